@@ -4,9 +4,25 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <regex.h>
 #include <curses.h>
 
+#define SIZE_WIDTH 6
+#define PATTERN_MAX 256
+#define PATH_SIZE_MIN 256
+
+#define PREVIEW_MAP_MAX 65536 /* Only the head of each file is mapped. */
+#define PREVIEW_CACHE_MAX 16
+#define PREVIEW_CACHE_BYTES (PREVIEW_MAP_MAX * 8)
+#define PREVIEW_DELAY 100 /* Milliseconds the cursor must rest. */
+
 typedef enum {
   FILE_NODE_TYPE_ROOT,
   FILE_NODE_TYPE_DIR,
@@ -14,22 +30,114 @@ typedef enum {
 } file_node_type_t;
 
 typedef struct file_node_s {
-  int marked;
+  unsigned int index; /* Position in the mark bitmap. */
   char *name;
   file_node_type_t type;
+  off_t size; /* Disk usage, directories are totals once summed. */
+  int sized;
   struct file_node_s *parent;
   unsigned int no_of_subnodes;
   struct file_node_s **subnode;
 } file_node_t;
 
+/* Grows as needed, so paths are never too long to build. */
+typedef struct file_node_path_s {
+  char *text;
+  int size;
+} file_node_path_t;
+
+typedef struct preview_entry_s {
+  int valid;
+  int error;
+  unsigned int index; /* Node index, as used by the mark bitmap. */
+  unsigned long used; /* Tick of last use, for LRU eviction. */
+  void *data;
+  size_t size;
+} preview_entry_t;
+
+typedef struct file_node_pattern_s {
+  int is_regex;
+  regex_t regex;
+  char *glob;
+} file_node_pattern_t;
+
 static int curses_scroll_offset  = 0;
 static int curses_selected_entry = 0;
 
+static int file_node_sort_by_size = 0;
+static int file_node_sort_pending = 0; /* Until the totals are known. */
+
+static unsigned char *file_node_marks = NULL;
+static unsigned char *file_node_written = NULL; /* Already in the output. */
+static unsigned int file_node_marks_bytes = 0;
+static unsigned int file_node_count = 0;
+
+static int preview_enabled = 0;
+static pthread_t preview_thread;
+static pthread_mutex_t preview_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t preview_cond = PTHREAD_COND_INITIALIZER;
+static preview_entry_t preview_cache[PREVIEW_CACHE_MAX];
+static unsigned long preview_tick = 0;
+static int preview_running = 0;
+static int preview_quit = 0;
+static int preview_wanted = 0;
+static unsigned int preview_wanted_index;
+static file_node_path_t preview_wanted_path = {NULL, 0};
+
+static pthread_t file_node_size_thread;
+static pthread_mutex_t file_node_size_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int file_node_size_running = 0;
+static int file_node_size_done = 0;
+static int file_node_size_quit = 0;
+static char *file_node_size_root_dir = NULL;
+
+static int file_node_is_marked(file_node_t *node)
+{
+  return (file_node_marks[node->index / 8] >> (node->index % 8)) & 1;
+}
+
+static void file_node_set_marked(file_node_t *node, int marked)
+{
+  if (marked) {
+    file_node_marks[node->index / 8] |= (1 << (node->index % 8));
+  } else {
+    file_node_marks[node->index / 8] &= ~(1 << (node->index % 8));
+  }
+}
+
+static int file_node_is_written(file_node_t *node)
+{
+  return (file_node_written[node->index / 8] >> (node->index % 8)) & 1;
+}
+
+static void file_node_set_written(file_node_t *node)
+{
+  file_node_written[node->index / 8] |= (1 << (node->index % 8));
+}
+
 static file_node_t *file_node_new(file_node_t *parent, char *name, file_node_type_t type)
 {
   int len;
+  unsigned int bytes;
+  unsigned char *marks;
   file_node_t *new;
 
+  /* Grow the mark bitmaps to cover the new node. */
+  if (file_node_count / 8 >= file_node_marks_bytes) {
+    bytes = (file_node_marks_bytes == 0) ? 1024 : file_node_marks_bytes * 2;
+    marks = realloc(file_node_marks, bytes);
+    if (marks == NULL)
+      return NULL;
+    memset(marks + file_node_marks_bytes, 0, bytes - file_node_marks_bytes);
+    file_node_marks = marks;
+    marks = realloc(file_node_written, bytes);
+    if (marks == NULL)
+      return NULL;
+    memset(marks + file_node_marks_bytes, 0, bytes - file_node_marks_bytes);
+    file_node_written = marks;
+    file_node_marks_bytes = bytes;
+  }
+
   new = (file_node_t *)malloc(sizeof(file_node_t));
   if (new == NULL)
     return NULL;
@@ -45,7 +153,9 @@ static file_node_t *file_node_new(file_node_t *parent, char *name, file_node_typ
   new->parent = parent;
   new->no_of_subnodes = 0;
   new->subnode = NULL;
-  new->marked = 0;
+  new->index = file_node_count++;
+  new->size = 0;
+  new->sized = 0; /* Until stat() by the size thread. */
   
   return new;
 }
@@ -116,37 +226,34 @@ static int file_node_list_size(file_node_t *node)
   return size;
 }
 
-static char *file_node_path(file_node_t *node, char *path, int path_len)
+static int file_node_compare(const void *p1, const void *p2)
 {
-  char temp[PATH_MAX];
-
-  strncpy(path, node->name, path_len);
-
-  node = node->parent;
-  while (node != NULL) {
-    if (node->type == FILE_NODE_TYPE_ROOT) {
-      break;
-    }
-    strncpy(temp, path, PATH_MAX);
-    snprintf(path, path_len, "%s/%s", node->name, temp);
-    node = node->parent;
-  }
-
-  return path;
+  file_node_t *p1p, *p2p;
+  p1p = *((file_node_t **)p1);
+  p2p = *((file_node_t **)p2);
+  return strcmp(((file_node_t *)p1p)->name, ((file_node_t *)p2p)->name);
 }
 
-static int file_node_compare(const void *p1, const void *p2)
+static int file_node_compare_size(const void *p1, const void *p2)
 {
   file_node_t *p1p, *p2p;
   p1p = *((file_node_t **)p1);
   p2p = *((file_node_t **)p2);
-  return strcmp(((file_node_t *)p1p)->name, ((file_node_t *)p2p)->name);
+  if (p1p->size > p2p->size)
+    return -1;
+  if (p1p->size < p2p->size)
+    return 1;
+  return strcmp(p1p->name, p2p->name);
 }
 
 static void file_node_sort(file_node_t *node)
 {
   int i;
-  qsort(node->subnode, node->no_of_subnodes, sizeof(file_node_t *), file_node_compare);
+  if (file_node_sort_by_size) {
+    qsort(node->subnode, node->no_of_subnodes, sizeof(file_node_t *), file_node_compare_size);
+  } else {
+    qsort(node->subnode, node->no_of_subnodes, sizeof(file_node_t *), file_node_compare);
+  }
   for (i = 0; i < node->no_of_subnodes; i++) {
     file_node_sort(node->subnode[i]);
   }
@@ -175,31 +282,190 @@ static void file_node_dump(file_node_t *node)
   }
 }
 
-static void file_node_print_marked(file_node_t *node, char *root_dir, FILE *fh)
+static int file_node_path_reserve(file_node_path_t *path, int len)
 {
-  int i;
-  char path[PATH_MAX];
+  char *text;
+  int size;
+
+  if (len < path->size)
+    return 0;
+
+  size = (path->size == 0) ? PATH_SIZE_MIN : path->size;
+  while (size <= len)
+    size *= 2;
+  text = realloc(path->text, size);
+  if (text == NULL)
+    return -1;
+
+  path->text = text;
+  path->size = size;
+  return 0;
+}
+
+static int file_node_path_set(file_node_path_t *path, char *text)
+{
+  int len;
+
+  len = strlen(text);
+  if (file_node_path_reserve(path, len) != 0)
+    return -1;
+  memcpy(path->text, text, len + 1);
+
+  return len;
+}
+
+/* Append the node name to a path prefix built by the caller, so each path
+   is written once per tree level instead of once per file. */
+static int file_node_path_append(char *name, file_node_path_t *path,
+  int path_len)
+{
+  int len;
+
+  len = strlen(name);
+  if (file_node_path_reserve(path, path_len + len + 1) != 0)
+    return -1;
+
+  if (path_len > 0)
+    path->text[path_len++] = '/';
+  memcpy(&path->text[path_len], name, len + 1);
+
+  return path_len + len;
+}
+
+static int file_node_path_build(file_node_t *node, file_node_path_t *path)
+{
+  int len;
+
+  /* The caller places the root directory in the buffer. */
+  if (node->type == FILE_NODE_TYPE_ROOT)
+    return strlen(path->text);
+
+  len = file_node_path_build(node->parent, path);
+  if (len == -1)
+    return -1;
+
+  return file_node_path_append(node->name, path, len);
+}
+
+/* Write the marked files not written before, so each is written once.
+   Returns the number of files that could not be, for lack of memory. */
+static int file_node_print_marked(file_node_t *node, file_node_path_t *path,
+  int path_len, char delimiter, FILE *fh)
+{
+  int i, len, failed;
+  file_node_t *subnode;
+
+  failed = 0;
+  for (i = 0; i < node->no_of_subnodes; i++) {
+    subnode = node->subnode[i];
+    if (subnode->type == FILE_NODE_TYPE_FILE &&
+        (! file_node_is_marked(subnode) || file_node_is_written(subnode)))
+      continue;
+
+    len = file_node_path_append(subnode->name, path, path_len);
+    if (len == -1) {
+      failed += (subnode->type == FILE_NODE_TYPE_FILE) ? 1 : 0;
+      continue;
+    }
+
+    if (subnode->type == FILE_NODE_TYPE_FILE) {
+      fwrite(path->text, 1, len, fh);
+      fputc(delimiter, fh);
+      file_node_set_written(subnode);
+    } else {
+      failed += file_node_print_marked(subnode, path, len, delimiter, fh);
+    }
+  }
+  path->text[path_len] = '\0';
+
+  return failed;
+}
+
+/* Returns the number of marked files not written, or -1 for all of them. */
+static int file_node_write_marked(file_node_t *node, char *root_dir,
+  char delimiter, FILE *fh)
+{
+  file_node_path_t path = {NULL, 0};
+  int len, failed;
+
+  len = file_node_path_set(&path, root_dir);
+  failed = (len == -1) ? -1 : file_node_print_marked(node, &path, len,
+    delimiter, fh);
+  free(path.text);
+  fflush(fh);
 
-  if (node->marked) {
-    fprintf(fh, "%s/%s\n", root_dir, file_node_path(node, path, PATH_MAX));
+  return failed;
+}
+
+static int file_node_pattern_init(file_node_pattern_t *pattern, char *text)
+{
+  /* A "re:" prefix selects POSIX extended regex, otherwise glob. */
+  if (strncmp(text, "re:", 3) == 0) {
+    pattern->is_regex = 1;
+    pattern->glob = NULL;
+    if (regcomp(&pattern->regex, text + 3, REG_EXTENDED | REG_NOSUB) != 0)
+      return -1;
+  } else {
+    pattern->is_regex = 0;
+    pattern->glob = text;
   }
+  return 0;
+}
 
+static void file_node_pattern_free(file_node_pattern_t *pattern)
+{
+  if (pattern->is_regex)
+    regfree(&pattern->regex);
+}
+
+static int file_node_pattern_match(file_node_pattern_t *pattern, char *path)
+{
+  if (pattern->is_regex) {
+    return regexec(&pattern->regex, path, 0, NULL, 0) == 0;
+  } else {
+    return fnmatch(pattern->glob, path, 0) == 0;
+  }
+}
+
+static int file_node_mark_pattern(file_node_t *node, file_node_path_t *path,
+  int path_len, file_node_pattern_t *pattern, int marked)
+{
+  int i, len, count;
+  file_node_t *subnode;
+
+  count = 0;
   for (i = 0; i < node->no_of_subnodes; i++) {
-    file_node_print_marked(node->subnode[i], root_dir, fh);
+    subnode = node->subnode[i];
+    len = file_node_path_append(subnode->name, path, path_len);
+    if (len == -1)
+      continue;
+
+    if (subnode->type == FILE_NODE_TYPE_FILE) {
+      if (file_node_pattern_match(pattern, path->text)) {
+        file_node_set_marked(subnode, marked);
+        count++;
+      }
+    } else {
+      count += file_node_mark_pattern(subnode, path, len, pattern, marked);
+    }
   }
+  path->text[path_len] = '\0';
+
+  return count;
 }
 
-static int file_node_scan(file_node_t *current, char *path)
+static int file_node_scan(file_node_t *current, file_node_path_t *path,
+  int path_len)
 {
   DIR *dh;
   struct dirent *entry;
   struct stat st;
-  char fullpath[PATH_MAX];
   file_node_t *subnode;
+  int len, type;
 
-  dh = opendir(path);
+  dh = opendir(path->text);
   if (dh == NULL) {
-    fprintf(stderr, "Error: Unable to open directory: %s\n", path);
+    fprintf(stderr, "Error: Unable to open directory: %s\n", path->text);
     return -1;
   }
 
@@ -207,25 +473,353 @@ static int file_node_scan(file_node_t *current, char *path)
     if (entry->d_name[0] == '.')
       continue; /* Ignore files with leading dot. */
 
-    snprintf(fullpath, PATH_MAX, "%s/%s", path, entry->d_name);
-    if (stat(fullpath, &st) == -1) {
-      fprintf(stderr, "Warning: Unable to stat() path: %s\n", fullpath);
+    len = file_node_path_append(entry->d_name, path, path_len);
+    if (len == -1)
       continue;
+
+    /* The directory entry tells the type, so only links and file systems
+       that leave it out need a stat() here. Sizes are left to the size
+       thread. */
+    type = entry->d_type;
+    if (type != DT_DIR && type != DT_REG) {
+      if (stat(path->text, &st) == -1) {
+        fprintf(stderr, "Warning: Unable to stat() path: %s\n", path->text);
+        continue;
+      }
+      if (S_ISDIR(st.st_mode))
+        type = DT_DIR;
+      else if (S_ISREG(st.st_mode))
+        type = DT_REG;
     }
 
-    if (S_ISDIR(st.st_mode)) {
+    if (type == DT_DIR) {
       subnode = file_node_add(current, entry->d_name, FILE_NODE_TYPE_DIR);
-      file_node_scan(subnode, fullpath);
+      if (subnode != NULL)
+        file_node_scan(subnode, path, len);
 
-    } else if (S_ISREG(st.st_mode)) {
+    } else if (type == DT_REG) {
       file_node_add(current, entry->d_name, FILE_NODE_TYPE_FILE);
     }
   }
+  path->text[path_len] = '\0';
 
   closedir(dh);
   return 0;
 }
 
+static int file_node_size_quitting(void)
+{
+  int quit;
+
+  pthread_mutex_lock(&file_node_size_mutex);
+  quit = file_node_size_quit;
+  pthread_mutex_unlock(&file_node_size_mutex);
+
+  return quit;
+}
+
+static off_t file_node_size_sum(file_node_t *node, file_node_path_t *path,
+  int path_len)
+{
+  struct stat st;
+  off_t total;
+  int i, len;
+
+  /* Count allocated blocks like du does, the directory itself included. */
+  total = 0;
+  if (node->type != FILE_NODE_TYPE_ROOT && stat(path->text, &st) == 0)
+    total = (off_t)st.st_blocks * 512;
+
+  for (i = 0; i < node->no_of_subnodes && ! file_node_size_quitting(); i++) {
+    len = file_node_path_append(node->subnode[i]->name, path, path_len);
+    if (len != -1)
+      total += file_node_size_sum(node->subnode[i], path, len);
+  }
+  path->text[path_len] = '\0';
+
+  /* Publish each file and directory as soon as its size is known. */
+  pthread_mutex_lock(&file_node_size_mutex);
+  node->size = total;
+  node->sized = 1;
+  pthread_mutex_unlock(&file_node_size_mutex);
+
+  return total;
+}
+
+static void *file_node_size_thread_main(void *arg)
+{
+  file_node_path_t path = {NULL, 0};
+  int len;
+
+  len = file_node_path_set(&path, file_node_size_root_dir);
+  if (len != -1)
+    file_node_size_sum((file_node_t *)arg, &path, len);
+  free(path.text);
+
+  pthread_mutex_lock(&file_node_size_mutex);
+  file_node_size_done = 1;
+  pthread_mutex_unlock(&file_node_size_mutex);
+
+  return NULL;
+}
+
+static int file_node_size_start(file_node_t *root, char *root_dir)
+{
+  file_node_size_root_dir = root_dir;
+  if (pthread_create(&file_node_size_thread, NULL,
+    file_node_size_thread_main, root) != 0) {
+    /* Fall back to summing in the foreground. */
+    file_node_size_thread_main(root);
+    return -1;
+  }
+
+  file_node_size_running = 1;
+  return 0;
+}
+
+static void file_node_size_wait(void)
+{
+  if (file_node_size_running) {
+    pthread_join(file_node_size_thread, NULL);
+    file_node_size_running = 0;
+  }
+}
+
+/* Stop summing early, so quitting does not wait on the whole tree. */
+static void file_node_size_stop(void)
+{
+  pthread_mutex_lock(&file_node_size_mutex);
+  file_node_size_quit = 1;
+  pthread_mutex_unlock(&file_node_size_mutex);
+  file_node_size_wait();
+}
+
+static int file_node_size_is_done(void)
+{
+  int done;
+
+  pthread_mutex_lock(&file_node_size_mutex);
+  done = file_node_size_done;
+  pthread_mutex_unlock(&file_node_size_mutex);
+
+  return done;
+}
+
+static char *file_node_size_format(off_t size, char *buf, int buf_len)
+{
+  char *unit = "BKMGTP";
+  double value;
+
+  value = size;
+  while (value >= 1024.0 && unit[1] != '\0') {
+    value /= 1024.0;
+    unit++;
+  }
+
+  if (*unit == 'B') {
+    snprintf(buf, buf_len, "%d", (int)value);
+  } else if (value < 10.0) {
+    snprintf(buf, buf_len, "%.1f%c", value, *unit);
+  } else {
+    snprintf(buf, buf_len, "%d%c", (int)value, *unit);
+  }
+
+  return buf;
+}
+
+/* Must be called with the preview mutex held. */
+static preview_entry_t *preview_cache_find(unsigned int index)
+{
+  int i;
+
+  for (i = 0; i < PREVIEW_CACHE_MAX; i++) {
+    if (preview_cache[i].valid && preview_cache[i].index == index) {
+      preview_cache[i].used = ++preview_tick;
+      return &preview_cache[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void preview_cache_evict(preview_entry_t *entry)
+{
+  if (entry->data != NULL)
+    munmap(entry->data, entry->size);
+  entry->data = NULL;
+  entry->valid = 0;
+}
+
+/* Must be called with the preview mutex held. */
+static void preview_cache_insert(unsigned int index, void *data, size_t size, int error)
+{
+  int i, lru;
+  size_t total;
+  preview_entry_t *entry;
+
+  /* Drop least recently used mappings until the new one fits. */
+  while (1) {
+    total = size;
+    lru = -1;
+    entry = NULL;
+    for (i = 0; i < PREVIEW_CACHE_MAX; i++) {
+      if (! preview_cache[i].valid) {
+        if (entry == NULL)
+          entry = &preview_cache[i];
+        continue;
+      }
+      total += preview_cache[i].size;
+      if (lru == -1 || preview_cache[i].used < preview_cache[lru].used)
+        lru = i;
+    }
+
+    if (lru == -1)
+      break;
+    if (entry != NULL && total <= PREVIEW_CACHE_BYTES)
+      break;
+    preview_cache_evict(&preview_cache[lru]);
+  }
+
+  entry->valid = 1;
+  entry->error = error;
+  entry->index = index;
+  entry->used = ++preview_tick;
+  entry->data = data;
+  entry->size = size;
+}
+
+static int preview_load(char *path, void **data, size_t *size)
+{
+  int fd;
+  struct stat st;
+
+  *data = NULL;
+  *size = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  /* Populated here, so drawing never waits on the disk. */
+  *size = (st.st_size > PREVIEW_MAP_MAX) ? PREVIEW_MAP_MAX : st.st_size;
+  *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (*data == MAP_FAILED) {
+    *data = NULL;
+    *size = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void *preview_thread_main(void *arg)
+{
+  unsigned int index;
+  char *path;
+  void *data;
+  size_t size;
+  int error;
+
+  pthread_mutex_lock(&preview_mutex);
+  while (1) {
+    while (! preview_wanted && ! preview_quit)
+      pthread_cond_wait(&preview_cond, &preview_mutex);
+    if (preview_quit)
+      break;
+
+    preview_wanted = 0;
+    index = preview_wanted_index;
+    if (preview_cache_find(index) != NULL)
+      continue;
+    path = strdup(preview_wanted_path.text);
+
+    pthread_mutex_unlock(&preview_mutex);
+    if (path != NULL) {
+      error = preview_load(path, &data, &size);
+      free(path);
+    } else {
+      data = NULL;
+      size = 0;
+      error = -1;
+    }
+    pthread_mutex_lock(&preview_mutex);
+
+    preview_cache_insert(index, data, size, error);
+  }
+  pthread_mutex_unlock(&preview_mutex);
+
+  return NULL;
+}
+
+static int preview_start(void)
+{
+  if (preview_running)
+    return 0;
+
+  if (pthread_create(&preview_thread, NULL, preview_thread_main, NULL) != 0)
+    return -1;
+
+  preview_running = 1;
+  return 0;
+}
+
+static void preview_stop(void)
+{
+  int i;
+
+  if (preview_running) {
+    pthread_mutex_lock(&preview_mutex);
+    preview_quit = 1;
+    pthread_cond_signal(&preview_cond);
+    pthread_mutex_unlock(&preview_mutex);
+    pthread_join(preview_thread, NULL);
+    preview_running = 0;
+  }
+
+  for (i = 0; i < PREVIEW_CACHE_MAX; i++) {
+    if (preview_cache[i].valid)
+      preview_cache_evict(&preview_cache[i]);
+  }
+}
+
+/* Returns non-zero if the preview for the node is not loaded yet. */
+static int preview_pending(file_node_t *node)
+{
+  int pending;
+
+  if (node == NULL || node->type != FILE_NODE_TYPE_FILE)
+    return 0;
+
+  pthread_mutex_lock(&preview_mutex);
+  pending = (preview_cache_find(node->index) == NULL);
+  pthread_mutex_unlock(&preview_mutex);
+
+  return pending;
+}
+
+static void preview_request(file_node_t *node, char *root_dir)
+{
+  pthread_mutex_lock(&preview_mutex);
+  if (file_node_path_set(&preview_wanted_path, root_dir) != -1 &&
+      file_node_path_build(node, &preview_wanted_path) != -1) {
+    preview_wanted_index = node->index;
+    preview_wanted = 1;
+    pthread_cond_signal(&preview_cond);
+  }
+  pthread_mutex_unlock(&preview_mutex);
+}
+
 static file_node_t *file_node_get_by_node_no(file_node_t *node, int node_no, int *node_count)
 {
   file_node_t *found;
@@ -262,17 +856,60 @@ static void file_node_mark(file_node_t *node, int node_no)
   if (found->type != FILE_NODE_TYPE_FILE)
     return; /* Only files, not directories, can be marked. */
 
-  if (found->marked == 0) {
-    found->marked = 1;
+  file_node_set_marked(found, ! file_node_is_marked(found));
+}
+
+static int curses_list_width(int maxx)
+{
+  if (preview_enabled)
+    return maxx / 2;
+  return maxx;
+}
+
+static void curses_preview_draw(file_node_t *node, int start_x)
+{
+  int maxy, maxx, y, x;
+  size_t i;
+  unsigned char c;
+  preview_entry_t *entry;
+
+  getmaxyx(stdscr, maxy, maxx);
+  if (node == NULL || node->type != FILE_NODE_TYPE_FILE)
+    return;
+
+  pthread_mutex_lock(&preview_mutex);
+  entry = preview_cache_find(node->index);
+  if (entry == NULL) {
+    mvaddnstr(0, start_x, "Loading...", maxx - start_x);
+  } else if (entry->error) {
+    mvaddnstr(0, start_x, "(Unreadable)", maxx - start_x);
   } else {
-    found->marked = 0;
+    y = x = 0;
+    for (i = 0; i < entry->size && y < maxy; i++) {
+      c = ((unsigned char *)entry->data)[i];
+      if (c == '\n') {
+        y++;
+        x = 0;
+        continue;
+      }
+      if (x >= maxx - start_x)
+        continue; /* Long lines are cut, not wrapped. */
+      if (c == '\t')
+        c = ' ';
+      else if (! isprint(c))
+        c = '.';
+      mvaddch(y, start_x + x, c);
+      x++;
+    }
   }
+  pthread_mutex_unlock(&preview_mutex);
 }
 
 static void curses_list_draw(file_node_t *node, int line_no, int node_no, int selected)
 {
   int node_count, maxy, maxx, pos, depth;
   file_node_t *found;
+  char size[SIZE_WIDTH + 1];
 
   node_count = 0;
   found = file_node_get_by_node_no(node, node_no, &node_count);
@@ -280,6 +917,7 @@ static void curses_list_draw(file_node_t *node, int line_no, int node_no, int se
     return;
 
   getmaxyx(stdscr, maxy, maxx);
+  maxx = curses_list_width(maxx);
 
   if (selected)
     attron(A_REVERSE);
@@ -299,11 +937,11 @@ static void curses_list_draw(file_node_t *node, int line_no, int node_no, int se
     }
 
     /* File/directory name. */
-    if (found->marked)
+    if (file_node_is_marked(found))
       attron(A_BOLD);
     mvaddstr(line_no, pos, found->name);
     pos += strlen(found->name);
-    if (found->marked)
+    if (file_node_is_marked(found))
       attroff(A_BOLD);
 
     /* Slash for directory. */
@@ -313,6 +951,14 @@ static void curses_list_draw(file_node_t *node, int line_no, int node_no, int se
     /* Padding. */
     for (; pos < maxx - 2; pos++)
       mvaddch(line_no, pos, ' ');
+
+    /* Size, or placeholder until the directory total is known. */
+    if (found->sized) {
+      file_node_size_format(found->size, size, sizeof(size));
+    } else {
+      strncpy(size, "...", sizeof(size));
+    }
+    mvprintw(line_no, maxx - 3 - SIZE_WIDTH, "%*s", SIZE_WIDTH, size);
   }
 
   if (selected)
@@ -321,16 +967,25 @@ static void curses_list_draw(file_node_t *node, int line_no, int node_no, int se
 
 static void curses_update_screen(file_node_t *node)
 {
-  int n, i, maxy, maxx;
+  int n, i, maxy, maxx, node_count;
   int scrollbar_size, scrollbar_pos;
   int list_size;
   
   list_size = file_node_list_size(node);
   
   getmaxyx(stdscr, maxy, maxx);
+  maxx = curses_list_width(maxx);
   erase();
+
+  /* Draw preview pane, from the cache only. */
+  if (preview_enabled) {
+    node_count = 0;
+    curses_preview_draw(file_node_get_by_node_no(node,
+      curses_selected_entry + 1, &node_count), maxx + 1);
+  }
   
   /* Draw text lines. */
+  pthread_mutex_lock(&file_node_size_mutex);
   for (n = 0; n < maxy; n++) { 
     if ((n + curses_scroll_offset) >= list_size)
       break;
@@ -341,6 +996,7 @@ static void curses_update_screen(file_node_t *node)
       curses_list_draw(node, n, n + curses_scroll_offset + 1, 0);
     }
   }
+  pthread_mutex_unlock(&file_node_size_mutex);
   
   /* Draw scrollbar. */
   if (list_size <= maxy)
@@ -355,6 +1011,12 @@ static void curses_update_screen(file_node_t *node)
   attroff(A_REVERSE);
   
   mvvline(0, maxx - 2, 0, maxy);
+
+  if (file_node_sort_pending) {
+    attron(A_REVERSE);
+    mvaddnstr(maxy - 1, 0, "Sizing...", maxx - 2);
+    attroff(A_REVERSE);
+  }
   
   /* Place cursor at end of selected line. */ 
   move(curses_selected_entry - curses_scroll_offset, maxx - 3);
@@ -373,9 +1035,53 @@ static void curses_winch_handler(file_node_t *node)
   keypad(stdscr, TRUE);
 }
 
-static void file_node_curses_loop(file_node_t *node)
+static int curses_prompt(char *prompt, char *buf, int buf_len)
+{
+  int maxy, maxx, result;
+
+  getmaxyx(stdscr, maxy, maxx);
+  move(maxy - 1, 0);
+  clrtoeol();
+  mvaddnstr(maxy - 1, 0, prompt, maxx - 1);
+
+  timeout(-1);
+  echo();
+  result = getnstr(buf, buf_len - 1);
+  noecho();
+
+  if (result == ERR || buf[0] == '\0')
+    return -1;
+  return 0;
+}
+
+static void curses_mark_pattern(file_node_t *node, int marked)
 {
-  int c, maxy, maxx, list_size;
+  char text[PATTERN_MAX];
+  file_node_path_t path = {NULL, 0};
+  file_node_pattern_t pattern;
+  int len;
+
+  if (curses_prompt(marked ? "Mark: " : "Unmark: ", text, PATTERN_MAX) != 0)
+    return;
+
+  if (file_node_pattern_init(&pattern, text) != 0) {
+    flash();
+    return;
+  }
+
+  /* Patterns match paths below the root directory. */
+  len = file_node_path_set(&path, "");
+  if (len != -1)
+    file_node_mark_pattern(node, &path, len, &pattern, marked);
+  free(path.text);
+  file_node_pattern_free(&pattern);
+}
+
+static void file_node_curses_loop(file_node_t *node, char *root_dir,
+  char delimiter, FILE *fh)
+{
+  int c, maxy, maxx, list_size, node_count;
+  file_node_t *selected;
 
   initscr();
   atexit(curses_exit_handler);
@@ -383,12 +1089,37 @@ static void file_node_curses_loop(file_node_t *node)
   keypad(stdscr, TRUE);
 
   while (1) {
+    /* Totals must be complete before the tree can be reordered. */
+    if (file_node_sort_pending && file_node_size_is_done()) {
+      file_node_size_wait();
+      file_node_sort(node);
+      file_node_sort_pending = 0;
+    }
+
     list_size = file_node_list_size(node);
     curses_update_screen(node);
     getmaxyx(stdscr, maxy, maxx);
+
+    node_count = 0;
+    selected = file_node_get_by_node_no(node, curses_selected_entry + 1, &node_count);
+
+    /* Poll for redraws while directory totals or a preview are pending. */
+    if (preview_enabled && preview_pending(selected)) {
+      timeout(PREVIEW_DELAY);
+    } else if (file_node_size_is_done()) {
+      timeout(-1);
+    } else {
+      timeout(100);
+    }
     c = getch();
 
     switch (c) {
+    case ERR:
+      /* Cursor has rested, so load the preview in the background. */
+      if (preview_enabled && preview_pending(selected))
+        preview_request(selected, root_dir);
+      break;
+
     case KEY_RESIZE:
       curses_winch_handler(node);
       break;
@@ -440,6 +1171,35 @@ static void file_node_curses_loop(file_node_t *node)
       }
       break;
 
+    case '+':
+      curses_mark_pattern(node, 1);
+      break;
+
+    case '-':
+      curses_mark_pattern(node, 0);
+      break;
+
+    case 'w':
+    case 'W':
+      /* Hand over what is marked so far, to a FIFO reader for instance.
+         The marks stay, and are not written again. */
+      if (file_node_write_marked(node, root_dir, delimiter, fh) != 0)
+        flash();
+      break;
+
+    case 'p':
+    case 'P':
+      if (preview_start() == 0)
+        preview_enabled = ! preview_enabled;
+      break;
+
+    case 's':
+    case 'S':
+      /* Sorted once the totals are known, without waiting for them. */
+      file_node_sort_by_size = !file_node_sort_by_size;
+      file_node_sort_pending = 1;
+      break;
+
     case '\e': /* Escape */
     case 'Q':
     case 'q':
@@ -452,21 +1212,43 @@ int main(int argc, char *argv[])
 {
   file_node_t *root;
   char *root_dir;
+  char delimiter;
+  file_node_path_t path = {NULL, 0};
+  struct stat st;
   FILE *fh;
+  int c, len;
+
+  delimiter = '\n';
+  while ((c = getopt(argc, argv, "0")) != -1) {
+    switch (c) {
+    case '0':
+      delimiter = '\0'; /* For use with "xargs -0". */
+      break;
+
+    default:
+      fprintf(stderr, "Usage: %s [-0] <output file> [directory]\n", argv[0]);
+      return 1;
+    }
+  }
 
-  if (argc < 2) {
-     fprintf(stderr, "Usage: %s <output file> [directory]\n", argv[0]);
+  if (argc - optind < 1) {
+     fprintf(stderr, "Usage: %s [-0] <output file> [directory]\n", argv[0]);
      return 1;
   }
 
-  fh = fopen(argv[1], "wx");
+  /* A FIFO that exists already is written to, so the output can stream. */
+  fh = fopen(argv[optind], "wx");
+  if (fh == NULL && errno == EEXIST && stat(argv[optind], &st) == 0 &&
+      S_ISFIFO(st.st_mode))
+    fh = fopen(argv[optind], "w");
   if (fh == NULL) {
-     fprintf(stderr, "Error: Cannot open file, or it exists already: %s\n", argv[1]);
+     fprintf(stderr, "Error: Cannot open file, or it exists already: %s\n", argv[optind]);
      return 1;
   }
+  setvbuf(fh, NULL, _IOFBF, 65536);
 
-  if (argc > 2) {
-    root_dir = argv[2];
+  if (argc - optind > 1) {
+    root_dir = argv[optind + 1];
   } else {
     root_dir = ".";
   }
@@ -477,23 +1259,33 @@ int main(int argc, char *argv[])
     return 1;
   }
 
-  if (file_node_scan(root, root_dir) != 0) {
+  len = file_node_path_set(&path, root_dir);
+  if (len == -1 || file_node_scan(root, &path, len) != 0) {
+    free(path.text);
     file_node_remove(root);
     fclose(fh);
     return 1;
   }
+  free(path.text);
 
   file_node_sort(root);
 
   if (isatty(STDOUT_FILENO)) {
-    file_node_curses_loop(root);
-    file_node_print_marked(root, root_dir, fh);
+    file_node_size_start(root, root_dir);
+    file_node_curses_loop(root, root_dir, delimiter, fh);
+    preview_stop();
+    if (file_node_write_marked(root, root_dir, delimiter, fh) != 0)
+      fprintf(stderr, "Error: Out of memory, not all marked files written.\n");
   } else {
     /* Mostly for debugging. */
     file_node_dump(root);
   }
 
+  file_node_size_stop();
   file_node_remove(root);
+  free(file_node_marks);
+  free(file_node_written);
+  free(preview_wanted_path.text);
   fclose(fh);
   return 0;
 }
@@ -0,0 +1,416 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "filter.h"
+
+#define FILTER_THREADS_MAX 16
+#define FILTER_CHUNK 4096 /* Entries scored at a time by one worker. */
+#define FILTER_RANK_STEP 256 /* Extra results ranked when more are needed. */
+
+/* Scoring, in the spirit of fzf: every matched character scores, more so
+   at the start of a word or right after another match, and gaps cost. */
+#define SCORE_MATCH 16
+#define SCORE_BOUNDARY 8
+#define SCORE_CAMEL 6
+#define SCORE_CONSECUTIVE 4
+#define SCORE_GAP_START 3
+#define SCORE_GAP_EXTEND 1
+
+typedef struct filter_match_s {
+  int score;
+  int index;
+} filter_match_t;
+
+/* Matches of a chunk, handed from a worker to the UI. Chunks are kept in
+   the order they were claimed, as lines may be added after the request. */
+typedef struct filter_chunk_s {
+  filter_match_t *match; /* NULL if out of memory. */
+  int size;
+  int scored;
+  int collected;
+} filter_chunk_t;
+
+static char *(*filter_line)(int no, int *len) = NULL;
+static pthread_t filter_thread[FILTER_THREADS_MAX];
+static int filter_threads = 0;
+
+/* Shared between the UI and the workers. */
+static pthread_mutex_t filter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t filter_cond = PTHREAD_COND_INITIALIZER;
+static char filter_pattern[FILTER_PATTERN_MAX];
+static unsigned int filter_generation = 0;
+static int filter_count = 0; /* Entries to score. */
+static int filter_next = 0; /* First entry of the next chunk to claim. */
+static filter_chunk_t *filter_chunk = NULL;
+static int filter_chunks = 0; /* Claimed. */
+static int filter_chunk_capacity = 0;
+static int filter_scored = 0; /* Chunks done. */
+static int filter_quit = 0;
+
+/* Only used by the UI. The first "filter_ranked" results are in order. */
+static filter_match_t *filter_result = NULL;
+static int filter_result_size = 0;
+static int filter_result_capacity = 0;
+static int filter_ranked = 0;
+static int filter_collected = 0;
+
+static int filter_boundary(char c)
+{
+  return c == '/' || c == '_' || c == '-' || c == ' ' || c == '.' ||
+    c == ':' || c == '\\' || c == '\t';
+}
+
+/* Returns the score of the text, or -1 if the pattern, which is in lower
+   case, is not a subsequence of it. The shortest match ending at the first
+   possible place is scored. */
+static int filter_score(const char *pattern, int pattern_len,
+  const char *text, int len)
+{
+  int i, j, start, end, score, gap, consecutive;
+
+  /* Find where the first match ends, then where it starts going back. */
+  for (i = 0, j = 0; i < len && j < pattern_len; i++) {
+    if (tolower((unsigned char)text[i]) == pattern[j])
+      j++;
+  }
+  if (j < pattern_len)
+    return -1;
+  end = i;
+  for (i = end - 1, j = pattern_len - 1; j >= 0; i--) {
+    if (tolower((unsigned char)text[i]) == pattern[j])
+      j--;
+  }
+  start = i + 1;
+
+  score = 0;
+  gap = 0;
+  consecutive = 0;
+  for (i = start, j = 0; i < end; i++) {
+    if (j < pattern_len && tolower((unsigned char)text[i]) == pattern[j]) {
+      score += SCORE_MATCH;
+      if (i == 0 || filter_boundary(text[i - 1]))
+        score += SCORE_BOUNDARY;
+      else if (islower((unsigned char)text[i - 1]) &&
+               isupper((unsigned char)text[i]))
+        score += SCORE_CAMEL;
+      if (consecutive)
+        score += SCORE_CONSECUTIVE;
+      consecutive = 1;
+      gap = 0;
+      j++;
+    } else {
+      score -= gap ? SCORE_GAP_EXTEND : SCORE_GAP_START;
+      consecutive = 0;
+      gap = 1;
+    }
+  }
+
+  return (score < 0) ? 0 : score;
+}
+
+static void *filter_worker(void *arg)
+{
+  char pattern[FILTER_PATTERN_MAX];
+  filter_match_t *match;
+  unsigned int generation;
+  int pattern_len, start, end, slot, n, i, len, score;
+  char *text;
+
+  pthread_mutex_lock(&filter_mutex);
+  while (1) {
+    while (filter_next >= filter_count && ! filter_quit)
+      pthread_cond_wait(&filter_cond, &filter_mutex);
+    if (filter_quit)
+      break;
+
+    start = filter_next;
+    end = start + FILTER_CHUNK;
+    if (end > filter_count)
+      end = filter_count;
+    filter_next = end;
+    slot = filter_chunks++;
+    generation = filter_generation;
+    strcpy(pattern, filter_pattern);
+    pthread_mutex_unlock(&filter_mutex);
+
+    pattern_len = strlen(pattern);
+    match = malloc(sizeof(filter_match_t) * (end - start));
+    n = 0;
+    for (i = start; i < end && match != NULL; i++) {
+      text = filter_line(i, &len);
+      score = filter_score(pattern, pattern_len, text, len);
+      if (score >= 0) {
+        match[n].score = score;
+        match[n].index = i;
+        n++;
+      }
+    }
+
+    /* Scored even without memory for the matches, or it never ends. */
+    pthread_mutex_lock(&filter_mutex);
+    if (generation == filter_generation) {
+      filter_chunk[slot].match = match;
+      filter_chunk[slot].size = (match != NULL) ? n : 0;
+      filter_chunk[slot].scored = 1;
+      filter_scored++;
+    } else {
+      free(match); /* Stale already. */
+    }
+  }
+  pthread_mutex_unlock(&filter_mutex);
+
+  return NULL;
+}
+
+/* Start a worker for each core, scoring lines from the callback. */
+int filter_start(char *(*line)(int no, int *len))
+{
+  sigset_t all, old;
+  long cores;
+
+  filter_line = line;
+  cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1)
+    cores = 1;
+  if (cores > FILTER_THREADS_MAX)
+    cores = FILTER_THREADS_MAX;
+
+  /* Signal handlers touch curses, so keep them on the main thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (filter_threads = 0; filter_threads < cores; filter_threads++) {
+    if (pthread_create(&filter_thread[filter_threads], NULL, filter_worker,
+        NULL) != 0)
+      break;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return (filter_threads > 0) ? 0 : -1;
+}
+
+static void filter_chunks_free(void)
+{
+  int i;
+
+  for (i = 0; i < filter_chunks; i++) {
+    if (! filter_chunk[i].collected)
+      free(filter_chunk[i].match);
+  }
+  free(filter_chunk);
+  filter_chunk = NULL;
+  filter_chunks = 0;
+  filter_chunk_capacity = 0;
+}
+
+/* Make room for the chunks left to claim up to "count" lines. Must be
+   called with the mutex held. */
+static int filter_chunks_reserve(int count)
+{
+  filter_chunk_t *grown;
+  int capacity;
+
+  capacity = filter_chunks + (count - filter_next + FILTER_CHUNK - 1) /
+    FILTER_CHUNK;
+  if (capacity <= filter_chunk_capacity)
+    return 0;
+  grown = realloc(filter_chunk, sizeof(filter_chunk_t) * capacity);
+  if (grown == NULL)
+    return -1;
+  memset(&grown[filter_chunk_capacity], 0,
+    sizeof(filter_chunk_t) * (capacity - filter_chunk_capacity));
+  filter_chunk = grown;
+  filter_chunk_capacity = capacity;
+  return 0;
+}
+
+/* Score the first "count" lines against the pattern in the background,
+   dropping what was scored for the previous one. */
+int filter_request(const char *pattern, int count)
+{
+  int i;
+
+  pthread_mutex_lock(&filter_mutex);
+  filter_chunks_free();
+  filter_next = 0;
+  if (filter_chunks_reserve(count) != 0) {
+    filter_count = 0;
+    pthread_mutex_unlock(&filter_mutex);
+    return -1;
+  }
+  filter_scored = 0;
+  filter_generation++;
+  for (i = 0; i < FILTER_PATTERN_MAX - 1 && pattern[i] != '\0'; i++)
+    filter_pattern[i] = tolower((unsigned char)pattern[i]);
+  filter_pattern[i] = '\0';
+  filter_count = count;
+  pthread_cond_broadcast(&filter_cond);
+  pthread_mutex_unlock(&filter_mutex);
+
+  filter_result_size = 0;
+  filter_ranked = 0;
+  filter_collected = 0;
+
+  return 0;
+}
+
+/* Score the lines added since the request too, up to "count". */
+int filter_extend(int count)
+{
+  int error;
+
+  pthread_mutex_lock(&filter_mutex);
+  error = filter_chunks_reserve(count);
+  if (error == 0 && count > filter_count) {
+    filter_count = count;
+    pthread_cond_broadcast(&filter_cond);
+  }
+  pthread_mutex_unlock(&filter_mutex);
+
+  return error;
+}
+
+/* Take the chunks scored since last time. Returns 1 if there were any, in
+   which case the results are ranked again as they are asked for. */
+int filter_poll(void)
+{
+  filter_match_t *grown;
+  int i, added, capacity;
+
+  pthread_mutex_lock(&filter_mutex);
+  added = 0;
+  for (i = 0; i < filter_chunks && filter_collected < filter_scored; i++) {
+    if (! filter_chunk[i].scored || filter_chunk[i].collected)
+      continue;
+
+    if (filter_result_size + filter_chunk[i].size > filter_result_capacity) {
+      capacity = filter_result_capacity * 2;
+      if (capacity < filter_result_size + filter_chunk[i].size)
+        capacity = filter_result_size + filter_chunk[i].size;
+      grown = realloc(filter_result, sizeof(filter_match_t) * capacity);
+      if (grown == NULL)
+        break;
+      filter_result = grown;
+      filter_result_capacity = capacity;
+    }
+    memcpy(&filter_result[filter_result_size], filter_chunk[i].match,
+      sizeof(filter_match_t) * filter_chunk[i].size);
+    filter_result_size += filter_chunk[i].size;
+    free(filter_chunk[i].match);
+    filter_chunk[i].collected = 1;
+    filter_collected++;
+    added = 1;
+  }
+  pthread_mutex_unlock(&filter_mutex);
+
+  if (added)
+    filter_ranked = 0;
+  return added;
+}
+
+/* Returns 1 until every line has been scored and every chunk taken. */
+int filter_busy(void)
+{
+  int busy;
+
+  pthread_mutex_lock(&filter_mutex);
+  busy = (filter_next < filter_count || filter_collected < filter_chunks);
+  pthread_mutex_unlock(&filter_mutex);
+
+  return busy;
+}
+
+int filter_size(void)
+{
+  return filter_result_size;
+}
+
+/* Best first, and in the original order when scored the same. */
+static int filter_before(const filter_match_t *a, const filter_match_t *b)
+{
+  return a->score > b->score || (a->score == b->score && a->index < b->index);
+}
+
+static int filter_compare(const void *p1, const void *p2)
+{
+  return filter_before(p2, p1) - filter_before(p1, p2);
+}
+
+/* Move the "n" best results of the range to its start, in any order. */
+static void filter_select(filter_match_t *match, int size, int n)
+{
+  filter_match_t pivot, temp;
+  int low, high, i, j;
+
+  low = 0;
+  high = size - 1;
+  while (low < high) {
+    pivot = match[low + (high - low) / 2];
+    i = low;
+    j = high;
+    while (i <= j) {
+      while (filter_before(&match[i], &pivot))
+        i++;
+      while (filter_before(&pivot, &match[j]))
+        j--;
+      if (i <= j) {
+        temp = match[i];
+        match[i] = match[j];
+        match[j] = temp;
+        i++;
+        j--;
+      }
+    }
+    if (n - 1 <= j)
+      high = j;
+    else if (n - 1 >= i)
+      low = i;
+    else
+      break;
+  }
+}
+
+/* Returns the line of the result at the position, ranking only as far as
+   needed, so the visible rows are ready long before the rest would be. */
+int filter_get(int no)
+{
+  int want;
+
+  if (no < 0 || no >= filter_result_size)
+    return -1;
+
+  if (no >= filter_ranked) {
+    want = no + 1;
+    if (want < filter_ranked + FILTER_RANK_STEP)
+      want = filter_ranked + FILTER_RANK_STEP;
+    if (want > filter_result_size)
+      want = filter_result_size;
+    filter_select(&filter_result[filter_ranked],
+      filter_result_size - filter_ranked, want - filter_ranked);
+    qsort(&filter_result[filter_ranked], want - filter_ranked,
+      sizeof(filter_match_t), filter_compare);
+    filter_ranked = want;
+  }
+
+  return filter_result[no].index;
+}
+
+void filter_stop(void)
+{
+  int i;
+
+  pthread_mutex_lock(&filter_mutex);
+  filter_quit = 1;
+  pthread_cond_broadcast(&filter_cond);
+  pthread_mutex_unlock(&filter_mutex);
+  for (i = 0; i < filter_threads; i++)
+    pthread_join(filter_thread[i], NULL);
+  filter_threads = 0;
+
+  filter_chunks_free();
+  free(filter_result);
+  filter_result = NULL;
+  filter_result_size = filter_result_capacity = 0;
+}
@@ -0,0 +1,15 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#define FILTER_PATTERN_MAX 256
+
+int filter_start(char *(*line)(int no, int *len));
+int filter_request(const char *pattern, int count);
+int filter_extend(int count);
+int filter_poll(void);
+int filter_busy(void);
+int filter_size(void);
+int filter_get(int no);
+void filter_stop(void);
+
+#endif /* _FILTER_H */
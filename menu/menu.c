@@ -1,62 +1,209 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <ncurses.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "filter.h"
+#include "stream.h"
 
-#define ENTRY_LIMIT 255 /* Same as limit for exit code. */
-#define TEXT_LIMIT 128
+#define EXIT_CODE_LIMIT 255 /* Selections from here on only go to stdout. */
+#define REDRAW_TICK 20 /* Milliseconds between redraws while busy. */
 
-static char list[ENTRY_LIMIT][TEXT_LIMIT];
+/* The whole input, mapped or streamed, and where each line starts in it.
+   The last offset is one past the end of the last line and its newline. */
+static char *text = NULL;
+static size_t text_size = 0;
+static int text_mapped = 0;
+static int text_streamed = 0;
+static size_t *list = NULL;
 static int list_size      = 0;
 static int scroll_offset  = 0;
 static int selected_entry = 0;
+static char filter_text[FILTER_PATTERN_MAX] = {'\0'};
+
+/* Returns the line, which is not terminated, and its length. */
+static char *list_get(int no, int *len)
+{
+  size_t end;
+
+  end = list[no + 1] - 1; /* Newline, or one past the end of the text. */
+  if (end > list[no] && text[end - 1] == '\r')
+    end--;
+  *len = end - list[no];
+  return &text[list[no]];
+}
+
+/* Find where the lines start, counting them first to allocate once. */
+static int list_index(void)
+{
+  char *p, *end, *newline;
+  int n;
+
+  end = text + text_size;
+  list_size = 0;
+  for (p = text; p < end; p = newline + 1) {
+    newline = memchr(p, '\n', end - p);
+    if (newline == NULL)
+      newline = end;
+    list_size++;
+  }
+
+  list = malloc(sizeof(size_t) * (list_size + 1));
+  if (list == NULL)
+    return -1;
+
+  n = 0;
+  for (p = text; p < end; p = newline + 1) {
+    newline = memchr(p, '\n', end - p);
+    if (newline == NULL)
+      newline = end;
+    list[n++] = p - text;
+  }
+  list[n] = p - text; /* As if the last line had a newline too. */
+
+  return 0;
+}
+
+/* Map the file if possible, otherwise read it in the background, so the
+   menu is usable while a slow producer is still writing lines. Pipes and
+   the like have to be read, and "-" is standard input. */
+static int text_load(char *path)
+{
+  struct stat st;
+  int fd;
+
+  if (strcmp(path, "-") == 0)
+    fd = STDIN_FILENO;
+  else
+    fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text != MAP_FAILED) {
+      text_size = st.st_size;
+      text_mapped = 1;
+      close(fd);
+      return list_index();
+    }
+    text = NULL;
+  }
+
+  if (stream_start(fd, &text, &list) != 0) {
+    close(fd);
+    return -1;
+  }
+  text_streamed = 1;
+  return 0;
+}
+
+/* Take the lines read since last time. Returns 1 if there were any. */
+static int text_poll(void)
+{
+  int size;
+
+  if (! text_streamed)
+    return 0;
+  size = stream_poll();
+  if (size == list_size)
+    return 0;
+  list_size = size;
+  if (filter_text[0] != '\0')
+    filter_extend(list_size);
+  return 1;
+}
+
+/* The lines shown, all of them or the filter results, best first. */
+static int view_size(void)
+{
+  return (filter_text[0] == '\0') ? list_size : filter_size();
+}
+
+static int view_get(int no)
+{
+  return (filter_text[0] == '\0') ? no : filter_get(no);
+}
 
 static void update_screen(void)
 {
-  int n, i, maxy, maxx;
+  int n, i, maxy, maxx, len, size;
   int scrollbar_size, scrollbar_pos;
+  char *line, count[32];
 
   getmaxyx(stdscr, maxy, maxx);
+  maxy--; /* Filter input goes last. */
+  size = view_size();
   erase();
 
-  /* Draw text lines. */
+  /* Draw text lines, cut to leave room for the scrollbar. */
   for (n = 0; n < maxy; n++) {
-    if ((n + scroll_offset) >= list_size)
+    if ((n + scroll_offset) >= size)
       break;
 
+    line = list_get(view_get(n + scroll_offset), &len);
+    if (len > maxx - 2)
+      len = maxx - 2;
     if (n == (selected_entry - scroll_offset)) {
       attron(A_REVERSE);
-      mvaddstr(n, 0, list[n + scroll_offset]);
-      for (i = strlen(list[n + scroll_offset]); i < maxx - 2; i++)
+      mvaddnstr(n, 0, line, len);
+      for (i = len; i < maxx - 2; i++)
         mvaddch(n, i, ' ');
       attroff(A_REVERSE);
     } else {
-      mvaddstr(n, 0, list[n + scroll_offset]);
+      mvaddnstr(n, 0, line, len);
     }
   }
 
   /* Draw scrollbar. */
-  if (list_size <= maxy)
-    scrollbar_size = maxy;
+  if (size <= maxy)
+    scrollbar_size = maxy - 1;
   else
-    scrollbar_size = maxy / (list_size / (double)maxy);
+    scrollbar_size = maxy / (size / (double)maxy);
 
-  scrollbar_pos = selected_entry / (double)list_size * (maxy - scrollbar_size);
+  scrollbar_pos = (size > 0) ?
+    selected_entry / (double)size * (maxy - scrollbar_size) : 0;
   attron(A_REVERSE);
-  for (i = 0; i <= scrollbar_size; i++)
+  for (i = 0; i <= scrollbar_size && i + scrollbar_pos < maxy; i++)
     mvaddch(i + scrollbar_pos, maxx - 1, ' ');
   attroff(A_REVERSE);
 
   mvvline(0, maxx - 2, 0, maxy);
 
-  /* Place cursor at end of selected line. */
-  move(selected_entry - scroll_offset, maxx - 3);
+  /* Draw filter input, with the number of matches while filtering and the
+     number of lines while they are read. */
+  mvprintw(maxy, 0, "> %s", filter_text);
+  count[0] = '\0';
+  if (filter_text[0] != '\0')
+    snprintf(count, sizeof(count), " %d/%d%s", size, list_size,
+      (filter_busy() || (text_streamed && stream_busy())) ? "..." : "");
+  else if (text_streamed && stream_busy())
+    snprintf(count, sizeof(count), " %d...", list_size);
+  if (count[0] != '\0' &&
+      (int)strlen(count) + 2 + (int)strlen(filter_text) < maxx)
+    mvaddstr(maxy, maxx - strlen(count), count);
+
+  /* Place cursor at end of filter input. */
+  move(maxy, 2 + strlen(filter_text));
 }
 
 static void exit_handler(void)
 {
   endwin();
+  filter_stop(); /* Before the lines go away. */
+  if (text_streamed) {
+    stream_stop();
+    return;
+  }
+  if (text_mapped)
+    munmap(text, text_size);
+  free(list);
 }
 
 static void winch_handler(void)
@@ -72,47 +219,101 @@ static void interrupt_handler(int signo)
   exit(0); /* Exit with code 0, always. */
 }
 
+/* Write the selection to stdout, as the index (counting from 1, like the
+   exit code), the text, or both separated by a tab. */
+static void print_selection(int no, int print_index, int print_text)
+{
+  char *line;
+  int len;
+
+  line = list_get(no, &len);
+  if (print_index)
+    printf("%d%s", no + 1, print_text ? "\t" : "");
+  if (print_text)
+    fwrite(line, 1, len, stdout);
+  printf("\n");
+}
+
 int main(int argc, char *argv[])
 {
-  int c, maxy, maxx;
-  char line[TEXT_LIMIT], *p;
-  FILE *fh;
+  int c, maxy, maxx, print_index, print_text, len, selected;
+  FILE *tty;
 
-  if (argc != 2) {
-    printf("Usage: %s <file with menu lines>\n", argv[0]);
-    return 0;
+  print_index = print_text = 0;
+  while ((c = getopt(argc, argv, "it")) != -1) {
+    switch (c) {
+    case 'i':
+      print_index = 1;
+      break;
+    case 't':
+      print_text = 1;
+      break;
+    default:
+      argc = 0; /* Show usage. */
+      break;
+    }
   }
+  if (! print_index)
+    print_text = 1;
 
-  fh = fopen(argv[1], "r");
-  if (fh == NULL) {
-    printf("Error: Unable to open menu file for reading.\n");
+  /* Without a file, lines come from standard input, unless that is the
+     terminal, which is needed for the keys. */
+  if (argc - optind > 1 ||
+      (argc - optind == 0 && isatty(STDIN_FILENO))) {
+    printf("Usage: %s [-i] [-t] [file with menu lines]\n", argv[0]);
+    printf("  -i  Write the number of the selected line to stdout.\n");
+    printf("  -t  Write its text too, after a tab. (Default without -i)\n");
+    printf("Lines are read from stdin without a file, or if it is \"-\".\n");
     return 0;
   }
 
-  while (fgets(line, TEXT_LIMIT, fh) != NULL) {
-    for (p = line; *p != '\0'; p++) {
-      if ((*p == '\r') || (*p == '\n')) {
-        *p = '\0';
-        break;
-      }
-    }
-    strncpy(list[list_size], line, TEXT_LIMIT);
-    list_size++;
-    if (list_size == ENTRY_LIMIT)
-      break;
+  if (text_load((argc - optind == 1) ? argv[optind] : "-") != 0) {
+    printf("Error: Unable to open menu file for reading.\n");
+    return 0;
   }
-  fclose(fh);
+  atexit(exit_handler);
 
   signal(SIGINT, interrupt_handler);
 
-  initscr();
-  atexit(exit_handler);
+  /* Draw on the terminal even when stdout is redirected for the result,
+     and read keys from it when stdin has the lines. */
+  tty = NULL;
+  if (! isatty(STDOUT_FILENO) || ! isatty(STDIN_FILENO))
+    tty = fopen("/dev/tty", "r+");
+  if (tty != NULL) {
+    if (newterm(NULL, tty, tty) == NULL) {
+      printf("Error: Unable to use the terminal.\n");
+      return 0;
+    }
+  } else {
+    initscr();
+  }
   noecho();
   keypad(stdscr, TRUE);
 
+  if (filter_start(list_get) != 0) {
+    endwin();
+    printf("Error: Unable to start filtering.\n");
+    return 0;
+  }
+
   while (1) {
+    /* Show lines and results as they come, keeping the selection within
+       them. */
+    text_poll();
+    if (filter_poll()) {
+      if (selected_entry >= view_size())
+        selected_entry = view_size() - 1;
+      if (selected_entry < 0)
+        selected_entry = 0;
+    }
     update_screen();
     getmaxyx(stdscr, maxy, maxx);
+    maxy--;
+
+    /* Wake up to draw more lines or results while busy, otherwise wait. */
+    timeout((filter_busy() || (text_streamed && stream_busy())) ?
+      REDRAW_TICK : -1);
     c = getch();
 
     switch (c) {
@@ -134,7 +335,7 @@ int main(int argc, char *argv[])
 
     case KEY_DOWN:
       selected_entry++;
-      if (selected_entry >= list_size)
+      if (selected_entry >= view_size())
         selected_entry--;
       if (selected_entry > maxy - 1) {
         scroll_offset++;
@@ -145,7 +346,7 @@ int main(int argc, char *argv[])
 
     case KEY_NPAGE:
       scroll_offset += maxy / 2;
-      while (maxy + scroll_offset > list_size)
+      while (maxy + scroll_offset > view_size())
         scroll_offset--;
       if (scroll_offset < 0)
         scroll_offset = 0;
@@ -164,14 +365,44 @@ int main(int argc, char *argv[])
     case KEY_ENTER:
     case '\n':
     case '\r':
+      if (view_size() == 0)
+        break;
+      selected = view_get(selected_entry);
+      endwin();
+      print_selection(selected, print_index, print_text);
+
       /* Need to start at 1 to differentiate between a valid selection
-         and other kinds of exits, that returns 0. */
-      return selected_entry + 1;
+         and other kinds of exits, that returns 0. Selections that do not
+         fit are only on stdout. */
+      if (selected + 1 >= EXIT_CODE_LIMIT)
+        return EXIT_CODE_LIMIT;
+      return selected + 1;
 
     case '\e': /* Escape */
-    case 'Q':
-    case 'q':
       return 0;
+
+    case KEY_BACKSPACE:
+    case 0x7f:
+    case '\b':
+      len = strlen(filter_text);
+      if (len == 0)
+        break;
+      filter_text[len - 1] = '\0';
+      if (filter_text[0] != '\0')
+        filter_request(filter_text, list_size);
+      selected_entry = scroll_offset = 0;
+      break;
+
+    default:
+      /* Type to filter, with the best matches first. */
+      len = strlen(filter_text);
+      if (c < 0 || c > 0xff || ! isprint(c) || len >= FILTER_PATTERN_MAX - 1)
+        break;
+      filter_text[len] = c;
+      filter_text[len + 1] = '\0';
+      filter_request(filter_text, list_size);
+      selected_entry = scroll_offset = 0;
+      break;
     }
 
   }
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stream.h"
+
+#define STREAM_RESERVE_MAX ((size_t)1 << 36)
+#define STREAM_RESERVE_MIN (16 << 20)
+#define STREAM_READ_SIZE 65536
+
+/* Reserved, not allocated, so only what is used takes memory, and the
+   lines stay where they are while more are read. */
+static int stream_fd = -1;
+static char *stream_text = NULL;
+static size_t stream_text_reserved = 0;
+static size_t *stream_list = NULL;
+static size_t stream_list_reserved = 0; /* One more than the lines. */
+static pthread_t stream_thread;
+static int stream_started = 0;
+
+/* Shared between the UI and the reader. */
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int stream_lines = 0; /* Complete lines, with their end offset set. */
+static int stream_done = 0;
+
+/* Only used by the UI. */
+static int stream_taken = 0;
+
+static void stream_publish(int lines, int done)
+{
+  pthread_mutex_lock(&stream_mutex);
+  stream_lines = lines;
+  stream_done = done;
+  pthread_mutex_unlock(&stream_mutex);
+}
+
+static void *stream_reader(void *arg)
+{
+  char *p, *end, *newline;
+  size_t used, want;
+  ssize_t n;
+  int lines;
+
+  used = 0;
+  lines = 0;
+  stream_list[0] = 0;
+  while (lines < stream_list_reserved - 1) {
+    want = stream_text_reserved - used;
+    if (want > STREAM_READ_SIZE)
+      want = STREAM_READ_SIZE;
+    if (want == 0)
+      break; /* Full, the rest is left unread. */
+    n = read(stream_fd, stream_text + used, want);
+    if (n <= 0)
+      break;
+
+    /* Index the lines completed by what was just read. */
+    end = stream_text + used + n;
+    for (p = stream_text + used; p < end; p = newline + 1) {
+      newline = memchr(p, '\n', end - p);
+      if (newline == NULL || lines >= stream_list_reserved - 1)
+        break;
+      stream_list[++lines] = newline + 1 - stream_text;
+    }
+    used += n;
+    stream_publish(lines, 0);
+  }
+
+  /* As if the last line had a newline too. */
+  if (used > stream_list[lines] && lines < stream_list_reserved - 1)
+    stream_list[++lines] = used + 1;
+  stream_publish(lines, 1);
+
+  return NULL;
+}
+
+/* Read lines from the descriptor in the background, into a text buffer
+   and line offsets laid out like a whole file would be, which stay put. */
+int stream_start(int fd, char **text, size_t **list)
+{
+  sigset_t all, old;
+  size_t size, lines;
+  int error;
+
+  for (size = STREAM_RESERVE_MAX; size >= STREAM_RESERVE_MIN; size /= 2) {
+    lines = (size < INT_MAX) ? size : INT_MAX;
+    stream_text = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stream_text == MAP_FAILED)
+      continue;
+    stream_list = mmap(NULL, sizeof(size_t) * lines, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stream_list != MAP_FAILED)
+      break;
+    munmap(stream_text, size);
+  }
+  if (size < STREAM_RESERVE_MIN) {
+    stream_text = NULL;
+    stream_list = NULL;
+    return -1;
+  }
+  stream_text_reserved = size;
+  stream_list_reserved = lines;
+  stream_fd = fd;
+
+  /* Signal handlers touch curses, so keep them on the main thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  error = pthread_create(&stream_thread, NULL, stream_reader, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (error != 0)
+    return -1;
+  stream_started = 1;
+
+  *text = stream_text;
+  *list = stream_list;
+  return 0;
+}
+
+/* Returns the number of complete lines read so far. */
+int stream_poll(void)
+{
+  pthread_mutex_lock(&stream_mutex);
+  stream_taken = stream_lines;
+  pthread_mutex_unlock(&stream_mutex);
+
+  return stream_taken;
+}
+
+/* Returns 1 until the input has ended and every line has been taken. */
+int stream_busy(void)
+{
+  int busy;
+
+  pthread_mutex_lock(&stream_mutex);
+  busy = (! stream_done || stream_taken < stream_lines);
+  pthread_mutex_unlock(&stream_mutex);
+
+  return busy;
+}
+
+void stream_stop(void)
+{
+  /* The reader may be waiting for input that never comes. */
+  if (stream_started) {
+    pthread_cancel(stream_thread);
+    pthread_join(stream_thread, NULL);
+    stream_started = 0;
+  }
+  if (stream_text != NULL) {
+    munmap(stream_text, stream_text_reserved);
+    munmap(stream_list, sizeof(size_t) * stream_list_reserved);
+  }
+  stream_text = NULL;
+  stream_list = NULL;
+}
@@ -0,0 +1,11 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stddef.h>
+
+int stream_start(int fd, char **text, size_t **list);
+int stream_poll(void);
+int stream_busy(void);
+void stream_stop(void);
+
+#endif /* _STREAM_H */
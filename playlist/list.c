@@ -1,83 +1,247 @@
+#define _GNU_SOURCE /* strcasestr() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h> /* strcasecmp() */
+#include <ctype.h>
 #include <time.h>
-#include <limits.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "play.h"
 #include "list.h"
+#include "trigram.h"
+#include "meta.h"
+#include "scan.h"
+#include "sort.h"
 
-/* The original set. */
-static char **list_original = NULL;
-static int list_original_size = 0;
+#define LIST_FILTER_STACK_MAX 64
+#define LIST_FILTER_CHECK_EVERY 1024 /* Entries between cancel checks. */
+#define LIST_FILTER_FAILED -2 /* Out of memory, the view is left as it is. */
+#define LIST_ARENA_MIN 65536 /* Initial arena when the size is unknown. */
+#define LIST_RESERVE_MAX UINT32_MAX /* Offsets are 32-bit. */
+#define LIST_RESERVE_MIN (16 << 20)
+#define LIST_CAPACITY_MIN 1024
+
+typedef struct list_entry_s {
+  uint32_t path; /* Offsets into the arena. */
+  uint32_t basename;
+} list_entry_t;
+
+/* Keys to sort by, with what is looked up once before sorting. */
+typedef struct list_sort_s {
+  const int *key;
+  int keys;
+  const char **tag;
+  int *duration;
+} list_sort_t;
+
+typedef struct list_result_s {
+  char *filter;
+  uint32_t *match; /* Indexes into the original set. */
+  int size;
+} list_result_t;
 
-/* The filtered set. */
-static char **list_filtered = NULL;
-static int list_filtered_size = 0;
+/* The whole playlist file, with each line terminated in place. When
+   scanning, it is reserved up front instead and filled as paths are found,
+   so that it never moves while other threads use it. */
+static char *list_arena = NULL;
+static size_t list_arena_used = 0;
+static size_t list_arena_reserved = 0; /* Mapped if not 0. */
 
-/* The abstraction. */
-static char **list = NULL;
+/* The original set, never reordered since the index refers to it. Entries
+   are only ever added at the end, under the index lock. */
+static list_entry_t *list_original = NULL;
+static int list_original_size = 0;
+static int list_original_reserved = 0;
+static pthread_rwlock_t list_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* The abstraction, indexes into the original set. A spare view of the same
+   capacity receives filter results, so nothing is allocated per filter. */
+static uint32_t *list = NULL;
+static uint32_t *list_spare = NULL;
 static int list_size = 0;
 static int list_current = -1;
+static int list_capacity = 0; /* Of the views and the orders. */
 
-int list_import_file(char *path)
+/* Play order over the original set, and the position of each entry in it.
+   The view is always sorted by it. The previous order is kept for undo,
+   together with the view sorted by it, unless the filter changed since. */
+static uint32_t *list_order = NULL;
+static uint32_t *list_rank = NULL;
+static int list_order_identity = 1;
+static uint32_t *list_order_previous = NULL;
+static uint32_t *list_rank_previous = NULL;
+static int list_order_previous_identity = 1;
+static uint32_t *list_undo = NULL;
+static int list_undo_size = -1; /* Invalid. */
+static unsigned char *list_mark = NULL; /* One bit per original entry. */
+
+/* Results for each prefix of the filter, only used by the filter thread. */
+static list_result_t list_filter_stack[LIST_FILTER_STACK_MAX];
+static int list_filter_stack_size = 0;
+
+/* Shared between the UI and the filter thread. */
+static pthread_t list_filter_thread;
+static pthread_mutex_t list_filter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t list_filter_cond = PTHREAD_COND_INITIALIZER;
+static int list_filter_running = 0;
+static int list_filter_quit = 0;
+static int list_filter_stale = 0; /* Entries were added, drop the results. */
+static char *list_filter_wanted = NULL;
+static char *list_filter_text = NULL; /* Last requested, UI only. */
+static unsigned int list_filter_generation = 0;
+static unsigned int list_filter_installed = 0;
+static uint32_t *list_filter_ready = NULL; /* NULL, size -1 means all. */
+static int list_filter_ready_size = 0;
+static unsigned int list_filter_ready_generation = 0;
+
+static char *list_path(uint32_t index)
+{
+  return list_arena + list_original[index].path;
+}
+
+static char *list_basename(uint32_t index)
+{
+  return list_arena + list_original[index].basename;
+}
+
+/* Read the whole file into the arena, terminated. Returns the length. */
+static ssize_t list_arena_read(int fd)
 {
-  char line[PATH_MAX];
-  char *p;
-  FILE *fh;
+  struct stat st;
+  size_t capacity, used;
+  ssize_t n;
+  char *grown;
 
-  fh = fopen(path, "r");
-  if (fh == NULL)
+  /* Regular files are read in one go, anything else grows as needed. One
+     byte more than the file, so the read that finds the end has room and
+     the arena is never grown for nothing. */
+  capacity = LIST_ARENA_MIN;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    capacity = st.st_size + 2;
+
+  list_arena = (char *)malloc(capacity);
+  if (list_arena == NULL)
     return -1;
 
-  list_original = (char **)malloc(sizeof(char *));
-  if (list_original == NULL) {
-    fclose(fh);
+  used = 0;
+  while (1) {
+    n = read(fd, list_arena + used, capacity - used - 1);
+    if (n == -1)
+      return -1;
+    if (n == 0)
+      break;
+    used += n;
+
+    /* Only grown when a read filled it, there may be more. */
+    if (used + 1 >= capacity) {
+      capacity *= 2;
+      grown = (char *)realloc(list_arena, capacity);
+      if (grown == NULL)
+        return -1;
+      list_arena = grown;
+    }
+  }
+  list_arena[used] = '\0';
+
+  return used;
+}
+
+int list_import_file(char *path)
+{
+  char *p, *end, *line_end, *cr, *slash;
+  ssize_t size;
+  int fd, i, lines;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
     return -1;
+  size = list_arena_read(fd);
+  close(fd);
+  if (size == -1 || size >= UINT32_MAX)
+    return -1; /* Offsets are 32-bit. */
+  end = list_arena + size;
+
+  /* Count lines first, so the entries are allocated once. */
+  lines = 0;
+  for (p = list_arena; p < end; p = line_end + 1) {
+    line_end = memchr(p, '\n', end - p);
+    if (line_end == NULL)
+      line_end = end;
+    lines++;
   }
-  list_original_size = 0;
 
-  while (fgets(line, PATH_MAX, fh) != NULL) {
-    for (p = line; *p != '\0'; p++) {
-      if ((*p == '\r') || (*p == '\n')) {
-        *p = '\0';
-        break;
-      }
-    }
+  list_original = (list_entry_t *)malloc(sizeof(list_entry_t) * (lines + 1));
+  list = (uint32_t *)malloc(sizeof(uint32_t) * (lines + 1));
+  list_spare = (uint32_t *)malloc(sizeof(uint32_t) * (lines + 1));
+  list_undo = (uint32_t *)malloc(sizeof(uint32_t) * (lines + 1));
+  list_order = (uint32_t *)malloc(sizeof(uint32_t) * (lines + 1));
+  list_rank = (uint32_t *)malloc(sizeof(uint32_t) * (lines + 1));
+  list_order_previous = (uint32_t *)malloc(sizeof(uint32_t) * (lines + 1));
+  list_rank_previous = (uint32_t *)malloc(sizeof(uint32_t) * (lines + 1));
+  list_mark = (unsigned char *)calloc(lines / 8 + 1, 1);
+  if (list_original == NULL || list == NULL || list_spare == NULL ||
+      list_undo == NULL || list_order == NULL || list_rank == NULL ||
+      list_order_previous == NULL || list_rank_previous == NULL ||
+      list_mark == NULL)
+    return -1;
 
-    list_original[list_original_size] = (char *)malloc(sizeof(char) * 
-      (strlen(line) + 1));
-    if (list_original[list_original_size] == NULL) {
-      fclose(fh);
-      return -1;
-    }
-    strncpy(list_original[list_original_size], line, strlen(line) + 1);
+  /* Terminate each line in place, at the first carriage return or newline. */
+  list_original_size = 0;
+  list_capacity = lines + 1;
+  for (p = list_arena; p < end; p = line_end + 1) {
+    line_end = memchr(p, '\n', end - p);
+    if (line_end == NULL)
+      line_end = end;
+    *line_end = '\0';
+    cr = memchr(p, '\r', line_end - p);
+    if (cr != NULL)
+      *cr = '\0';
 
+    slash = strrchr(p, '/');
+    list_original[list_original_size].path = p - list_arena;
+    list_original[list_original_size].basename =
+      (slash == NULL) ? (p - list_arena) : (slash + 1 - list_arena);
     list_original_size++;
-    list_original = (char **)realloc(list_original, sizeof(char *) * 
-      (list_original_size + 1));
-    if (list_original == NULL) {
-      fclose(fh);
-      return -1;
-    }
-    list_original[list_original_size] = NULL;
   }
 
-  fclose(fh);
+  /* Index basenames once, so filters need not scan the whole list. */
+  for (i = 0; i < list_original_size; i++) {
+    if (trigram_add(i, list_basename(i)) != 0)
+      return -1;
+  }
 
   /* Set original list as the one to use right after loading the file. */
-  list = list_original;
+  for (i = 0; i < list_original_size; i++) {
+    list[i] = i;
+    list_order[i] = list_order_previous[i] = i;
+    list_rank[i] = list_rank_previous[i] = i;
+  }
   list_size = list_original_size;
+  srandom(time(NULL) ^ getpid());
 
   return 0;
 }
 
+/* Prepare whatever follows the current entry, since it is likely next. */
+static void list_prefetch(void)
+{
+  if (list_current >= 0 && list_current + 1 < list_size)
+    play_prefetch(list_path(list[list_current + 1]));
+}
+
 void list_request(int no)
 {
   if (no >= 0 && no < list_size) {
     play_cancel();
     list_current = no;
-    play_execute(list[list_current]);
+    play_execute(list_path(list[list_current]));
+    list_prefetch();
   }
 }
 
@@ -90,25 +254,19 @@ void list_request_next(void)
   }
   play_cancel(); /* Will most likely be ignored, since called after done. */
   list_current++;
-  play_execute(list[list_current]);
+  play_execute(list_path(list[list_current]));
+  list_prefetch();
 }
 
 char *list_get(int no, int *playing)
 {
-  char *basename;
-
   if (no == list_current)
     *playing = 1;
   else
     *playing = 0;
 
   if (no >= 0 && no < list_size) {
-    basename = rindex(list[no], '/');
-    if (basename == NULL) {
-      return list[no];
-    } else {
-      return basename + 1;
-    }
+    return list_basename(list[no]);
   } else {
     return NULL;
   }
@@ -119,9 +277,75 @@ int list_size_get(void)
   return list_size;
 }
 
+int list_meta_start(char *cache_path, char *command)
+{
+  return meta_start(cache_path, command, list_original_size, list_path);
+}
+
+int list_meta_busy(void)
+{
+  return meta_busy();
+}
+
+/* Returns 1 if the duration or tag of the entry is known. */
+int list_meta_get(int no, const char **tag, int *duration)
+{
+  if (no < 0 || no >= list_size)
+    return 0;
+  return meta_get(list[no], tag, duration);
+}
+
+static int list_index_compare(const void *p1, const void *p2)
+{
+  uint32_t a = *(const uint32_t *)p1, b = *(const uint32_t *)p2;
+
+  return (a > b) - (a < b);
+}
+
+/* Sort a view by the play order, in place. Since the view is a subset of
+   the order, marking its entries and walking the order is enough. The view
+   may be in any order, like a shuffled one kept for undo. */
+static void list_view_order(uint32_t *view, int size)
+{
+  uint32_t entry;
+  int i, n;
+
+  if (list_order_identity) {
+    /* The original order, no need to walk all of it. */
+    qsort(view, size, sizeof(uint32_t), list_index_compare);
+    return;
+  }
+
+  for (i = 0; i < size; i++)
+    list_mark[view[i] / 8] |= 1 << (view[i] % 8);
+
+  n = 0;
+  for (i = 0; i < list_original_size && n < size; i++) {
+    entry = list_order[i];
+    if (list_mark[entry / 8] & (1 << (entry % 8))) {
+      list_mark[entry / 8] &= ~(1 << (entry % 8));
+      view[n++] = entry;
+    }
+  }
+}
+
+/* Locate the playing entry again after the view has changed. */
+static void list_current_find(int entry)
+{
+  int i;
+
+  list_current = -1;
+  for (i = 0; entry != -1 && i < list_size; i++) {
+    if (list[i] == entry) {
+      list_current = i;
+      break;
+    }
+  }
+}
+
 int list_swap(int no_a, int no_b)
 {
-  char *temp;
+  uint32_t temp, a, b;
 
   if (no_a < 0 || 
       no_b < 0 ||
@@ -129,165 +353,723 @@ int list_swap(int no_a, int no_b)
       no_b >= list_size)
     return -1;
 
-  play_block();
+  /* Swap in the play order too, so it survives changing the filter. */
+  a = list[no_a];
+  b = list[no_b];
+  list_order[list_rank[a]] = b;
+  list_order[list_rank[b]] = a;
+  temp = list_rank[a];
+  list_rank[a] = list_rank[b];
+  list_rank[b] = temp;
+  list_order_identity = 0;
 
-  temp = list[no_b];
-  list[no_b] = list[no_a];
-  list[no_a] = temp;
+  list[no_a] = b;
+  list[no_b] = a;
 
   if (no_a == list_current)
     list_current = no_b;
   else if (no_b == list_current)
     list_current = no_a;
-
-  play_unblock();
+  list_prefetch();
 
   return 0;
 }
 
-void list_shuffle(void)
+/* Unbiased random number below "n", by rejecting the uneven remainder. */
+static uint32_t list_random_below(uint32_t n)
 {
-  char *temp;
-  int i, r;
+  uint32_t limit, r;
 
-  srandom(time(NULL));
+  limit = RAND_MAX - (RAND_MAX % n);
+  do {
+    r = random();
+  } while (r >= limit);
 
-  play_block();
+  return r % n;
+}
 
-  for (i = 0; i < list_size; i++) {
-    r = random() % list_size;
+/* Swap in the previous order, with its view if it is still valid. */
+static void list_order_swap(void)
+{
+  uint32_t *temp;
+  int entry, identity;
 
-    temp = list[i];
-    list[i] = list[r];
-    list[r] = temp;
+  entry = (list_current >= 0) ? (int)list[list_current] : -1;
 
-    if (r == list_current)
-      list_current = i;
-    else if (i == list_current)
-      list_current = r;
+  temp = list_order;
+  list_order = list_order_previous;
+  list_order_previous = temp;
+  temp = list_rank;
+  list_rank = list_rank_previous;
+  list_rank_previous = temp;
+  identity = list_order_identity;
+  list_order_identity = list_order_previous_identity;
+  list_order_previous_identity = identity;
+
+  if (list_undo_size != list_size) {
+    memcpy(list_undo, list, sizeof(uint32_t) * list_size);
+    list_view_order(list_undo, list_size);
   }
+  temp = list;
+  list = list_undo;
+  list_undo = temp;
+  list_undo_size = list_size;
 
-  play_unblock();
+  list_current_find(entry);
+  list_prefetch();
 }
 
-static int list_cmp(char *filter, char *original)
+/* Shuffle the play order, which also applies when filtered. The strings and
+   the original set are never touched. */
+void list_shuffle(void)
 {
-  char *basename;
+  uint32_t i, j;
 
-  basename = rindex(original, '/');
-  if (basename == NULL)
-    basename = original;
-  else
-    basename++; /* Remove leading slash. */
+  if (list_original_size == 0)
+    return;
 
-  while (*basename != '\0') {
-    if (strncasecmp(filter, basename, strlen(filter)) == 0)
-      return 0;
-    basename++;
+  /* Inside-out Fisher-Yates, building the new order in the previous one. */
+  for (i = 0; i < list_original_size; i++) {
+    j = list_random_below(i + 1);
+    list_order_previous[i] = list_order_previous[j];
+    list_order_previous[j] = i;
   }
-  return -1;
+  for (i = 0; i < list_original_size; i++)
+    list_rank_previous[list_order_previous[i]] = i;
+  list_order_previous_identity = 0;
+
+  /* The current view is kept for undo, since it matches the current order. */
+  list_undo_size = -1;
+  list_order_swap();
 }
 
-static int list_filter_produces_size(char *filter)
+/* Lower case of every byte, looked up instead of calling tolower(). */
+static unsigned char list_sort_fold[256];
+
+/* Add the bytes of one part of a sort key that fall in the chunk, "pos"
+   being where the part starts in the whole key. Text is case folded, and
+   followed by a zero so that shorter text goes first. */
+static void list_sort_part(uint64_t *chunk, int *filled, int *pos, int depth,
+  const unsigned char *data, int len, int text)
 {
-  int i, size;
+  int total, skip;
 
-  size = 0;
-  for (i = 0; i < list_original_size; i++) {
-    if (list_cmp(filter, list_original[i]) == 0)
-      size++;
+  total = len + (text ? 1 : 0);
+  for (skip = depth + *filled - *pos; *filled < 8 && skip < total; skip++) {
+    *chunk <<= 8;
+    if (skip < len)
+      *chunk |= text ? list_sort_fold[data[skip]] : data[skip];
+    (*filled)++;
   }
+  *pos += total;
+}
 
-  return size;
+static void list_sort_number(unsigned char *number, uint32_t value)
+{
+  number[0] = value >> 24;
+  number[1] = value >> 16;
+  number[2] = value >> 8;
+  number[3] = value;
 }
 
-int list_filter_apply(char *filter)
+/* The sort key of an entry is each of its keys in turn, and then the index,
+   so that keys differ and equal entries keep their original order. Text
+   past the chunk is not looked at, it may not have ended yet. */
+static uint64_t list_sort_key(uint32_t index, int depth, void *arg)
 {
-  int i;
+  list_sort_t *sort = arg;
+  const unsigned char *text;
+  unsigned char number[4];
+  uint64_t chunk;
+  int filled, pos, i;
 
-  /* Just ignore everything if an invalid filter is given. */
-  if (list_filter_produces_size(filter) == 0)
+  chunk = 0;
+  filled = 0;
+  pos = 0;
+  for (i = 0; i < sort->keys && filled < 8; i++) {
+    switch (sort->key[i]) {
+    case LIST_SORT_PATH:
+      text = (unsigned char *)list_path(index);
+      list_sort_part(&chunk, &filled, &pos, depth, text,
+        strnlen((char *)text, depth + 8), 1);
+      break;
+    case LIST_SORT_BASENAME:
+      text = (unsigned char *)list_basename(index);
+      list_sort_part(&chunk, &filled, &pos, depth, text,
+        strnlen((char *)text, depth + 8), 1);
+      break;
+    case LIST_SORT_DIRECTORY:
+      text = (unsigned char *)list_path(index);
+      list_sort_part(&chunk, &filled, &pos, depth, text,
+        list_original[index].basename - list_original[index].path, 1);
+      break;
+    case LIST_SORT_TAG:
+      /* Marked first, so those without a tag go last. */
+      text = (unsigned char *)sort->tag[index];
+      number[0] = (text != NULL) ? 1 : 2;
+      list_sort_part(&chunk, &filled, &pos, depth, number, 1, 0);
+      if (text != NULL)
+        list_sort_part(&chunk, &filled, &pos, depth, text,
+          strnlen((char *)text, depth + 8), 1);
+      break;
+    case LIST_SORT_DURATION:
+      /* Unknown is -1, which goes last. */
+      list_sort_number(number, sort->duration[index]);
+      list_sort_part(&chunk, &filled, &pos, depth, number, 4, 0);
+      break;
+    }
+  }
+  list_sort_number(number, index);
+  list_sort_part(&chunk, &filled, &pos, depth, number, 4, 0);
+
+  if (filled == 0)
+    return 0;
+  return chunk << (8 * (8 - filled));
+}
+
+/* Sort the play order by the keys, each one deciding only when all those
+   before it are equal. Like a shuffle, it applies when filtered too, and
+   is undone the same way. Returns -1 if out of memory. */
+int list_sort(const int *key, int keys)
+{
+  list_sort_t sort;
+  uint32_t *order, i;
+  int j, result;
+
+  if (list_original_size == 0 || keys < 1)
+    return 0;
+  order = (uint32_t *)malloc(sizeof(uint32_t) * list_original_size);
+  if (order == NULL)
     return -1;
 
-  play_block(); /* Entering critical section. */
+  memset(&sort, 0, sizeof(sort));
+  sort.key = key;
+  sort.keys = keys;
+  for (j = 0; j < 256; j++)
+    list_sort_fold[j] = tolower(j);
 
-  /* Free old filtered list first, if it exists. */
-  if (list_filtered != NULL) {
-    for (i = 0; i < list_filtered_size; i++) {
-      free(list_filtered[i]);
+  /* Metadata keeps coming in, so take what is known now. */
+  for (j = 0; j < keys; j++) {
+    if ((key[j] == LIST_SORT_TAG || key[j] == LIST_SORT_DURATION) &&
+        sort.tag == NULL) {
+      sort.tag = (const char **)malloc(sizeof(char *) * list_original_size);
+      sort.duration = (int *)malloc(sizeof(int) * list_original_size);
+      if (sort.tag == NULL || sort.duration == NULL) {
+        free(order);
+        free(sort.tag);
+        free(sort.duration);
+        return -1;
+      }
+      for (i = 0; i < list_original_size; i++) {
+        if (! meta_get(i, &sort.tag[i], &sort.duration[i])) {
+          sort.tag[i] = NULL;
+          sort.duration[i] = -1;
+        }
+      }
     }
-    free(list_filtered);
-    list_filtered = NULL;
   }
 
-  /* Use the empty string to disable the filter. */
-  if (strlen(filter) == 0) {
-    list = list_original;
-    list_size = list_original_size;
-    goto list_filter_apply_done;
+  for (i = 0; i < list_original_size; i++)
+    order[i] = i;
+  result = sort_indexes(order, list_original_size, list_sort_key, &sort);
+  free(sort.tag);
+  free(sort.duration);
+  if (result != 0) {
+    free(order);
+    return -1;
   }
 
-  list_filtered = (char **)malloc(sizeof(char *));
-  if (list_filtered == NULL)
-    return -1;
+  /* The new order goes in the previous one, as when shuffling. */
+  memcpy(list_order_previous, order, sizeof(uint32_t) * list_original_size);
+  free(order);
+  for (i = 0; i < list_original_size; i++)
+    list_rank_previous[list_order_previous[i]] = i;
+  list_order_previous_identity = 0;
 
-  list_filtered_size = 0;
-  for (i = 0; i < list_original_size; i++) {
-    if (list_cmp(filter, list_original[i]) == 0) {
-      list_filtered[list_filtered_size] = (char *)malloc(sizeof(char) * 
-        (strlen(list_original[i]) + 1));
-      if (list_filtered[list_filtered_size] == NULL)
-        return -1;
-      strncpy(list_filtered[list_filtered_size], 
-        list_original[i], strlen(list_original[i]) + 1);
+  list_undo_size = -1;
+  list_order_swap();
 
-      list_filtered_size++;
-      list_filtered = (char **)realloc(list_filtered, sizeof(char *) *
-        (list_filtered_size + 1));
-      if (list_filtered == NULL)
-        return -1;
+  return 0;
+}
+
+/* Go back to the order before the last shuffle, calling again redoes it. */
+void list_shuffle_undo(void)
+{
+  list_order_swap();
+}
+
+static int list_filter_cancelled(unsigned int generation)
+{
+  return __atomic_load_n(&list_filter_generation, __ATOMIC_RELAXED) != generation;
+}
+
+/* Returns the number of original entries matching the filter, with their
+   indexes in "matches", which the caller must free. Only the entries in
+   "from" are checked, unless it is NULL. Returns -1 if cancelled, and
+   LIST_FILTER_FAILED if out of memory. */
+static int list_filter_matches(char *filter, uint32_t *from, int from_size,
+  uint32_t **matches, unsigned int generation)
+{
+  uint32_t *candidates;
+  int i, n, size, total;
+
+  if (from != NULL) {
+    /* Narrowing a previous result, it is already the candidate set. */
+    n = from_size;
+    candidates = (uint32_t *)malloc(sizeof(uint32_t) * (n + 1));
+    if (candidates == NULL)
+      return LIST_FILTER_FAILED;
+    memcpy(candidates, from, sizeof(uint32_t) * n);
+  } else {
+    /* Entries are only added at the end, so those already counted can be
+       checked without the lock. */
+    pthread_rwlock_rdlock(&list_index_lock);
+    n = trigram_candidates(filter, &candidates);
+    total = list_original_size;
+    pthread_rwlock_unlock(&list_index_lock);
+    if (n == -1) {
+      /* Filter too short for the index, check everything. */
+      n = total;
+      candidates = (uint32_t *)malloc(sizeof(uint32_t) * (n + 1));
+      if (candidates == NULL)
+        return LIST_FILTER_FAILED;
+      for (i = 0; i < n; i++)
+        candidates[i] = i;
+    }
+  }
+
+  /* Only candidates need the real comparison. */
+  size = 0;
+  for (i = 0; i < n; i++) {
+    if ((i % LIST_FILTER_CHECK_EVERY) == 0 && list_filter_cancelled(generation)) {
+      free(candidates);
+      return -1;
     }
+    if (strcasestr(list_basename(candidates[i]), filter) != NULL)
+      candidates[size++] = candidates[i];
   }
+  *matches = candidates;
+  return size;
+}
+
+static void list_filter_stack_pop(void)
+{
+  list_filter_stack_size--;
+  free(list_filter_stack[list_filter_stack_size].filter);
+  free(list_filter_stack[list_filter_stack_size].match);
+}
+
+static void *list_filter_main(void *arg)
+{
+  list_result_t *top;
+  char *filter;
+  uint32_t *matches, *ready;
+  int size, stale;
+  unsigned int generation;
+
+  pthread_mutex_lock(&list_filter_mutex);
+  while (1) {
+    while (list_filter_wanted == NULL && ! list_filter_quit)
+      pthread_cond_wait(&list_filter_cond, &list_filter_mutex);
+    if (list_filter_quit)
+      break;
 
-  /* This should not happen, as size is checked earlier, but just in case... */
-  if (list_filtered_size == 0) {
-    free(list_filtered);
-    list_filtered = NULL;
+    filter = list_filter_wanted;
+    list_filter_wanted = NULL;
+    generation = list_filter_generation;
+    stale = list_filter_stale;
+    list_filter_stale = 0;
+    pthread_mutex_unlock(&list_filter_mutex);
 
-    list = list_original;
-    list_size = list_original_size;
-    goto list_filter_apply_done;
+    /* Results from before entries were added would miss them. */
+    while (stale && list_filter_stack_size > 0)
+      list_filter_stack_pop();
+
+    /* Drop results that are not for a prefix of the new filter. */
+    while (list_filter_stack_size > 0) {
+      top = &list_filter_stack[list_filter_stack_size - 1];
+      if (strncmp(top->filter, filter, strlen(top->filter)) == 0)
+        break;
+      list_filter_stack_pop();
+    }
+    top = (list_filter_stack_size > 0) ?
+      &list_filter_stack[list_filter_stack_size - 1] : NULL;
+
+    ready = NULL;
+    size = -1;
+    if (filter[0] == '\0') {
+      size = -1; /* Empty filter, everything. */
+    } else if (top != NULL && strcmp(top->filter, filter) == 0) {
+      /* Backspace, or the same filter again. */
+      ready = (uint32_t *)malloc(sizeof(uint32_t) * (top->size + 1));
+      size = LIST_FILTER_FAILED;
+      if (ready != NULL) {
+        memcpy(ready, top->match, sizeof(uint32_t) * top->size);
+        size = top->size;
+      }
+    } else {
+      size = list_filter_matches(filter, top ? top->match : NULL,
+        top ? top->size : 0, &matches, generation);
+      if (size == -1) {
+        free(filter);
+        pthread_mutex_lock(&list_filter_mutex);
+        continue; /* Cancelled by a newer filter. */
+      }
+
+      if (size != LIST_FILTER_FAILED) {
+        ready = (uint32_t *)malloc(sizeof(uint32_t) * (size + 1));
+        if (ready != NULL)
+          memcpy(ready, matches, sizeof(uint32_t) * size);
+
+        if (list_filter_stack_size < LIST_FILTER_STACK_MAX) {
+          list_filter_stack[list_filter_stack_size].filter = filter;
+          list_filter_stack[list_filter_stack_size].match = matches;
+          list_filter_stack[list_filter_stack_size].size = size;
+          list_filter_stack_size++;
+          filter = NULL;
+        } else {
+          free(matches);
+        }
+      }
+      if (ready == NULL)
+        size = LIST_FILTER_FAILED;
+    }
+    free(filter);
+
+    /* Published even when out of memory, or it would be pending for good. */
+    pthread_mutex_lock(&list_filter_mutex);
+    if (generation == list_filter_generation) {
+      free(list_filter_ready);
+      list_filter_ready = ready;
+      list_filter_ready_size = size;
+      list_filter_ready_generation = generation;
+    } else {
+      free(ready); /* Stale already. */
+    }
   }
+  pthread_mutex_unlock(&list_filter_mutex);
 
-  list = list_filtered;
-  list_size = list_filtered_size;
+  return NULL;
+}
 
-list_filter_apply_done:
-  play_unblock(); /* Leaving critical section. */
-  play_cancel();
-  list_current = 0;
-  play_execute(list[list_current]);
+static int list_filter_start(void)
+{
+  sigset_t all, old;
+  int result;
+
+  if (list_filter_running)
+    return 0;
+
+  /* Signal handlers touch curses, so keep them on the main thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  result = pthread_create(&list_filter_thread, NULL, list_filter_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (result != 0)
+    return -1;
+  list_filter_running = 1;
   return 0;
 }
 
-void list_destroy(void)
+/* Start filtering in the background, replacing any filter in progress. */
+int list_filter_request(char *filter)
 {
-  int i;
+  char *copy, *text;
 
-  if (list_original != NULL) {
-    for (i = 0; i < list_original_size; i++) {
-      free(list_original[i]);
-    }
-    free(list_original);
-    list_original = NULL;
+  if (list_filter_start() != 0)
+    return -1;
+
+  copy = strdup(filter);
+  text = strdup(filter);
+  if (copy == NULL || text == NULL) {
+    free(copy);
+    free(text);
+    return -1;
   }
+  free(list_filter_text);
+  list_filter_text = text;
 
-  if (list_filtered != NULL) {
-    for (i = 0; i < list_filtered_size; i++) {
-      free(list_filtered[i]);
-    }
-    free(list_filtered);
-    list_filtered = NULL;
+  pthread_mutex_lock(&list_filter_mutex);
+  free(list_filter_wanted);
+  list_filter_wanted = copy;
+  __atomic_add_fetch(&list_filter_generation, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&list_filter_cond);
+  pthread_mutex_unlock(&list_filter_mutex);
+
+  return 0;
+}
+
+int list_filter_pending(void)
+{
+  int pending;
+
+  pthread_mutex_lock(&list_filter_mutex);
+  pending = (list_filter_installed != list_filter_generation);
+  pthread_mutex_unlock(&list_filter_mutex);
+
+  return pending;
+}
+
+/* Install the newest filter result, if any. Returns 1 if the list changed. */
+int list_filter_poll(void)
+{
+  uint32_t *ready, *view;
+  int size, current;
+
+  pthread_mutex_lock(&list_filter_mutex);
+  if (list_filter_ready_generation != list_filter_generation ||
+      list_filter_installed == list_filter_generation) {
+    pthread_mutex_unlock(&list_filter_mutex);
+    return 0;
+  }
+  ready = list_filter_ready;
+  size = list_filter_ready_size;
+  list_filter_ready = NULL;
+  list_filter_installed = list_filter_generation;
+  pthread_mutex_unlock(&list_filter_mutex);
+  if (size == LIST_FILTER_FAILED)
+    return 0;
+
+  /* Fill the spare view and swap, so nothing is allocated. */
+  view = list_spare;
+  if (ready == NULL) {
+    size = list_original_size;
+    memcpy(view, list_order, sizeof(uint32_t) * size);
+  } else {
+    memcpy(view, ready, sizeof(uint32_t) * size);
+    free(ready);
+    list_view_order(view, size);
+  }
+
+  /* Keep track of what is playing, if it is still in the list. */
+  current = (list_current >= 0) ? (int)list[list_current] : -1;
+
+  list_spare = list;
+  list = view;
+  list_size = size;
+  list_undo_size = -1; /* The filter changed. */
+  list_current_find(current);
+  list_prefetch();
+
+  return 1;
+}
+
+/* Make room in the views and the orders for "needed" entries. */
+static int list_capacity_grow(int needed)
+{
+  uint32_t **array[] = {&list, &list_spare, &list_undo, &list_order,
+    &list_rank, &list_order_previous, &list_rank_previous};
+  uint32_t *grown;
+  unsigned char *mark;
+  int capacity, marked, i;
+
+  if (needed <= list_capacity)
+    return 0;
+  capacity = (list_capacity < LIST_CAPACITY_MIN) ?
+    LIST_CAPACITY_MIN : list_capacity;
+  while (capacity < needed)
+    capacity *= 2;
+
+  for (i = 0; i < (int)(sizeof(array) / sizeof(array[0])); i++) {
+    grown = (uint32_t *)realloc(*array[i], sizeof(uint32_t) * capacity);
+    if (grown == NULL)
+      return -1;
+    *array[i] = grown;
   }
+  marked = (list_mark != NULL) ? list_capacity / 8 + 1 : 0;
+  mark = (unsigned char *)realloc(list_mark, capacity / 8 + 1);
+  if (mark == NULL)
+    return -1;
+  memset(mark + marked, 0, capacity / 8 + 1 - marked);
+  list_mark = mark;
+  list_capacity = capacity;
+
+  return 0;
 }
 
+/* Add terminated paths to the end of the original set, the orders, and the
+   view if it is not filtered. Returns the number of entries added. */
+static int list_append(char *paths, size_t len)
+{
+  char *p, *end, *slash;
+  int first, count, size, i;
+
+  if (list_arena_used + len > list_arena_reserved)
+    len = 0; /* Out of reserved space, the rest is left out. */
+  end = paths + len;
+  count = 0;
+  for (p = paths; p < end; p += strlen(p) + 1)
+    count++;
+  first = list_original_size;
+  if (first + count > list_original_reserved)
+    return 0;
+  if (count == 0 || list_capacity_grow(first + count + 1) != 0)
+    return 0;
+
+  /* Nothing reads past the current size, so the entries go in unlocked. */
+  memcpy(list_arena + list_arena_used, paths, len);
+  p = list_arena + list_arena_used;
+  for (i = first; i < first + count; i++) {
+    slash = strrchr(p, '/');
+    list_original[i].path = p - list_arena;
+    list_original[i].basename =
+      (slash == NULL) ? (p - list_arena) : (slash + 1 - list_arena);
+    p += strlen(p) + 1;
+  }
+  list_arena_used += len;
+
+  pthread_rwlock_wrlock(&list_index_lock);
+  for (i = first; i < first + count; i++) {
+    if (trigram_add(i, list_basename(i)) != 0)
+      break;
+  }
+  list_original_size = first + count;
+  pthread_rwlock_unlock(&list_index_lock);
+
+  /* New entries are last in both orders, which keeps the view sorted. */
+  for (i = first; i < first + count; i++) {
+    list_order[i] = list_order_previous[i] = i;
+    list_rank[i] = list_rank_previous[i] = i;
+  }
+  list_undo_size = -1;
+
+  if (list_filter_text == NULL || list_filter_text[0] == '\0') {
+    size = list_size;
+    for (i = first; i < first + count; i++)
+      list[list_size++] = i;
+    if (list_current >= 0 && list_current == size - 1)
+      list_prefetch();
+  } else {
+    pthread_mutex_lock(&list_filter_mutex);
+    list_filter_stale = 1;
+    pthread_mutex_unlock(&list_filter_mutex);
+    list_filter_request(list_filter_text);
+  }
+
+  meta_grow(list_original_size);
+
+  return count;
+}
+
+/* Start walking the directories in the background, entries are added to the
+   list as they are found by list_scan_poll(). */
+int list_scan_start(char **dirs, int count, char *extensions)
+{
+  size_t size;
+
+  /* Reserved, not allocated, so only what is used takes memory. */
+  for (size = LIST_RESERVE_MAX; size >= LIST_RESERVE_MIN; size /= 2) {
+    list_arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (list_arena != MAP_FAILED)
+      break;
+  }
+  if (size < LIST_RESERVE_MIN) {
+    list_arena = NULL;
+    return -1;
+  }
+
+  /* Paths take more than a few bytes each. */
+  list_original = mmap(NULL, sizeof(list_entry_t) * (size / 16),
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (list_original == MAP_FAILED) {
+    munmap(list_arena, size);
+    list_arena = NULL;
+    list_original = NULL;
+    return -1;
+  }
+  list_arena_reserved = size;
+  list_original_reserved = size / 16;
+
+  if (list_capacity_grow(LIST_CAPACITY_MIN) != 0)
+    return -1;
+  srandom(time(NULL) ^ getpid());
+
+  return scan_start(dirs, count, extensions);
+}
+
+/* Add what the scan found since last time. Returns 1 if the list changed. */
+int list_scan_poll(void)
+{
+  char *found;
+  size_t len;
+  int added;
+
+  /* Wait for the filter, and add them after so the next one covers them. */
+  if (list_filter_pending())
+    return 0;
+
+  found = scan_take(&len);
+  if (found == NULL)
+    return 0;
+  added = list_append(found, len);
+  free(found);
+
+  return added > 0;
+}
+
+int list_scan_busy(void)
+{
+  return scan_busy();
+}
+
+void list_destroy(void)
+{
+  scan_stop();
+  meta_stop();
+
+  if (list_filter_running) {
+    pthread_mutex_lock(&list_filter_mutex);
+    list_filter_quit = 1;
+    __atomic_add_fetch(&list_filter_generation, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&list_filter_cond);
+    pthread_mutex_unlock(&list_filter_mutex);
+    pthread_join(list_filter_thread, NULL);
+    list_filter_running = 0;
+  }
+  while (list_filter_stack_size > 0)
+    list_filter_stack_pop();
+  free(list_filter_wanted);
+  list_filter_wanted = NULL;
+  free(list_filter_text);
+  list_filter_text = NULL;
+  free(list_filter_ready);
+  list_filter_ready = NULL;
+
+  if (list_arena_reserved > 0) {
+    munmap(list_arena, list_arena_reserved);
+    munmap(list_original, sizeof(list_entry_t) * list_original_reserved);
+    list_arena_reserved = 0;
+    list_original_reserved = 0;
+  } else {
+    free(list_arena);
+    free(list_original);
+  }
+  list_arena = NULL;
+  list_arena_used = 0;
+  list_original = NULL;
+  list_original_size = 0;
+
+  free(list);
+  list = NULL;
+  free(list_spare);
+  list_spare = NULL;
+  free(list_undo);
+  list_undo = NULL;
+  list_undo_size = -1;
+  free(list_order);
+  list_order = NULL;
+  free(list_rank);
+  list_rank = NULL;
+  free(list_order_previous);
+  list_order_previous = NULL;
+  free(list_rank_previous);
+  list_rank_previous = NULL;
+  free(list_mark);
+  list_mark = NULL;
+  list_size = 0;
+  list_capacity = 0;
+
+  trigram_destroy();
+}
@@ -1,14 +1,32 @@
 #ifndef _LIST_H
 #define _LIST_H
 
+enum {
+  LIST_SORT_PATH = 0,
+  LIST_SORT_BASENAME,
+  LIST_SORT_DIRECTORY,
+  LIST_SORT_TAG,
+  LIST_SORT_DURATION,
+};
+
 int list_import_file(char *path);
+int list_scan_start(char **dirs, int count, char *extensions);
+int list_scan_poll(void);
+int list_scan_busy(void);
 void list_request(int no);
 void list_request_next(void);
 char *list_get(int no, int *playing);
 int list_swap(int no_a, int no_b);
 void list_shuffle(void);
+void list_shuffle_undo(void);
+int list_sort(const int *key, int keys);
 int list_size_get(void);
-int list_filter_apply(char *filter);
+int list_meta_start(char *cache_path, char *command);
+int list_meta_get(int no, const char **tag, int *duration);
+int list_meta_busy(void);
+int list_filter_request(char *filter);
+int list_filter_pending(void);
+int list_filter_poll(void);
 void list_destroy(void);
 
 #endif /* _LIST_H */
@@ -0,0 +1,467 @@
+#define _GNU_SOURCE /* syscall() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "meta.h"
+#include "probe.h"
+
+#define META_MAGIC "PLMETA1\n"
+#define META_MAGIC_SIZE 8
+#define META_RECORD_SIZE 16 /* Fixed part, followed by path and tag. */
+#define META_WORKERS_MAX 4
+#define META_NICE 10
+#define META_IOPRIO_IDLE (3 << 13) /* IOPRIO_CLASS_IDLE, no header for it. */
+#define META_CHUNK 4096 /* Entries, allocated together and never moved. */
+#define META_CHUNKS_MAX 16384
+#define META_STOP_WAIT 1 /* Seconds to wait for workers at exit. */
+
+enum {
+  META_UNKNOWN = 0,
+  META_CACHED, /* From the cache, not yet checked against the file. */
+  META_DONE,
+};
+
+typedef struct meta_s {
+  long long mtime;
+  int duration;
+  int state;
+  char *tag;
+} meta_t;
+
+/* Chunked, so workers keep their pointers while entries are added. */
+static meta_t *meta_chunk[META_CHUNKS_MAX];
+static int meta_chunks = 0;
+static int meta_started = 0;
+static int meta_count = 0; /* Only grows, published to the workers. */
+static char *(*meta_path)(uint32_t index) = NULL;
+static const char *meta_command = NULL;
+static char *meta_cache_path = NULL;
+
+/* The loaded cache, which cached tags point into, and its records by
+   path, so entries added later are found in it too. */
+static char *meta_cache = NULL;
+static size_t meta_cache_size = 0;
+static size_t *meta_cache_table = NULL; /* Record offsets, 0 is empty. */
+static unsigned int meta_cache_mask = 0;
+
+static pthread_t meta_thread[META_WORKERS_MAX];
+static int meta_threads = 0;
+static pthread_mutex_t meta_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t meta_cond = PTHREAD_COND_INITIALIZER;
+static int meta_next = 0;
+static int meta_finished = 0;
+static int meta_quit = 0;
+static int meta_dirty = 0;
+static int meta_alive = 0; /* Workers not yet finished. */
+static int meta_cancel[2] = {-1, -1}; /* Closed to kill probe commands. */
+
+static meta_t *meta_at(int index)
+{
+  return &meta_chunk[index / META_CHUNK][index % META_CHUNK];
+}
+
+static unsigned int meta_hash(const char *s)
+{
+  unsigned int hash;
+
+  /* FNV-1a */
+  hash = 2166136261U;
+  for (; *s != '\0'; s++) {
+    hash ^= (unsigned char)*s;
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+/* Decode the record at "pos", returns the position of the next one or 0
+   if it is truncated or damaged. */
+static size_t meta_record(size_t pos, long long *mtime, int *duration,
+  char **path, char **tag)
+{
+  unsigned short path_len, tag_len;
+
+  if (pos + META_RECORD_SIZE > meta_cache_size)
+    return 0;
+  memcpy(mtime, &meta_cache[pos], 8);
+  memcpy(duration, &meta_cache[pos + 8], 4);
+  memcpy(&path_len, &meta_cache[pos + 12], 2);
+  memcpy(&tag_len, &meta_cache[pos + 14], 2);
+  *path = &meta_cache[pos + META_RECORD_SIZE];
+  *tag = (tag_len > 0) ? *path + path_len : NULL;
+  pos += META_RECORD_SIZE + path_len + tag_len;
+  if (pos > meta_cache_size || path_len == 0 || (*path)[path_len - 1] != '\0' ||
+      (tag_len > 0 && (*tag)[tag_len - 1] != '\0'))
+    return 0;
+
+  return pos;
+}
+
+/* Records are a fixed part followed by the path and the tag, both with
+   their terminators, so they are used in place once loaded. */
+static void meta_cache_load(void)
+{
+  unsigned int slot;
+  long long mtime;
+  int duration, records;
+  size_t pos, next;
+  FILE *fh;
+  struct stat st;
+  char *path, *tag;
+
+  fh = fopen(meta_cache_path, "r");
+  if (fh == NULL)
+    return;
+  if (fstat(fileno(fh), &st) == -1 || st.st_size < META_MAGIC_SIZE) {
+    fclose(fh);
+    return;
+  }
+  meta_cache = malloc(st.st_size);
+  if (meta_cache == NULL ||
+      fread(meta_cache, 1, st.st_size, fh) != (size_t)st.st_size ||
+      memcmp(meta_cache, META_MAGIC, META_MAGIC_SIZE) != 0) {
+    free(meta_cache);
+    meta_cache = NULL;
+    fclose(fh);
+    return;
+  }
+  fclose(fh);
+  meta_cache_size = st.st_size;
+
+  records = 0;
+  for (pos = META_MAGIC_SIZE;
+       (next = meta_record(pos, &mtime, &duration, &path, &tag)) != 0;
+       pos = next)
+    records++;
+
+  /* Map paths to records with an open addressing table. */
+  for (meta_cache_mask = 1; meta_cache_mask < (unsigned int)records * 2;
+       meta_cache_mask <<= 1)
+    ;
+  meta_cache_table = calloc(meta_cache_mask, sizeof(size_t));
+  if (meta_cache_table == NULL)
+    return;
+  meta_cache_mask--;
+
+  /* Truncated or damaged, keep what was read so far. */
+  for (pos = META_MAGIC_SIZE;
+       (next = meta_record(pos, &mtime, &duration, &path, &tag)) != 0;
+       pos = next) {
+    for (slot = meta_hash(path) & meta_cache_mask; meta_cache_table[slot] != 0;
+         slot = (slot + 1) & meta_cache_mask)
+      ;
+    meta_cache_table[slot] = pos;
+  }
+}
+
+/* Fill in an entry from the cache, if it is there. */
+static void meta_cache_find(int index)
+{
+  unsigned int slot;
+  long long mtime;
+  int duration;
+  char *path, *record_path, *tag;
+  meta_t *m;
+
+  if (meta_cache_table == NULL)
+    return;
+
+  path = meta_path(index);
+  for (slot = meta_hash(path) & meta_cache_mask; meta_cache_table[slot] != 0;
+       slot = (slot + 1) & meta_cache_mask) {
+    meta_record(meta_cache_table[slot], &mtime, &duration, &record_path, &tag);
+    if (strcmp(record_path, path) == 0) {
+      m = meta_at(index);
+      m->mtime = mtime;
+      m->duration = duration;
+      m->tag = tag;
+      m->state = META_CACHED;
+      break;
+    }
+  }
+}
+
+/* Written to a temporary file first, so a crash never leaves half a cache. */
+static void meta_cache_save(void)
+{
+  unsigned short path_len, tag_len;
+  char *temp, *path;
+  meta_t *m;
+  FILE *fh;
+  int i;
+
+  temp = malloc(strlen(meta_cache_path) + 5);
+  if (temp == NULL)
+    return;
+  sprintf(temp, "%s.tmp", meta_cache_path);
+
+  fh = fopen(temp, "w");
+  if (fh == NULL) {
+    free(temp);
+    return;
+  }
+
+  fwrite(META_MAGIC, 1, META_MAGIC_SIZE, fh);
+  for (i = 0; i < meta_count; i++) {
+    m = meta_at(i);
+    if (m->state == META_UNKNOWN)
+      continue;
+    path = meta_path(i);
+    if (strlen(path) >= 65535 ||
+        (m->tag != NULL && strlen(m->tag) >= 65535))
+      continue;
+    path_len = strlen(path) + 1;
+    tag_len = (m->tag != NULL) ? strlen(m->tag) + 1 : 0;
+    fwrite(&m->mtime, 8, 1, fh);
+    fwrite(&m->duration, 4, 1, fh);
+    fwrite(&path_len, 2, 1, fh);
+    fwrite(&tag_len, 2, 1, fh);
+    fwrite(path, 1, path_len, fh);
+    if (tag_len > 0)
+      fwrite(m->tag, 1, tag_len, fh);
+  }
+
+  if (fclose(fh) == 0)
+    rename(temp, meta_cache_path);
+  else
+    unlink(temp);
+  free(temp);
+}
+
+static void *meta_worker(void *arg)
+{
+  struct stat st;
+  probe_t probe;
+  meta_t *m;
+  char *path, *tag;
+  int i, result;
+
+  /* Stay out of the way of the player and the UI. */
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), META_NICE);
+  syscall(SYS_ioprio_set, 1, syscall(SYS_gettid), META_IOPRIO_IDLE);
+
+  while (1) {
+    /* Claim the next entry, or wait for more to be added. */
+    pthread_mutex_lock(&meta_mutex);
+    while (meta_next >= meta_count && ! meta_quit)
+      pthread_cond_wait(&meta_cond, &meta_mutex);
+    if (meta_quit) {
+      pthread_mutex_unlock(&meta_mutex);
+      break;
+    }
+    i = meta_next++;
+    pthread_mutex_unlock(&meta_mutex);
+    m = meta_at(i);
+    path = meta_path(i);
+    result = -1;
+    tag = NULL;
+
+    if (stat(path, &st) == 0 &&
+        ! (m->state == META_CACHED && m->mtime == (long long)st.st_mtime)) {
+      if (meta_command != NULL)
+        result = probe_command(meta_command, path, &probe, meta_cancel[0]);
+      else
+        result = probe_file(path, &probe);
+      if (result == 0 && probe.tag[0] != '\0')
+        tag = strdup(probe.tag);
+    }
+
+    /* Nothing changes once quitting, so the cache can be saved meanwhile. */
+    pthread_mutex_lock(&meta_mutex);
+    if (meta_quit) {
+      pthread_mutex_unlock(&meta_mutex);
+      free(tag);
+      break;
+    }
+    if (result == 0) {
+      m->mtime = st.st_mtime;
+      __atomic_store_n(&m->duration, probe.duration, __ATOMIC_RELAXED);
+      __atomic_store_n(&m->tag, tag, __ATOMIC_RELEASE);
+      __atomic_store_n(&meta_dirty, 1, __ATOMIC_RELAXED);
+    }
+    if (m->state != META_UNKNOWN || result == 0)
+      __atomic_store_n(&m->state, META_DONE, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&meta_finished, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&meta_mutex);
+  }
+
+  pthread_mutex_lock(&meta_mutex);
+  meta_alive--;
+  pthread_cond_broadcast(&meta_cond);
+  pthread_mutex_unlock(&meta_mutex);
+
+  return NULL;
+}
+
+/* Show cached metadata for the entries right away, and probe the files in
+   the background, with the command if given, to fill in or refresh it. */
+int meta_start(const char *cache_path, const char *command, int count,
+  char *(*path)(uint32_t index))
+{
+  sigset_t all, old;
+  long cores;
+
+  meta_path = path;
+  meta_command = command;
+  meta_started = 1;
+
+  if (cache_path != NULL) {
+    meta_cache_path = strdup(cache_path);
+    if (meta_cache_path != NULL)
+      meta_cache_load();
+  }
+  if (meta_grow(count) != 0)
+    return -1;
+  if (pipe2(meta_cancel, O_CLOEXEC) == -1)
+    meta_cancel[0] = meta_cancel[1] = -1; /* Commands cannot be killed. */
+
+  cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1)
+    cores = 1;
+  if (cores > META_WORKERS_MAX)
+    cores = META_WORKERS_MAX;
+
+  /* Signal handlers touch curses, so keep them on the main thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (meta_threads = 0; meta_threads < cores; meta_threads++) {
+    pthread_mutex_lock(&meta_mutex);
+    meta_alive++;
+    pthread_mutex_unlock(&meta_mutex);
+    if (pthread_create(&meta_thread[meta_threads], NULL, meta_worker,
+        NULL) != 0) {
+      pthread_mutex_lock(&meta_mutex);
+      meta_alive--;
+      pthread_mutex_unlock(&meta_mutex);
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return 0;
+}
+
+/* There are now "count" entries, probe the new ones too. */
+int meta_grow(int count)
+{
+  int i, old;
+
+  if (! meta_started || count <= meta_count)
+    return 0;
+
+  while (meta_chunks * META_CHUNK < count) {
+    if (meta_chunks >= META_CHUNKS_MAX)
+      return -1;
+    meta_chunk[meta_chunks] = calloc(META_CHUNK, sizeof(meta_t));
+    if (meta_chunk[meta_chunks] == NULL)
+      return -1;
+    meta_chunks++;
+  }
+
+  /* Entries are filled in before the workers may see them. */
+  for (i = meta_count; i < count; i++)
+    meta_cache_find(i);
+
+  pthread_mutex_lock(&meta_mutex);
+  old = meta_count;
+  meta_count = count;
+  if (old == meta_next)
+    pthread_cond_broadcast(&meta_cond); /* Workers may be waiting. */
+  pthread_mutex_unlock(&meta_mutex);
+
+  return 0;
+}
+
+/* Returns 1 if anything is known about the entry. */
+int meta_get(uint32_t index, const char **tag, int *duration)
+{
+  meta_t *m;
+
+  if (index >= (uint32_t)meta_count)
+    return 0;
+  m = meta_at(index);
+  if (__atomic_load_n(&m->state, __ATOMIC_ACQUIRE) == META_UNKNOWN)
+    return 0;
+
+  *tag = __atomic_load_n(&m->tag, __ATOMIC_ACQUIRE);
+  *duration = __atomic_load_n(&m->duration, __ATOMIC_RELAXED);
+  return 1;
+}
+
+int meta_busy(void)
+{
+  return meta_threads > 0 &&
+    __atomic_load_n(&meta_finished, __ATOMIC_RELAXED) < meta_count;
+}
+
+void meta_stop(void)
+{
+  struct timespec until;
+  meta_t *m;
+  int i, stuck;
+
+  if (! meta_started)
+    return;
+
+  /* Probe commands are killed, but a file on a hung mount cannot be
+     interrupted, so workers are only waited for so long. */
+  pthread_mutex_lock(&meta_mutex);
+  meta_quit = 1;
+  pthread_cond_broadcast(&meta_cond);
+  if (meta_cancel[1] != -1)
+    close(meta_cancel[1]);
+  meta_cancel[1] = -1;
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += META_STOP_WAIT;
+  while (meta_alive > 0 &&
+         pthread_cond_timedwait(&meta_cond, &meta_mutex, &until) != ETIMEDOUT)
+    ;
+  stuck = meta_alive;
+  pthread_mutex_unlock(&meta_mutex);
+
+  for (i = 0; i < meta_threads; i++) {
+    if (stuck > 0)
+      pthread_detach(meta_thread[i]);
+    else
+      pthread_join(meta_thread[i], NULL);
+  }
+  meta_threads = 0;
+
+  if (meta_dirty && meta_cache_path != NULL)
+    meta_cache_save();
+
+  /* Stuck workers still point into the entries, left for the exit. */
+  if (stuck > 0)
+    return;
+  if (meta_cancel[0] != -1)
+    close(meta_cancel[0]);
+  meta_cancel[0] = -1;
+
+  /* Tags from the cache live in it, the others were probed. */
+  for (i = 0; i < meta_count; i++) {
+    m = meta_at(i);
+    if (m->tag < meta_cache || m->tag >= meta_cache + meta_cache_size)
+      free(m->tag);
+  }
+  for (i = 0; i < meta_chunks; i++)
+    free(meta_chunk[i]);
+  meta_chunks = 0;
+  meta_count = 0;
+  meta_started = 0;
+  free(meta_cache_table);
+  meta_cache_table = NULL;
+  free(meta_cache);
+  meta_cache = NULL;
+  meta_cache_size = 0;
+  free(meta_cache_path);
+  meta_cache_path = NULL;
+}
@@ -0,0 +1,13 @@
+#ifndef _META_H
+#define _META_H
+
+#include <stdint.h>
+
+int meta_start(const char *cache_path, const char *command, int count,
+  char *(*path)(uint32_t index));
+int meta_grow(int count);
+int meta_get(uint32_t index, const char **tag, int *duration);
+int meta_busy(void);
+void meta_stop(void);
+
+#endif /* _META_H */
@@ -1,23 +1,70 @@
+#define _GNU_SOURCE /* pipe2() */
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
 #include "play.h"
 
 static int play_pid = 0;
+static int play_signal_fd = -1;
 static void (*play_finished_handler)(void) = NULL;
 static char *play_program = NULL;
 
-static void play_finished(int signo)
+/* A player forked ahead of time, waiting on a pipe to be released. */
+static int play_spawn_enabled = 0;
+static int play_spawn_pid = 0;
+static int play_spawn_fd = -1;
+static char *play_spawn_arg = NULL;
+
+/* Files are read ahead on a thread, opening one can block for a while. */
+static pthread_mutex_t play_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t play_prefetch_cond = PTHREAD_COND_INITIALIZER;
+static char *play_prefetch_path = NULL; /* Next one, only the latest. */
+static int play_prefetch_started = 0;
+
+/* Child exits are read from a signalfd by the event loop, instead of running
+   code in a signal handler. Must be called before any threads are created,
+   so that they inherit the blocked SIGCHLD. Returns the descriptor. */
+int play_init(void)
 {
-  int status;
+  sigset_t ss;
 
-  waitpid(play_pid, &status, 0);
-  play_pid = 0;
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &ss, NULL) == -1)
+    return -1;
+
+  play_signal_fd = signalfd(-1, &ss, SFD_NONBLOCK | SFD_CLOEXEC);
+  return play_signal_fd;
+}
+
+/* Call when the descriptor from play_init() is readable. */
+void play_reap(void)
+{
+  struct signalfd_siginfo info;
+  int status, finished;
+
+  /* Signals of the same kind are merged, so only drain and check them all. */
+  while (read(play_signal_fd, &info, sizeof(info)) == sizeof(info))
+    ;
+
+  /* Only wait for children of this module, the probe runs commands and
+     waits for them itself. */
+  finished = 0;
+  if (play_pid > 0 && waitpid(play_pid, &status, WNOHANG) == play_pid) {
+    play_pid = 0;
+    finished = 1;
+  }
+  if (play_spawn_pid > 0 &&
+      waitpid(play_spawn_pid, &status, WNOHANG) == play_spawn_pid)
+    play_spawn_pid = 0;
 
-  if (play_finished_handler != NULL)
+  if (finished && play_finished_handler != NULL)
     (play_finished_handler)();
 }
 
@@ -31,19 +78,160 @@ void play_set_program(char *program)
   play_program = program;
 }
 
+void play_set_spawn(int enabled)
+{
+  play_spawn_enabled = enabled;
+}
+
+/* Restore the signal mask, since it survives exec, and redirect standard I/O
+   to prevent child program writing to the TTY. */
+static void play_child_prepare(void)
+{
+  sigset_t ss;
+  int fd;
+
+  sigemptyset(&ss);
+  sigprocmask(SIG_SETMASK, &ss, NULL);
+
+  close(0);
+  close(1);
+  close(2);
+  fd = open("/dev/null", O_RDWR);
+  if (fd == 0) {
+    dup(0);
+    dup(0);
+  }
+}
+
+/* Get rid of the spare player, it exits when the pipe is closed. */
+static void play_spawn_discard(void)
+{
+  int status;
+
+  if (play_spawn_fd == -1)
+    return;
+
+  close(play_spawn_fd);
+  play_spawn_fd = -1;
+  if (play_spawn_pid > 0)
+    waitpid(play_spawn_pid, &status, 0);
+  play_spawn_pid = 0;
+  play_spawn_arg = NULL;
+}
+
+static void play_spawn(char *arg)
+{
+  int fd[2];
+  char go;
+
+  if (play_spawn_fd != -1) {
+    if (strcmp(play_spawn_arg, arg) == 0)
+      return; /* Already waiting for it. */
+    play_spawn_discard();
+  }
+
+  if (pipe2(fd, O_CLOEXEC) == -1)
+    return;
+
+  play_spawn_pid = fork();
+  if (play_spawn_pid == -1) {
+    play_spawn_pid = 0;
+    close(fd[0]);
+    close(fd[1]);
+    return;
+  }
+
+  if (play_spawn_pid == 0) {
+    close(fd[1]);
+    play_child_prepare();
+    /* Anything but a released byte means the spare is no longer wanted. */
+    if (read(fd[0], &go, 1) != 1)
+      _exit(0);
+    execlp(play_program, play_program, arg, NULL);
+    _exit(1);
+  }
+
+  close(fd[0]);
+  play_spawn_fd = fd[1];
+  play_spawn_arg = arg;
+}
+
+static void *play_prefetch_worker(void *arg)
+{
+  char *path;
+  int fd;
+
+  pthread_mutex_lock(&play_prefetch_mutex);
+  while (1) {
+    while (play_prefetch_path == NULL)
+      pthread_cond_wait(&play_prefetch_cond, &play_prefetch_mutex);
+    path = play_prefetch_path;
+    play_prefetch_path = NULL;
+    pthread_mutex_unlock(&play_prefetch_mutex);
+
+    fd = open(path, O_RDONLY);
+    if (fd != -1) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+    free(path);
+
+    pthread_mutex_lock(&play_prefetch_mutex);
+  }
+
+  return NULL;
+}
+
+/* Hand the file to the read ahead thread, starting it the first time. */
+static void play_prefetch_file(char *arg)
+{
+  pthread_t thread;
+  sigset_t all, old;
+  char *path;
+
+  path = strdup(arg);
+  if (path == NULL)
+    return;
+
+  pthread_mutex_lock(&play_prefetch_mutex);
+  free(play_prefetch_path);
+  play_prefetch_path = path;
+  pthread_cond_signal(&play_prefetch_cond);
+  pthread_mutex_unlock(&play_prefetch_mutex);
+
+  if (play_prefetch_started)
+    return;
+
+  /* Signals are handled on the main thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if (pthread_create(&thread, NULL, play_prefetch_worker, NULL) == 0) {
+    pthread_detach(thread);
+    play_prefetch_started = 1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Warm up the next track while the current one plays, by reading it into the
+   page cache and optionally forking its player ahead of time. */
+void play_prefetch(char *arg)
+{
+  if (play_program == NULL)
+    return;
+
+  play_prefetch_file(arg);
+
+  if (play_spawn_enabled)
+    play_spawn(arg);
+}
+
 void play_cancel(void)
 {
   int status;
-  struct sigaction sa;
 
   if (play_pid == 0)
     return; /* Nothing is executing, cannot cancel. */
 
-  sa.sa_handler = SIG_IGN;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
-  sigaction(SIGCHLD, &sa, NULL);
-
   kill(play_pid, SIGINT);
 
   waitpid(play_pid, &status, 0);
@@ -52,8 +240,7 @@ void play_cancel(void)
 
 void play_execute(char *arg)
 {
-  struct sigaction sa;
-  int fd0, fd1, fd2;
+  char go = 1;
 
   if (play_program == NULL)
     return;
@@ -61,38 +248,24 @@ void play_execute(char *arg)
   if (play_pid > 0)
     return; /* Already running, cannot execute. */
 
-  sa.sa_handler = play_finished;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
-  sigaction(SIGCHLD, &sa, NULL);
+  /* Release the spare player if it is waiting for this one. */
+  if (play_spawn_fd != -1 && play_spawn_pid > 0 &&
+      strcmp(play_spawn_arg, arg) == 0) {
+    if (write(play_spawn_fd, &go, 1) == 1) {
+      play_pid = play_spawn_pid;
+      close(play_spawn_fd);
+      play_spawn_fd = -1;
+      play_spawn_pid = 0;
+      play_spawn_arg = NULL;
+      return;
+    }
+  }
+  play_spawn_discard();
 
   play_pid = fork();
   if (play_pid == 0) {
-    /* Redirect standard I/O to prevent child program writing to the TTY. */
-    close(0);
-    close(1);
-    close(2);
-    fd0 = open("/dev/null", O_RDWR);
-    fd1 = dup(0);
-    fd2 = dup(0);
-
+    play_child_prepare();
     execlp(play_program, play_program, arg, NULL);
+    _exit(1);
   }
 }
-
-void play_block(void)
-{
-  sigset_t ss;
-  sigemptyset(&ss);
-  sigaddset(&ss, SIGCHLD);
-  sigprocmask(SIG_BLOCK, &ss, NULL);
-}
-
-void play_unblock(void)
-{
-  sigset_t ss;
-  sigemptyset(&ss);
-  sigaddset(&ss, SIGCHLD);
-  sigprocmask(SIG_UNBLOCK, &ss, NULL);
-}
-
@@ -1,11 +1,13 @@
 #ifndef _PLAY_H
 #define _PLAY_H
 
+int play_init(void);
+void play_reap(void);
 void play_finished_handler_install(void (*handler)(void));
 void play_set_program(char *program);
 void play_cancel(void);
 void play_execute(char *arg);
-void play_block(void);
-void play_unblock(void);
+void play_prefetch(char *arg);
+void play_set_spawn(int enabled);
 
 #endif /* _PLAY_H */
@@ -0,0 +1,479 @@
+#define _GNU_SOURCE /* pipe2() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> /* strncasecmp() */
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "probe.h"
+
+#define PROBE_HEADER_SIZE 65536 /* Read from the start of each file. */
+#define PROBE_TEXT_MAX 64
+#define PROBE_OUTPUT_MAX 4096
+
+extern char **environ;
+
+static unsigned int probe_be32(const unsigned char *p)
+{
+  return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned int probe_le32(const unsigned char *p)
+{
+  return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+static unsigned int probe_syncsafe(const unsigned char *p)
+{
+  return ((p[0] & 0x7f) << 21) | ((p[1] & 0x7f) << 14) |
+         ((p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+/* Append a code point as UTF-8, if it fits. */
+static size_t probe_utf8(char *out, size_t used, size_t max, unsigned int c)
+{
+  if (c < 0x20)
+    c = ' '; /* Control characters would upset the terminal. */
+
+  if (c < 0x80 && used + 1 < max) {
+    out[used++] = c;
+  } else if (c >= 0x80 && c < 0x800 && used + 2 < max) {
+    out[used++] = 0xc0 | (c >> 6);
+    out[used++] = 0x80 | (c & 0x3f);
+  } else if (c >= 0x800 && used + 3 < max) {
+    out[used++] = 0xe0 | (c >> 12);
+    out[used++] = 0x80 | ((c >> 6) & 0x3f);
+    out[used++] = 0x80 | (c & 0x3f);
+  }
+  out[used] = '\0';
+  return used;
+}
+
+/* Decode text in one of the ID3v2 encodings, which are also used for the
+   plain Latin-1 (0) and UTF-8 (3) text in other formats. */
+static void probe_text(const unsigned char *p, size_t len, int encoding,
+  char *out, size_t max)
+{
+  size_t i, used;
+  unsigned int c;
+  int big_endian;
+
+  used = 0;
+  out[0] = '\0';
+
+  if (encoding == 1 || encoding == 2) {
+    /* UTF-16, with a byte order mark unless big endian is given. */
+    big_endian = (encoding == 2);
+    i = 0;
+    if (encoding == 1 && len >= 2) {
+      big_endian = (p[0] == 0xfe && p[1] == 0xff);
+      i = 2;
+    }
+    for (; i + 1 < len; i += 2) {
+      c = big_endian ? (p[i] << 8) | p[i + 1] : (p[i + 1] << 8) | p[i];
+      if (c == 0)
+        break;
+      if (c >= 0xd800 && c <= 0xdfff)
+        c = '?'; /* Outside the basic plane, not worth decoding. */
+      used = probe_utf8(out, used, max, c);
+    }
+    return;
+  }
+
+  for (i = 0; i < len && p[i] != '\0'; i++) {
+    if (encoding == 3 || p[i] < 0x80) {
+      if (used + 1 < max)
+        out[used++] = (p[i] < 0x20) ? ' ' : p[i];
+      out[used] = '\0';
+    } else {
+      used = probe_utf8(out, used, max, p[i]);
+    }
+  }
+}
+
+/* Compose the tag as "Artist - Title", from whatever is known. */
+static void probe_tag_set(probe_t *probe, const char *artist,
+  const char *title)
+{
+  if (artist[0] != '\0' && title[0] != '\0')
+    snprintf(probe->tag, PROBE_TAG_MAX, "%s - %s", artist, title);
+  else
+    snprintf(probe->tag, PROBE_TAG_MAX, "%s", artist[0] ? artist : title);
+}
+
+/* Returns the size of the ID3v2 tag at the start of the file, or 0. */
+static size_t probe_id3v2(const unsigned char *h, size_t size, probe_t *probe,
+  char *artist, char *title)
+{
+  size_t tag_size, pos, end, frame_size;
+  char text[PROBE_TEXT_MAX];
+  int version;
+
+  if (size < 10 || memcmp(h, "ID3", 3) != 0)
+    return 0;
+
+  version = h[3];
+  tag_size = probe_syncsafe(&h[6]) + 10;
+  if (h[5] & 0x10)
+    tag_size += 10; /* Footer. */
+  if (version < 3)
+    return tag_size; /* Old frame layout, only skip it. */
+
+  pos = 10;
+  if (h[5] & 0x40) {
+    /* Extended header. */
+    if (size < 14)
+      return tag_size;
+    pos += (version == 4) ? probe_syncsafe(&h[10]) : probe_be32(&h[10]) + 4;
+  }
+
+  end = (tag_size < size) ? tag_size : size;
+  while (pos + 10 <= end && h[pos] != '\0') {
+    frame_size = (version == 4) ?
+      probe_syncsafe(&h[pos + 4]) : probe_be32(&h[pos + 4]);
+    if (frame_size < 1 || pos + 10 + frame_size > end)
+      break;
+
+    if (memcmp(&h[pos], "TPE1", 4) == 0) {
+      probe_text(&h[pos + 11], frame_size - 1, h[pos + 10],
+        artist, PROBE_TEXT_MAX);
+    } else if (memcmp(&h[pos], "TIT2", 4) == 0) {
+      probe_text(&h[pos + 11], frame_size - 1, h[pos + 10],
+        title, PROBE_TEXT_MAX);
+    } else if (memcmp(&h[pos], "TLEN", 4) == 0) {
+      probe_text(&h[pos + 11], frame_size - 1, h[pos + 10],
+        text, sizeof(text));
+      if (atol(text) > 0)
+        probe->duration = atol(text) / 1000; /* Milliseconds. */
+    }
+
+    pos += 10 + frame_size;
+  }
+
+  return tag_size;
+}
+
+static void probe_id3v1(int fd, off_t file_size, char *artist, char *title)
+{
+  unsigned char t[128];
+  int i;
+
+  if (file_size < 128 || pread(fd, t, 128, file_size - 128) != 128)
+    return;
+  if (memcmp(t, "TAG", 3) != 0)
+    return;
+
+  /* Fields are padded with spaces or zeroes. */
+  for (i = 32; i >= 3 && (t[i] == ' ' || t[i] == '\0'); i--)
+    t[i] = '\0';
+  for (i = 62; i >= 33 && (t[i] == ' ' || t[i] == '\0'); i--)
+    t[i] = '\0';
+
+  if (title[0] == '\0')
+    probe_text(&t[3], 30, 0, title, PROBE_TEXT_MAX);
+  if (artist[0] == '\0')
+    probe_text(&t[33], 30, 0, artist, PROBE_TEXT_MAX);
+}
+
+/* Duration of MPEG audio layer III, from a Xing or VBRI header when the
+   bitrate is variable, otherwise estimated from the constant bitrate. */
+static int probe_mpeg(const unsigned char *p, size_t size, off_t data_size)
+{
+  static const int bitrate_v1[16] =
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0};
+  static const int bitrate_v2[16] =
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0};
+  static const int sample_rate_v1[4] = {44100, 48000, 32000, 0};
+  int version, bitrate, sample_rate, samples, side;
+  size_t i, x;
+
+  for (i = 0; i + 4 <= size; i++) {
+    if (p[i] != 0xff || (p[i + 1] & 0xe0) != 0xe0)
+      continue;
+    version = (p[i + 1] >> 3) & 3; /* 3 is MPEG-1, 2 MPEG-2, 0 MPEG-2.5 */
+    if (version == 1 || ((p[i + 1] >> 1) & 3) != 1)
+      continue; /* Reserved, or not layer III. */
+    bitrate = (version == 3) ?
+      bitrate_v1[p[i + 2] >> 4] : bitrate_v2[p[i + 2] >> 4];
+    sample_rate = sample_rate_v1[(p[i + 2] >> 2) & 3];
+    if (bitrate == 0 || sample_rate == 0)
+      continue;
+    if (version != 3)
+      sample_rate /= (version == 2) ? 2 : 4;
+    samples = (version == 3) ? 1152 : 576;
+
+    /* Xing or Info header right after the side information. */
+    if ((p[i + 3] >> 6) == 3)
+      side = (version == 3) ? 17 : 9; /* Mono. */
+    else
+      side = (version == 3) ? 32 : 17;
+    x = i + 4 + side;
+    if (x + 12 <= size &&
+        (memcmp(&p[x], "Xing", 4) == 0 || memcmp(&p[x], "Info", 4) == 0) &&
+        (probe_be32(&p[x + 4]) & 1))
+      return (long long)probe_be32(&p[x + 8]) * samples / sample_rate;
+
+    x = i + 36;
+    if (x + 18 <= size && memcmp(&p[x], "VBRI", 4) == 0)
+      return (long long)probe_be32(&p[x + 14]) * samples / sample_rate;
+
+    return (data_size * 8) / (bitrate * 1000);
+  }
+
+  return -1;
+}
+
+static void probe_flac(int fd, probe_t *probe, char *artist, char *title)
+{
+  unsigned char h[4], *d;
+  unsigned long long total;
+  unsigned int sample_rate, len, count, i, pos, n;
+  off_t offset;
+  int last, type;
+
+  d = malloc(PROBE_HEADER_SIZE);
+  if (d == NULL)
+    return;
+
+  /* Walk the metadata blocks, reading only the two that are needed. */
+  offset = 4;
+  do {
+    if (pread(fd, h, 4, offset) != 4)
+      break;
+    last = h[0] & 0x80;
+    type = h[0] & 0x7f;
+    len = (h[1] << 16) | (h[2] << 8) | h[3];
+    offset += 4;
+
+    n = (len < PROBE_HEADER_SIZE) ? len : PROBE_HEADER_SIZE;
+    if (type == 0 && len >= 18 && pread(fd, d, 18, offset) == 18) {
+      sample_rate = (d[10] << 12) | (d[11] << 4) | (d[12] >> 4);
+      total = ((unsigned long long)(d[13] & 0x0f) << 32) | probe_be32(&d[14]);
+      if (sample_rate > 0 && total > 0)
+        probe->duration = total / sample_rate;
+
+    } else if (type == 4 && pread(fd, d, n, offset) == n && n >= 8) {
+      /* Vorbis comments, little endian lengths and "KEY=value" strings. */
+      /* Lengths are checked against what is left, so they cannot wrap. */
+      len = probe_le32(d);
+      if (len > n - 8)
+        break;
+      pos = 4 + len;
+      count = probe_le32(&d[pos]);
+      pos += 4;
+      for (i = 0; i < count && n - pos >= 4; i++) {
+        len = probe_le32(&d[pos]);
+        pos += 4;
+        if (len > n - pos)
+          break;
+        if (len > 7 && strncasecmp((char *)&d[pos], "ARTIST=", 7) == 0)
+          probe_text(&d[pos + 7], len - 7, 3, artist, PROBE_TEXT_MAX);
+        else if (len > 6 && strncasecmp((char *)&d[pos], "TITLE=", 6) == 0)
+          probe_text(&d[pos + 6], len - 6, 3, title, PROBE_TEXT_MAX);
+        pos += len;
+      }
+      break; /* Nothing more of interest. */
+    }
+
+    offset += len;
+  } while (! last);
+
+  free(d);
+}
+
+static void probe_wav(const unsigned char *h, size_t size, probe_t *probe)
+{
+  unsigned int byte_rate, len;
+  size_t pos;
+
+  byte_rate = 0;
+  for (pos = 12; pos + 8 <= size; pos += 8 + len + (len & 1)) {
+    len = probe_le32(&h[pos + 4]);
+    if (memcmp(&h[pos], "fmt ", 4) == 0 && pos + 20 <= size) {
+      byte_rate = probe_le32(&h[pos + 16]);
+    } else if (memcmp(&h[pos], "data", 4) == 0) {
+      if (byte_rate > 0)
+        probe->duration = len / byte_rate;
+      break;
+    }
+    if (len > size)
+      break;
+  }
+}
+
+/* Fill in what the file headers tell, for MP3, FLAC and WAV files. */
+int probe_file(const char *path, probe_t *probe)
+{
+  char artist[PROBE_TEXT_MAX], title[PROBE_TEXT_MAX];
+  unsigned char *h;
+  struct stat st;
+  ssize_t size;
+  size_t tag_size;
+  int fd;
+
+  probe->duration = -1;
+  probe->tag[0] = '\0';
+  artist[0] = title[0] = '\0';
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  h = malloc(PROBE_HEADER_SIZE);
+  if (h == NULL || fstat(fd, &st) == -1) {
+    free(h);
+    close(fd);
+    return -1;
+  }
+
+  size = pread(fd, h, PROBE_HEADER_SIZE, 0);
+  if (size > 0) {
+    if (size >= 4 && memcmp(h, "fLaC", 4) == 0) {
+      probe_flac(fd, probe, artist, title);
+    } else if (size >= 12 &&
+               memcmp(h, "RIFF", 4) == 0 && memcmp(&h[8], "WAVE", 4) == 0) {
+      probe_wav(h, size, probe);
+    } else {
+      tag_size = probe_id3v2(h, size, probe, artist, title);
+      probe_id3v1(fd, st.st_size, artist, title);
+      if (probe->duration == -1) {
+        /* The audio starts after the tag, which may hold large pictures. */
+        if (tag_size > 0)
+          size = pread(fd, h, PROBE_HEADER_SIZE, tag_size);
+        if (size > 0 && (off_t)tag_size < st.st_size)
+          probe->duration = probe_mpeg(h, size, st.st_size - tag_size);
+      }
+    }
+  }
+  probe_tag_set(probe, artist, title);
+
+  free(h);
+  close(fd);
+  return 0;
+}
+
+/* Run the command with the path as its last argument. The first line of
+   output is the duration in seconds, any other lines make up the tag. When
+   "cancel" becomes readable, or hangs up, the command is killed. */
+int probe_command(const char *command, const char *path, probe_t *probe,
+  int cancel)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  char output[PROBE_OUTPUT_MAX], discard[PROBE_OUTPUT_MAX];
+  char *script, *argv[6], *line, *next, *end;
+  struct pollfd fds[2];
+  sigset_t none;
+  ssize_t n;
+  size_t used, len, i;
+  double seconds;
+  pid_t pid;
+  int fd[2], status, result, cancelled;
+
+  probe->duration = -1;
+  probe->tag[0] = '\0';
+
+  script = malloc(strlen(command) + 8);
+  if (script == NULL)
+    return -1;
+  sprintf(script, "%s \"$1\"", command);
+  argv[0] = "sh";
+  argv[1] = "-c";
+  argv[2] = script;
+  argv[3] = "sh";
+  argv[4] = (char *)path;
+  argv[5] = NULL;
+
+  if (pipe2(fd, O_CLOEXEC) == -1) {
+    free(script);
+    return -1;
+  }
+
+  /* Signals blocked for the event loop must not stay blocked in the child.
+     Its own process group, so what the shell starts can be killed too. */
+  sigemptyset(&none);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+    POSIX_SPAWN_SETPGROUP);
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, fd[1], 1);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+  result = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  free(script);
+  close(fd[1]);
+  if (result != 0) {
+    close(fd[0]);
+    return -1;
+  }
+
+  fds[0].fd = fd[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = cancel;
+  fds[1].events = POLLIN;
+  used = 0;
+  cancelled = 0;
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents != 0) {
+      /* Not reaped yet, so the group cannot be someone else's. */
+      kill(-pid, SIGKILL);
+      cancelled = 1;
+      break;
+    }
+
+    if (used < sizeof(output) - 1) {
+      n = read(fd[0], output + used, sizeof(output) - used - 1);
+      if (n > 0)
+        used += n;
+    } else {
+      n = read(fd[0], discard, sizeof(discard)); /* Let the command finish. */
+    }
+    if (n <= 0)
+      break;
+  }
+  output[used] = '\0';
+  close(fd[0]);
+  waitpid(pid, &status, 0);
+  if (cancelled)
+    return -1;
+
+  line = output;
+  next = strchr(line, '\n');
+  if (next != NULL)
+    *next++ = '\0';
+  seconds = strtod(line, &end);
+  if (end != line && seconds >= 0)
+    probe->duration = seconds + 0.5;
+
+  for (line = next; line != NULL && *line != '\0'; line = next) {
+    next = strchr(line, '\n');
+    if (next != NULL)
+      *next++ = '\0';
+    len = strlen(probe->tag);
+    if (line[0] != '\0' && len + 4 < PROBE_TAG_MAX)
+      snprintf(probe->tag + len, PROBE_TAG_MAX - len, "%s%s",
+        (len > 0) ? " - " : "", line);
+  }
+  for (i = 0; probe->tag[i] != '\0'; i++) {
+    if ((unsigned char)probe->tag[i] < 0x20)
+      probe->tag[i] = ' '; /* Control characters would upset the terminal. */
+  }
+
+  return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef _PROBE_H
+#define _PROBE_H
+
+#define PROBE_TAG_MAX 128
+
+typedef struct probe_s {
+  int duration; /* Seconds, -1 if unknown. */
+  char tag[PROBE_TAG_MAX]; /* Empty if unknown. */
+} probe_t;
+
+int probe_file(const char *path, probe_t *probe);
+int probe_command(const char *command, const char *path, probe_t *probe,
+  int cancel);
+
+#endif /* _PROBE_H */
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> /* strcasecmp() */
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "scan.h"
+
+#define SCAN_THREADS_MAX 16
+#define SCAN_EXTENSIONS_MAX 64
+
+typedef struct scan_work_s {
+  char *path;
+  struct scan_work_s *next;
+} scan_work_t;
+
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+static scan_work_t *scan_queue = NULL;
+static int scan_active = 0; /* Workers currently busy. */
+static int scan_running = 0; /* Workers not yet finished. */
+static int scan_quit = 0;
+static pthread_t scan_thread[SCAN_THREADS_MAX];
+static int scan_threads = 0;
+
+/* Paths found so far and not yet taken, separated by terminators. */
+static char *scan_output = NULL;
+static size_t scan_output_used = 0;
+static size_t scan_output_size = 0;
+
+static char *scan_extension[SCAN_EXTENSIONS_MAX];
+static int scan_extensions = 0;
+static char *scan_extension_list = NULL;
+
+static int scan_wanted(const char *name)
+{
+  const char *dot;
+  int i;
+
+  dot = strrchr(name, '.');
+  if (dot == NULL)
+    return 0;
+  for (i = 0; i < scan_extensions; i++) {
+    if (strcasecmp(dot + 1, scan_extension[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int scan_compare(const void *p1, const void *p2)
+{
+  return strcmp(*(char **)p1, *(char **)p2);
+}
+
+/* Must be called with the mutex held. */
+static void scan_push(char *path)
+{
+  scan_work_t *work;
+
+  work = malloc(sizeof(scan_work_t));
+  if (work == NULL) {
+    free(path);
+    return;
+  }
+  work->path = path;
+  work->next = scan_queue;
+  scan_queue = work;
+  pthread_cond_signal(&scan_cond);
+}
+
+/* Append the files of one directory in one go, so they stay together. */
+static void scan_emit(const char *dir, char **name, int count)
+{
+  size_t len, dir_len, needed;
+  char *grown;
+  int i;
+
+  dir_len = strlen(dir);
+  needed = 0;
+  for (i = 0; i < count; i++)
+    needed += dir_len + strlen(name[i]) + 2;
+
+  pthread_mutex_lock(&scan_mutex);
+  if (scan_output_used + needed > scan_output_size) {
+    len = scan_output_size * 2;
+    if (len < scan_output_used + needed)
+      len = scan_output_used + needed;
+    grown = realloc(scan_output, len);
+    if (grown == NULL) {
+      pthread_mutex_unlock(&scan_mutex);
+      return;
+    }
+    scan_output = grown;
+    scan_output_size = len;
+  }
+  for (i = 0; i < count; i++) {
+    scan_output_used += sprintf(&scan_output[scan_output_used], "%s/%s",
+      dir, name[i]) + 1;
+  }
+  pthread_mutex_unlock(&scan_mutex);
+}
+
+/* Lists one directory, queueing the directories and emitting the files. */
+static void scan_walk(const char *path)
+{
+  DIR *dh;
+  struct dirent *entry;
+  struct stat st;
+  char **file, **dir, **grown, *sub;
+  int files, dirs, files_size, dirs_size, is_dir, i;
+
+  dh = opendir(path);
+  if (dh == NULL)
+    return;
+
+  file = dir = NULL;
+  files = dirs = files_size = dirs_size = 0;
+  while ((entry = readdir(dh))) {
+    if (entry->d_name[0] == '.')
+      continue; /* Hidden, and the directory itself and its parent. */
+
+    if (entry->d_type == DT_DIR) {
+      is_dir = 1;
+    } else if (entry->d_type == DT_REG) {
+      is_dir = 0;
+    } else if (entry->d_type == DT_LNK) {
+      /* Linked files are followed, linked directories could loop. */
+      if (fstatat(dirfd(dh), entry->d_name, &st, 0) == -1 ||
+          ! S_ISREG(st.st_mode))
+        continue;
+      is_dir = 0;
+    } else {
+      if (fstatat(dirfd(dh), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        continue;
+      is_dir = S_ISDIR(st.st_mode);
+      if (! is_dir && ! S_ISREG(st.st_mode))
+        continue;
+    }
+
+    if (! is_dir && ! scan_wanted(entry->d_name))
+      continue;
+
+    if (is_dir) {
+      if (dirs >= dirs_size) {
+        dirs_size = (dirs_size == 0) ? 16 : dirs_size * 2;
+        grown = realloc(dir, sizeof(char *) * dirs_size);
+        if (grown == NULL)
+          break;
+        dir = grown;
+      }
+      dir[dirs] = strdup(entry->d_name);
+      if (dir[dirs] != NULL)
+        dirs++;
+    } else {
+      if (files >= files_size) {
+        files_size = (files_size == 0) ? 16 : files_size * 2;
+        grown = realloc(file, sizeof(char *) * files_size);
+        if (grown == NULL)
+          break;
+        file = grown;
+      }
+      file[files] = strdup(entry->d_name);
+      if (file[files] != NULL)
+        files++;
+    }
+  }
+  closedir(dh);
+
+  /* Sorted, so albums play in track order. */
+  qsort(file, files, sizeof(char *), scan_compare);
+  scan_emit(path, file, files);
+  for (i = 0; i < files; i++)
+    free(file[i]);
+  free(file);
+
+  /* Pushed in reverse, so the first one is taken first. */
+  qsort(dir, dirs, sizeof(char *), scan_compare);
+  pthread_mutex_lock(&scan_mutex);
+  for (i = dirs - 1; i >= 0; i--) {
+    sub = malloc(strlen(path) + strlen(dir[i]) + 2);
+    if (sub != NULL) {
+      sprintf(sub, "%s/%s", path, dir[i]);
+      scan_push(sub);
+    }
+    free(dir[i]);
+  }
+  pthread_mutex_unlock(&scan_mutex);
+  free(dir);
+}
+
+static void *scan_worker(void *arg)
+{
+  scan_work_t *work;
+
+  pthread_mutex_lock(&scan_mutex);
+  while (! scan_quit) {
+    while (scan_queue == NULL && scan_active > 0 && ! scan_quit)
+      pthread_cond_wait(&scan_cond, &scan_mutex);
+    if (scan_queue == NULL || scan_quit)
+      break; /* Nothing queued and nobody left to queue more. */
+
+    work = scan_queue;
+    scan_queue = work->next;
+    scan_active++;
+    pthread_mutex_unlock(&scan_mutex);
+
+    scan_walk(work->path);
+    free(work->path);
+    free(work);
+
+    pthread_mutex_lock(&scan_mutex);
+    scan_active--;
+    if (scan_active == 0 && scan_queue == NULL)
+      pthread_cond_broadcast(&scan_cond);
+  }
+  scan_running--;
+  pthread_mutex_unlock(&scan_mutex);
+
+  return NULL;
+}
+
+/* Walk the directories in the background, for files with one of the comma
+   separated extensions. Found paths are collected with scan_take(). */
+int scan_start(char **dirs, int count, const char *extensions)
+{
+  sigset_t all, old;
+  char *path, *token, *save;
+  size_t len;
+  long n;
+  int i;
+
+  scan_extension_list = strdup(extensions);
+  if (scan_extension_list == NULL)
+    return -1;
+  for (token = strtok_r(scan_extension_list, ",", &save);
+       token != NULL && scan_extensions < SCAN_EXTENSIONS_MAX;
+       token = strtok_r(NULL, ",", &save)) {
+    if (token[0] == '.')
+      token++;
+    scan_extension[scan_extensions++] = token;
+  }
+
+  pthread_mutex_lock(&scan_mutex);
+  for (i = count - 1; i >= 0; i--) {
+    path = strdup(dirs[i]);
+    if (path == NULL)
+      continue;
+    len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+      path[--len] = '\0';
+    scan_push(path);
+  }
+  pthread_mutex_unlock(&scan_mutex);
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  if (n > SCAN_THREADS_MAX)
+    n = SCAN_THREADS_MAX;
+
+  /* Signal handlers touch curses, so keep them on the main thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (scan_threads = 0; scan_threads < n; scan_threads++) {
+    pthread_mutex_lock(&scan_mutex);
+    scan_running++;
+    pthread_mutex_unlock(&scan_mutex);
+    if (pthread_create(&scan_thread[scan_threads], NULL, scan_worker,
+        NULL) != 0) {
+      pthread_mutex_lock(&scan_mutex);
+      scan_running--;
+      pthread_mutex_unlock(&scan_mutex);
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return (scan_threads > 0) ? 0 : -1;
+}
+
+/* Returns the paths found since the last call, or NULL if none. The caller
+   must free the buffer, which holds "len" bytes of terminated paths. */
+char *scan_take(size_t *len)
+{
+  char *taken;
+
+  pthread_mutex_lock(&scan_mutex);
+  taken = scan_output;
+  *len = scan_output_used;
+  if (scan_output_used == 0)
+    taken = NULL;
+  else
+    scan_output = NULL;
+  if (taken != NULL) {
+    scan_output_used = 0;
+    scan_output_size = 0;
+  }
+  pthread_mutex_unlock(&scan_mutex);
+
+  return taken;
+}
+
+/* Returns 1 while walking, or while there are paths left to take. */
+int scan_busy(void)
+{
+  int busy;
+
+  pthread_mutex_lock(&scan_mutex);
+  busy = (scan_running > 0 || scan_output_used > 0);
+  pthread_mutex_unlock(&scan_mutex);
+
+  return busy;
+}
+
+void scan_stop(void)
+{
+  scan_work_t *work;
+  int i;
+
+  pthread_mutex_lock(&scan_mutex);
+  scan_quit = 1;
+  pthread_cond_broadcast(&scan_cond);
+  pthread_mutex_unlock(&scan_mutex);
+
+  for (i = 0; i < scan_threads; i++)
+    pthread_join(scan_thread[i], NULL);
+  scan_threads = 0;
+
+  while (scan_queue != NULL) {
+    work = scan_queue;
+    scan_queue = work->next;
+    free(work->path);
+    free(work);
+  }
+  free(scan_output);
+  scan_output = NULL;
+  scan_output_used = scan_output_size = 0;
+  free(scan_extension_list);
+  scan_extension_list = NULL;
+  scan_extensions = 0;
+}
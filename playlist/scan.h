@@ -0,0 +1,13 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h>
+
+#define SCAN_EXTENSIONS "mp3,flac,ogg,opus,m4a,aac,wav,wma,mpc,ape,wv,mod,xm,it,s3m"
+
+int scan_start(char **dirs, int count, const char *extensions);
+char *scan_take(size_t *len);
+int scan_busy(void);
+void scan_stop(void);
+
+#endif /* _SCAN_H */
@@ -0,0 +1,297 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "sort.h"
+
+#define SORT_THREADS_MAX 8
+#define SORT_SERIAL_MAX 16384 /* Not worth starting threads below this. */
+#define SORT_INSERTION_MAX 32
+#define SORT_DEPTH 16 /* Bytes of the key sorted at a time. */
+
+/* The index with sixteen bytes of its key, so comparing stays in the array.
+   Reading the key is what takes time, and both halves are read together. */
+typedef struct sort_item_s {
+  uint64_t key[2];
+  uint32_t index;
+} sort_item_t;
+
+typedef struct sort_job_s {
+  sort_item_t *item;
+  sort_item_t *temp;
+  int start;
+  int end;
+  int depth; /* Of the keys filled by the fill workers. */
+  sort_key_t key;
+  void *arg;
+  int *next; /* Shared, the next group to sort, for the group workers. */
+  int *group;
+  int *group_depth;
+  int groups;
+} sort_job_t;
+
+static int sort_less(const sort_item_t *a, const sort_item_t *b)
+{
+  return a->key[0] < b->key[0] ||
+    (a->key[0] == b->key[0] && a->key[1] < b->key[1]);
+}
+
+static int sort_equal(const sort_item_t *a, const sort_item_t *b)
+{
+  return a->key[0] == b->key[0] && a->key[1] == b->key[1];
+}
+
+static void sort_insertion(sort_item_t *item, int count)
+{
+  sort_item_t current;
+  int i, j;
+
+  for (i = 1; i < count; i++) {
+    current = item[i];
+    for (j = i; j > 0 && sort_less(&current, &item[j - 1]); j--)
+      item[j] = item[j - 1];
+    item[j] = current;
+  }
+}
+
+static void sort_fill_item(sort_item_t *item, int depth, sort_key_t key,
+  void *arg)
+{
+  item->key[0] = key(item->index, depth, arg);
+  item->key[1] = key(item->index, depth + 8, arg);
+}
+
+/* Least significant byte first, skipping bytes that are the same for all. */
+static void sort_radix(sort_item_t *item, sort_item_t *temp, int count)
+{
+  int histogram[256], offset[256];
+  sort_item_t *src, *dst, *swap;
+  int byte, half, shift, i, b;
+
+  src = item;
+  dst = temp;
+  for (byte = 0; byte < SORT_DEPTH; byte++) {
+    half = (byte < 8) ? 1 : 0;
+    shift = (byte % 8) * 8;
+
+    memset(histogram, 0, sizeof(histogram));
+    for (i = 0; i < count; i++)
+      histogram[(src[i].key[half] >> shift) & 0xff]++;
+    if (histogram[(src[0].key[half] >> shift) & 0xff] == count)
+      continue;
+
+    offset[0] = 0;
+    for (b = 1; b < 256; b++)
+      offset[b] = offset[b - 1] + histogram[b - 1];
+    for (i = 0; i < count; i++)
+      dst[offset[(src[i].key[half] >> shift) & 0xff]++] = src[i];
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != item)
+    memcpy(item, src, sizeof(sort_item_t) * count);
+}
+
+/* Sort items whose keys are equal before "depth", by the next bytes and
+   then each run of equal ones by the bytes after. */
+static void sort_group(sort_item_t *item, sort_item_t *temp, int count,
+  int depth, sort_key_t key, void *arg)
+{
+  int i, start;
+
+  if (count < 2)
+    return;
+  for (i = 0; i < count; i++)
+    sort_fill_item(&item[i], depth, key, arg);
+  if (count <= SORT_INSERTION_MAX)
+    sort_insertion(item, count);
+  else
+    sort_radix(item, temp, count);
+
+  for (start = 0, i = 1; i <= count; i++) {
+    if (i == count || ! sort_equal(&item[i], &item[start])) {
+      sort_group(&item[start], &temp[start], i - start, depth + SORT_DEPTH,
+        key, arg);
+      start = i;
+    }
+  }
+}
+
+static void *sort_fill(void *arg)
+{
+  sort_job_t *job = arg;
+  int i;
+
+  for (i = job->start; i < job->end; i++)
+    sort_fill_item(&job->item[i], job->depth, job->key, job->arg);
+  return NULL;
+}
+
+static void *sort_groups(void *arg)
+{
+  sort_job_t *job = arg;
+  int g, start, end;
+
+  while ((g = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED)) <
+         job->groups) {
+    start = job->group[g];
+    end = job->group[g + 1];
+    sort_group(&job->item[start], &job->temp[start], end - start,
+      job->group_depth[g], job->key, job->arg);
+  }
+  return NULL;
+}
+
+/* Run the jobs on their own threads, the last one on this thread. */
+static void sort_jobs(void *(*work)(void *), sort_job_t *job, int count)
+{
+  pthread_t thread[SORT_THREADS_MAX];
+  int started[SORT_THREADS_MAX];
+  sigset_t all, old;
+  int i;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (i = 0; i < count - 1; i++)
+    started[i] = (pthread_create(&thread[i], NULL, work, &job[i]) == 0);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  work(&job[count - 1]);
+  for (i = 0; i < count - 1; i++) {
+    if (started[i])
+      pthread_join(thread[i], NULL);
+    else
+      work(&job[i]); /* Could not start it, do it here instead. */
+  }
+}
+
+/* Read the keys at "depth" of the items from "start" to "end" on all
+   cores, and sort them by those. */
+static void sort_step(sort_job_t *job, int cores, int start, int end,
+  int depth)
+{
+  int i;
+
+  for (i = 0; i < cores; i++) {
+    job[i].start = start + (int)((long long)(end - start) * i / cores);
+    job[i].end = start + (int)((long long)(end - start) * (i + 1) / cores);
+    job[i].depth = depth;
+  }
+  sort_jobs(sort_fill, job, cores);
+  sort_radix(&job[0].item[start], &job[0].temp[start], end - start);
+}
+
+/* Sort the indexes by their keys, most significant bytes first. The first
+   bytes are read and sorted for all at once, then the runs that share them
+   are sorted further on all cores, each on its own. */
+int sort_indexes(uint32_t *index, int count, sort_key_t key, void *arg)
+{
+  sort_job_t job[SORT_THREADS_MAX];
+  sort_item_t *item, *temp;
+  int *group, *group_depth, *split_group, *split_depth, *swap;
+  long cores;
+  int groups, splits, split, next, start, end, depth, g, i;
+
+  if (count < 2)
+    return 0;
+  cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores > SORT_THREADS_MAX)
+    cores = SORT_THREADS_MAX;
+  if (cores < 2 || count < SORT_SERIAL_MAX)
+    cores = 1;
+
+  item = malloc(sizeof(sort_item_t) * count);
+  temp = malloc(sizeof(sort_item_t) * count);
+  group = malloc(sizeof(int) * (count + 1));
+  group_depth = malloc(sizeof(int) * count);
+  split_group = malloc(sizeof(int) * (count + 1));
+  split_depth = malloc(sizeof(int) * count);
+  if (item == NULL || temp == NULL || group == NULL || group_depth == NULL ||
+      split_group == NULL || split_depth == NULL) {
+    free(item);
+    free(temp);
+    free(group);
+    free(group_depth);
+    free(split_group);
+    free(split_depth);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++)
+    item[i].index = index[i];
+  for (i = 0; i < cores; i++) {
+    job[i].item = item;
+    job[i].temp = temp;
+    job[i].key = key;
+    job[i].arg = arg;
+    job[i].next = &next;
+  }
+  sort_step(job, cores, 0, count, 0);
+
+  groups = 0;
+  for (i = 0; i < count; i++) {
+    if (i == 0 || ! sort_equal(&item[i], &item[i - 1])) {
+      group[groups] = i;
+      group_depth[groups++] = SORT_DEPTH;
+    }
+  }
+  group[groups] = count;
+
+  /* Runs too big for one core, like paths that share a long prefix, are
+     taken a step further on all cores first, until none is left. */
+  do {
+    split = 0;
+    splits = 0;
+    for (g = 0; g < groups; g++) {
+      start = group[g];
+      end = group[g + 1];
+      depth = group_depth[g];
+      if (cores < 2 || end - start < SORT_SERIAL_MAX) {
+        split_group[splits] = start;
+        split_depth[splits++] = depth;
+        continue;
+      }
+
+      sort_step(job, cores, start, end, depth);
+      for (i = start; i < end; i++) {
+        if (i == start || ! sort_equal(&item[i], &item[i - 1])) {
+          split_group[splits] = i;
+          split_depth[splits++] = depth + SORT_DEPTH;
+        }
+      }
+      split = 1;
+    }
+    split_group[splits] = count;
+
+    swap = group;
+    group = split_group;
+    split_group = swap;
+    swap = group_depth;
+    group_depth = split_depth;
+    split_depth = swap;
+    groups = splits;
+  } while (split);
+
+  next = 0;
+  for (i = 0; i < cores; i++) {
+    job[i].group = group;
+    job[i].group_depth = group_depth;
+    job[i].groups = groups;
+  }
+  sort_jobs(sort_groups, job, cores);
+
+  for (i = 0; i < count; i++)
+    index[i] = item[i].index;
+  free(item);
+  free(temp);
+  free(group);
+  free(group_depth);
+  free(split_group);
+  free(split_depth);
+
+  return 0;
+}
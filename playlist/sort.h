@@ -0,0 +1,12 @@
+#ifndef _SORT_H
+#define _SORT_H
+
+#include <stdint.h>
+
+/* Returns the eight bytes of the sort key of the index at "depth", first
+   byte highest, with zeroes past its end. Keys must all differ. */
+typedef uint64_t (*sort_key_t)(uint32_t index, int depth, void *arg);
+
+int sort_indexes(uint32_t *index, int count, sort_key_t key, void *arg);
+
+#endif /* _SORT_H */
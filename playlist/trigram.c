@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "trigram.h"
+
+/* Characters are case folded down to 6 bits, so a trigram fits in 18 bits.
+   Folding may put unrelated characters in the same class, which only adds
+   candidates that are rejected later when verified against the text. */
+#define TRIGRAM_BITS 6
+#define TRIGRAM_KEYS (1 << (TRIGRAM_BITS * 3))
+
+typedef struct trigram_list_s {
+  uint32_t *id; /* Sorted, since IDs are added in increasing order. */
+  int size;
+  int capacity;
+} trigram_list_t;
+
+static trigram_list_t *trigram_table = NULL;
+
+static unsigned int trigram_fold(unsigned char c)
+{
+  c = tolower(c);
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 1;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 27;
+  return 37 + (c % 27);
+}
+
+static unsigned int trigram_key(const char *p)
+{
+  return (trigram_fold(p[0]) << (TRIGRAM_BITS * 2)) |
+         (trigram_fold(p[1]) << TRIGRAM_BITS) |
+          trigram_fold(p[2]);
+}
+
+/* Index the text under the ID, IDs must be added in increasing order. */
+int trigram_add(uint32_t id, const char *text)
+{
+  trigram_list_t *list;
+  uint32_t *grown;
+  size_t i, len;
+
+  if (trigram_table == NULL) {
+    trigram_table = calloc(TRIGRAM_KEYS, sizeof(trigram_list_t));
+    if (trigram_table == NULL)
+      return -1;
+  }
+
+  len = strlen(text);
+  for (i = 0; i + 3 <= len; i++) {
+    list = &trigram_table[trigram_key(&text[i])];
+    if (list->size > 0 && list->id[list->size - 1] == id)
+      continue; /* Same trigram twice in one text. */
+
+    if (list->size >= list->capacity) {
+      list->capacity = (list->capacity == 0) ? 4 : list->capacity * 2;
+      grown = realloc(list->id, sizeof(uint32_t) * list->capacity);
+      if (grown == NULL)
+        return -1;
+      list->id = grown;
+    }
+    list->id[list->size++] = id;
+  }
+
+  return 0;
+}
+
+static int trigram_list_compare(const void *p1, const void *p2)
+{
+  return (*(trigram_list_t **)p1)->size - (*(trigram_list_t **)p2)->size;
+}
+
+/* Intersect sorted "a" with sorted "b" in place, returns the new size of "a".
+   Binary search is used to skip ahead, since "b" is usually much longer. */
+static int trigram_intersect(uint32_t *a, int a_size, const uint32_t *b,
+  int b_size)
+{
+  int i, n, low, high, mid;
+
+  n = 0;
+  low = 0;
+  for (i = 0; i < a_size; i++) {
+    high = b_size;
+    while (low < high) {
+      mid = (low + high) / 2;
+      if (b[mid] < a[i])
+        low = mid + 1;
+      else
+        high = mid;
+    }
+    if (low >= b_size)
+      break;
+    if (b[low] == a[i])
+      a[n++] = a[i];
+  }
+
+  return n;
+}
+
+/* Find IDs whose text may contain the filter, the caller must verify them
+   and free the result. Returns -1 if the filter is too short to use the
+   index, in which case every ID is a candidate. */
+int trigram_candidates(const char *filter, uint32_t **result)
+{
+  trigram_list_t **list;
+  size_t i, len;
+  int n, size;
+
+  len = strlen(filter);
+  if (len < 3)
+    return -1;
+
+  *result = NULL;
+  if (trigram_table == NULL)
+    return 0;
+
+  list = malloc(sizeof(trigram_list_t *) * (len - 2));
+  if (list == NULL)
+    return -1;
+
+  for (i = 0; i + 3 <= len; i++) {
+    list[i] = &trigram_table[trigram_key(&filter[i])];
+    if (list[i]->size == 0) {
+      free(list);
+      return 0; /* Some trigram never occurs, so nothing can match. */
+    }
+  }
+  n = len - 2;
+
+  /* Start from the shortest list to keep the working set small. */
+  qsort(list, n, sizeof(trigram_list_t *), trigram_list_compare);
+
+  *result = malloc(sizeof(uint32_t) * list[0]->size);
+  if (*result == NULL) {
+    free(list);
+    return -1;
+  }
+  memcpy(*result, list[0]->id, sizeof(uint32_t) * list[0]->size);
+  size = list[0]->size;
+
+  for (i = 1; i < n && size > 0; i++) {
+    if (list[i] == list[i - 1])
+      continue; /* Repeated trigram in the filter. */
+    size = trigram_intersect(*result, size, list[i]->id, list[i]->size);
+  }
+
+  free(list);
+  return size;
+}
+
+void trigram_destroy(void)
+{
+  int i;
+
+  if (trigram_table == NULL)
+    return;
+
+  for (i = 0; i < TRIGRAM_KEYS; i++) {
+    free(trigram_table[i].id);
+  }
+  free(trigram_table);
+  trigram_table = NULL;
+}
@@ -0,0 +1,10 @@
+#ifndef _TRIGRAM_H
+#define _TRIGRAM_H
+
+#include <stdint.h>
+
+int trigram_add(uint32_t id, const char *text);
+int trigram_candidates(const char *filter, uint32_t **result);
+void trigram_destroy(void);
+
+#endif /* _TRIGRAM_H */
@@ -5,10 +5,30 @@
 #include <ncurses.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/timerfd.h>
 #include "play.h"
 #include "list.h"
+#include "scan.h"
 
 #define FILTER_LIMIT 50
+#define META_TEXT_MAX 160
+#define TICK_INTERVAL 20 /* Milliseconds, while waiting for background work. */
+#define STATUS_MAX 160
+
+/* What was last drawn on an entry row, to skip rows that did not change. */
+typedef struct row_s {
+  int valid;
+  char *entry; /* Points into the list, so unique per entry. */
+  int selected;
+  int playing;
+  int meta_known;
+  const char *tag;
+  int duration;
+} row_t;
 
 static int scroll_offset  = 0;
 static int selected_entry = 0;
@@ -16,79 +36,238 @@ static char file_filter[FILTER_LIMIT] = {'\0'};
 static int help_hint_active = 1; /* Display at startup. */
 static int help_window_active = 0;
 static WINDOW *help_window = NULL;
+static int filter_play = 0; /* Enter pressed, play when filtered. */
+static int filter_typed = 0; /* Go to the top when the result is in. */
+static int scan_play = 0; /* Play once the scan finds the first entry. */
+static int sort_next = 0; /* Keys to sort by when F3 is pressed next. */
+static const char *sort_hint = NULL; /* What the list was sorted by. */
+
+/* Each sort uses the first key, then the others where it is equal. */
+static const struct {
+  const char *name;
+  int key[3];
+  int keys;
+} sort_keys[] = {
+  {"path", {LIST_SORT_PATH}, 1},
+  {"name", {LIST_SORT_BASENAME, LIST_SORT_PATH}, 2},
+  {"directory", {LIST_SORT_DIRECTORY, LIST_SORT_BASENAME}, 2},
+  {"tag", {LIST_SORT_TAG, LIST_SORT_PATH}, 2},
+  {"duration", {LIST_SORT_DURATION, LIST_SORT_TAG, LIST_SORT_PATH}, 3},
+};
+#define SORT_KEYS (sizeof(sort_keys) / sizeof(sort_keys[0]))
+
+static row_t *rows = NULL;
+static int rows_size = 0;
+static int rows_width = 0;
+static int screen_damaged = 1; /* Redraw everything next time. */
+static char status_drawn[STATUS_MAX * 2 + 2];
+static char filter_drawn[FILTER_LIMIT];
+
+/* Format the known metadata of an entry, returns the length or 0. */
+static int meta_format(int no, char *text, int size)
+{
+  const char *tag;
+  int duration, len;
+
+  if (! list_meta_get(no, &tag, &duration))
+    return 0;
+
+  len = 0;
+  if (tag != NULL)
+    len = snprintf(text, size, "%s  ", tag);
+  if (len >= size)
+    len = size - 1;
+  if (duration >= 3600)
+    len += snprintf(text + len, size - len, "%d:%02d:%02d",
+      duration / 3600, (duration / 60) % 60, duration % 60);
+  else if (duration >= 0)
+    len += snprintf(text + len, size - len, "%d:%02d",
+      duration / 60, duration % 60);
+  else if (len >= 2)
+    len -= 2; /* No trailing separator. */
+  if (len >= size)
+    len = size - 1;
+  text[len] = '\0';
+
+  return len;
+}
 
+/* Columns taken by UTF-8 text, counting each character as one. */
+static int text_columns(const char *text)
+{
+  int n;
+
+  for (n = 0; *text != '\0'; text++) {
+    if ((*text & 0xc0) != 0x80)
+      n++;
+  }
+  return n;
+}
+
+/* Draw a single entry row, after it was found to have changed. */
+static void draw_row(int n, row_t *row, int maxx)
+{
+  int i, meta_len, width;
+  char *meta_text;
+  char meta[META_TEXT_MAX];
+
+  move(n, 0);
+  clrtoeol();
+  if (row->entry == NULL)
+    return;
+
+  /* Metadata goes to the right, taking at most half of the line, and
+     losing the start of the tag first so that the duration stays. */
+  meta_text = meta;
+  meta_len = 0;
+  if (meta_format(n + scroll_offset, meta, sizeof(meta)) > 0) {
+    meta_len = text_columns(meta);
+    while (meta_len > maxx / 2) {
+      meta_text++;
+      if ((*meta_text & 0xc0) != 0x80)
+        meta_len--;
+    }
+  }
+  width = (meta_len > 0) ? maxx - meta_len - 1 : maxx;
+
+  if (row->selected)
+    attron(A_REVERSE);
+  if (row->playing)
+    attron(A_BOLD);
+  mvaddnstr(n, 0, row->entry, width);
+  if (row->selected) {
+    for (i = strlen(row->entry); i < maxx; i++)
+      mvaddch(n, i, ' ');
+  }
+  if (meta_len > 0)
+    mvaddstr(n, maxx - meta_len, meta_text);
+  if (row->playing)
+    attroff(A_BOLD);
+  if (row->selected)
+    attroff(A_REVERSE);
+}
+
+static void draw_help(void)
+{
+  werase(help_window);
+  mvwaddstr(help_window, 1, 1, "F1 - Help");
+  mvwaddstr(help_window, 2, 1, "F3 - Sort list (Again for the next key)");
+  mvwaddstr(help_window, 3, 1, "F4 - Undo shuffle or sort (Again to redo)");
+  mvwaddstr(help_window, 4, 1, "F5 - Go to top (Same as Home key)");
+  mvwaddstr(help_window, 5, 1, "F6 - Go to bottom (Same as End key)");
+  mvwaddstr(help_window, 6, 1, "F7 - Move entry up");
+  mvwaddstr(help_window, 7, 1, "F8 - Move entry down");
+  mvwaddstr(help_window, 8, 1, "F9 - Shuffle list (Also if filtered)");
+  mvwaddstr(help_window, 9, 1, "Escape - Quit");
+  mvwaddstr(help_window, 11, 1,
+    "Use Up/Down Arrow keys and Page Up/Down to scroll and move cursor.");
+  mvwaddstr(help_window, 12, 1,
+    "Use Left or Right Arrow keys to select entry under cursor.");
+  mvwaddstr(help_window, 13, 1,
+    "Type to filter the list, and press Enter to play it from the top.");
+  box(help_window, ACS_VLINE, ACS_HLINE);
+  wsyncup(help_window); /* It shares the lines of the screen. */
+}
+
+/* Only rows whose entry, highlight or metadata changed are drawn again, so
+   moving the cursor or changing track sends just a few lines. */
 static void update_screen(void)
 {
-  int n, i, maxy, maxx, playing;
-  char *entry;
+  int n, maxy, maxx, playing, changed;
+  row_t row, *grown;
+  char status[STATUS_MAX * 2 + 2], hint[STATUS_MAX], scan[STATUS_MAX];
 
   getmaxyx(stdscr, maxy, maxx);
   maxy -= 2;
-  erase();
+  if (maxy < 0)
+    maxy = 0;
+
+  if (maxy != rows_size || maxx != rows_width) {
+    grown = realloc(rows, sizeof(row_t) * (maxy + 1));
+    if (grown == NULL)
+      return;
+    rows = grown;
+    rows_size = maxy;
+    rows_width = maxx;
+    screen_damaged = 1;
+  }
+
+  /* The help covers rows, which must come back once it is closed. */
+  if (! help_window_active && help_window != NULL) {
+    delwin(help_window);
+    help_window = NULL;
+    screen_damaged = 1;
+  }
+
+  if (screen_damaged) {
+    erase();
+    for (n = 0; n < rows_size; n++)
+      rows[n].valid = 0;
+    status_drawn[0] = '\0';
+    filter_drawn[0] = '\0';
+  }
 
   /* Draw entries. */
+  changed = screen_damaged;
   for (n = 0; n < maxy; n++) {
-    if ((n + scroll_offset) >= list_size_get())
-      break;
+    memset(&row, 0, sizeof(row));
+    row.valid = 1;
+    row.entry = list_get(n + scroll_offset, &playing);
+    if (row.entry != NULL) {
+      row.selected = (n == (selected_entry - scroll_offset));
+      row.playing = playing;
+      row.meta_known = list_meta_get(n + scroll_offset, &row.tag,
+        &row.duration);
+    }
+    if (memcmp(&row, &rows[n], sizeof(row)) == 0)
+      continue;
 
-    entry = list_get(n + scroll_offset, &playing);
-    if (entry == NULL)
-      break;
+    rows[n] = row;
+    draw_row(n, &row, maxx);
+    changed = 1;
+  }
 
-    if (n == (selected_entry - scroll_offset)) {
+  /* Draw status bar and filter input, when they change. */
+  hint[0] = '\0';
+  if (help_hint_active)
+    snprintf(hint, sizeof(hint), "Press F1 for help.");
+  else if (sort_hint != NULL)
+    snprintf(hint, sizeof(hint), "Sorted by %s.", sort_hint);
+  scan[0] = '\0';
+  if (list_scan_busy())
+    snprintf(scan, sizeof(scan), " Scanning: %d ", list_size_get());
+  snprintf(status, sizeof(status), "%s\n%s", hint, scan);
+  if (screen_damaged || strcmp(status, status_drawn) != 0) {
+    strcpy(status_drawn, status);
+    mvhline(maxy, 0, 0, maxx);
+    if (hint[0] != '\0') {
       attron(A_REVERSE);
-      if (playing)
-        attron(A_BOLD);
-      mvaddnstr(n, 0, entry, maxx);
-      for (i = strlen(entry); i < maxx; i++)
-        mvaddch(n, i, ' ');
-      if (playing)
-        attroff(A_BOLD);
+      mvaddnstr(maxy, 0, hint, maxx);
       attroff(A_REVERSE);
-    } else {
-      if (playing)
-        attron(A_BOLD);
-      mvaddnstr(n, 0, entry, maxx);
-      if (playing)
-        attroff(A_BOLD);
     }
+    if (scan[0] != '\0' && (int)strlen(scan) < maxx)
+      mvaddstr(maxy, maxx - strlen(scan), scan);
   }
-
-  /* Draw status bar and filter input, and let cursor rest there. */
-  mvhline(maxy, 0, 0, maxx);
-  mvprintw(maxy + 1, 0, "> %s", file_filter);
-
-  if (help_hint_active) {
-    attron(A_REVERSE);
-    mvaddstr(maxy, 0, "Press F1 for help.");
-    attroff(A_REVERSE);
+  if (screen_damaged || strcmp(file_filter, filter_drawn) != 0) {
+    strcpy(filter_drawn, file_filter);
+    move(maxy + 1, 0);
+    clrtoeol();
+    mvprintw(maxy + 1, 0, "> %s", file_filter);
   }
 
+  /* Rows drawn under the help cover it, so it goes on top again. */
   if (help_window_active) {
     if (help_window == NULL) {
-      help_window = subwin(stdscr, 13, maxx - 6, 3, 3);
-    }
-    werase(help_window);
-    mvwaddstr(help_window, 1, 1, "F1 - Help");
-    mvwaddstr(help_window, 2, 1, "F5 - Go to top (Same as Home key)");
-    mvwaddstr(help_window, 3, 1, "F6 - Go to bottom (Same as End key)");
-    mvwaddstr(help_window, 4, 1, "F7 - Move entry up");
-    mvwaddstr(help_window, 5, 1, "F8 - Move entry down");
-    mvwaddstr(help_window, 6, 1, "F9 - Shuffle list (Also if filtered)");
-    mvwaddstr(help_window, 7, 1, "Escape - Quit");
-    mvwaddstr(help_window, 9, 1,
-      "Use Up/Down Arrow keys and Page Up/Down to scroll and move cursor.");
-    mvwaddstr(help_window, 10, 1,
-      "Use Left or Right Arrow keys to select entry under cursor.");
-    mvwaddstr(help_window, 11, 1,
-      "Use characters to enter a filter, and press Enter to apply it.");
-    box(help_window, ACS_VLINE, ACS_HLINE);
-  } else {
-    if (help_window != NULL) {
-      delwin(help_window);
-      help_window = NULL;
+      help_window = subwin(stdscr, 15, maxx - 6, 3, 3);
+      changed = 1;
     }
+    if (help_window != NULL && changed)
+      draw_help();
   }
+
+  /* Let the cursor rest at the filter input. */
+  move(maxy + 1, 2 + strlen(file_filter));
+  screen_damaged = 0;
 }
 
 static void exit_handler(void)
@@ -96,11 +275,13 @@ static void exit_handler(void)
   play_cancel();
   list_destroy();
   endwin();
+  free(rows);
 }
 
 static void winch_handler(void)
 {
   endwin(); /* To get new window limits. */
+  screen_damaged = 1;
   update_screen();
   flushinp();
   keypad(stdscr, TRUE);
@@ -114,20 +295,237 @@ static void interrupt_handler(int signo)
 static void finished_handler(void)
 {
   list_request_next();
-  update_screen();
+}
+
+/* Tick periodically while background work is pending, otherwise not at all. */
+static void tick_set(int fd, int active)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (active) {
+    its.it_interval.tv_nsec = TICK_INTERVAL * 1000000L;
+    its.it_value = its.it_interval;
+  }
+  timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* Handle a single key press. Returns 1 if the program should quit. */
+static int key_handler(int c)
+{
+  int maxy, maxx, len;
+
+  getmaxyx(stdscr, maxy, maxx);
+  maxy -= 2;
+
+  /* Don't close the help if interrupted. */
+  if (c > 0) {
+    help_hint_active = help_window_active = 0;
+    sort_hint = NULL;
+  }
+
+  switch (c) {
+  case KEY_RESIZE:
+    /* Use this event instead of SIGWINCH for better portability. */
+    winch_handler();
+    break;
+
+  case KEY_F(10):
+  case KEY_F(1):
+    help_window_active = 1;
+    break;
+
+  case KEY_F(7):
+    list_swap(selected_entry, selected_entry - 1);
+  case KEY_UP:
+    selected_entry--;
+    if (selected_entry < 0)
+      selected_entry++;
+    if (scroll_offset > selected_entry) {
+      scroll_offset--;
+      if (scroll_offset < 0)
+        scroll_offset = 0;
+    }
+    break;
+
+  case KEY_F(8):
+    list_swap(selected_entry, selected_entry + 1);
+  case KEY_DOWN:
+    selected_entry++;
+    if (selected_entry >= list_size_get())
+      selected_entry--;
+    if (selected_entry > maxy - 1) {
+      scroll_offset++;
+      if (scroll_offset > selected_entry - maxy + 1)
+        scroll_offset--;
+    }
+    break;
+
+  case KEY_NPAGE:
+    scroll_offset += maxy / 2;
+    while (maxy + scroll_offset > list_size_get())
+      scroll_offset--;
+    if (scroll_offset < 0)
+      scroll_offset = 0;
+    if (selected_entry < scroll_offset)
+      selected_entry = scroll_offset;
+    break;
+
+  case KEY_PPAGE:
+    scroll_offset -= maxy / 2;
+    if (scroll_offset < 0)
+      scroll_offset = 0;
+    if (selected_entry > maxy + scroll_offset - 1)
+      selected_entry = maxy + scroll_offset - 1;
+    break;
+
+  case KEY_HOME:
+  case KEY_F(5):
+    scroll_offset = 0;
+    selected_entry = 0;
+    break;
+
+  case KEY_END:
+  case KEY_F(6):
+    if (list_size_get() - maxy > 0)
+      scroll_offset = list_size_get() - maxy;
+    selected_entry = list_size_get() - 1;
+    break;
+
+  case KEY_F(9):
+    list_shuffle();
+    break;
+
+  case KEY_F(3):
+    /* Each press sorts by the next key, and says which. */
+    if (list_sort(sort_keys[sort_next].key, sort_keys[sort_next].keys) == 0)
+      sort_hint = sort_keys[sort_next].name;
+    sort_next = (sort_next + 1) % SORT_KEYS;
+    break;
+
+  case KEY_F(4):
+    list_shuffle_undo();
+    break;
+
+  case KEY_LEFT:
+  case KEY_RIGHT:
+    list_request(selected_entry);
+    break;
+
+  case KEY_ENTER:
+  case '\n':
+  case '\r':
+    /* Play the filtered list from the top, once it is ready. */
+    filter_play = 1;
+    break;
+
+  case '\e': /* Escape */
+    return 1;
+
+  case KEY_BACKSPACE:
+  case 0x7f:
+    len = strlen(file_filter);
+    if (len > 0) {
+      file_filter[len - 1] = '\0';
+      list_filter_request(file_filter);
+      filter_typed = 1;
+    }
+    break;
+
+  default:
+    if (! isprint(c))
+      break;
+    len = strlen(file_filter);
+    if (len <= FILTER_LIMIT - 2) {
+      file_filter[len] = c;
+      list_filter_request(file_filter);
+      filter_typed = 1;
+    }
+    break;
+  }
+
+  return 0;
+}
+
+static void usage(char *name)
+{
+  printf("Usage: %s [options] <playlist file> <program>\n", name);
+  printf("       %s [options] --scan <directory>... <program>\n", name);
+  printf("  -s, --spawn       Start the next player ahead of time.\n");
+  printf("  -n, --no-meta     Do not show durations and tags.\n");
+  printf("  -p, --probe <command>\n");
+  printf("                    Get them from a command instead of the file "
+    "headers.\n");
+  printf("  -d, --scan        Find the files in directories instead.\n");
+  printf("  -e, --extensions <list>\n");
+  printf("                    Comma separated, when scanning. (Default: %s)\n",
+    SCAN_EXTENSIONS);
 }
 
 int main(int argc, char *argv[])
 {
-  int c, maxy, maxx, len;
+  static const struct option options[] = {
+    {"spawn", no_argument, NULL, 's'},
+    {"no-meta", no_argument, NULL, 'n'},
+    {"probe", required_argument, NULL, 'p'},
+    {"scan", no_argument, NULL, 'd'},
+    {"extensions", required_argument, NULL, 'e'},
+    {NULL, 0, NULL, 0},
+  };
+  struct pollfd fds[3];
   struct sigaction sa;
+  uint64_t expirations;
+  char *probe_command, *cache_path, *cache_dir, *extensions, *program;
+  int c, ticking, busy, meta_enabled, scan_enabled, args;
+
+  probe_command = NULL;
+  extensions = SCAN_EXTENSIONS;
+  meta_enabled = 1;
+  scan_enabled = 0;
+  args = 0;
+  while ((c = getopt_long(argc, argv, "snp:de:", options, NULL)) != -1) {
+    switch (c) {
+    case 's':
+      /* Fork the next player ahead of time, for gapless changes. */
+      play_set_spawn(1);
+      break;
+    case 'n':
+      meta_enabled = 0;
+      break;
+    case 'p':
+      probe_command = optarg;
+      break;
+    case 'd':
+      scan_enabled = 1;
+      break;
+    case 'e':
+      extensions = optarg;
+      break;
+    default:
+      args = -1; /* Show usage. */
+      break;
+    }
+  }
 
-  if (argc != 3) {
-    printf("Usage: %s <playlist file> <program>\n", argv[0]);
+  /* The program comes last, after the playlist file or the directories. */
+  if (args == 0)
+    args = argc - optind;
+  if (args < 2 || (! scan_enabled && args != 2)) {
+    usage(argv[0]);
     return 1;
   }
+  program = argv[argc - 1];
   
-  if (list_import_file(argv[1]) != 0) {
+  fds[1].fd = play_init();
+  fds[2].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fds[1].fd == -1 || fds[2].fd == -1) {
+    printf("Error: Unable to set up event handling.\n");
+    return 1;
+  }
+  fds[0].fd = STDIN_FILENO;
+  fds[0].events = fds[1].events = fds[2].events = POLLIN;
+
+  if (! scan_enabled && list_import_file(argv[optind]) != 0) {
     printf("Error: Unable to open playlist file.\n");
     return 1;
   }
@@ -138,129 +536,89 @@ int main(int argc, char *argv[])
   sigaction(SIGINT, &sa, NULL);
 
   play_finished_handler_install(finished_handler);
-  play_set_program(argv[2]);
+  play_set_program(program);
+
+  /* Metadata is cached next to the playlist, keyed by path and mtime, or
+     in the user cache directory for scanned files. */
+  if (meta_enabled) {
+    cache_path = NULL;
+    if (! scan_enabled) {
+      cache_path = malloc(strlen(argv[optind]) + 6);
+      if (cache_path != NULL)
+        sprintf(cache_path, "%s.meta", argv[optind]);
+    } else if ((cache_dir = getenv("XDG_CACHE_HOME")) != NULL &&
+               cache_dir[0] != '\0') {
+      cache_path = malloc(strlen(cache_dir) + 20);
+      if (cache_path != NULL)
+        sprintf(cache_path, "%s/playlist-scan.meta", cache_dir);
+    } else if ((cache_dir = getenv("HOME")) != NULL) {
+      cache_path = malloc(strlen(cache_dir) + 27);
+      if (cache_path != NULL)
+        sprintf(cache_path, "%s/.cache/playlist-scan.meta", cache_dir);
+    }
+    list_meta_start(cache_path, probe_command);
+    free(cache_path);
+  }
+
+  /* Entries are added while running, the first one is played when found. */
+  if (scan_enabled) {
+    if (list_scan_start(&argv[optind], args - 1, extensions) != 0) {
+      printf("Error: Unable to start scanning.\n");
+      return 1;
+    }
+    scan_play = 1;
+  }
 
   initscr();
   atexit(exit_handler);
   noecho();
   keypad(stdscr, TRUE);
+  nodelay(stdscr, TRUE);
 
   list_request(0); /* Start right away at startup. */
 
+  /* Every event is handled here, and the screen is redrawn once after. */
+  ticking = 0;
   while (1) {
-    update_screen();
-    getmaxyx(stdscr, maxy, maxx);
-    maxy -= 2;
-    c = getch();
-
-    /* Don't close the help if interrupted. */
-    if (c > 0) {
-      help_hint_active = help_window_active = 0;
+    if (list_filter_poll() && filter_typed) {
+      if (! list_filter_pending())
+        filter_typed = 0;
+      scroll_offset = 0;
+      selected_entry = 0;
     }
-
-    switch (c) {
-    case KEY_RESIZE:
-      /* Use this event instead of SIGWINCH for better portability. */
-      winch_handler();
-      break;
-
-    case KEY_F(10):
-    case KEY_F(1):
-      help_window_active = 1;
-      break;
-
-    case KEY_F(7):
-      list_swap(selected_entry, selected_entry - 1);
-    case KEY_UP:
-      selected_entry--;
-      if (selected_entry < 0)
-        selected_entry++;
-      if (scroll_offset > selected_entry) {
-        scroll_offset--;
-        if (scroll_offset < 0)
-          scroll_offset = 0;
-      }
-      break;
-
-    case KEY_F(8):
-      list_swap(selected_entry, selected_entry + 1);
-    case KEY_DOWN:
-      selected_entry++;
-      if (selected_entry >= list_size_get())
-        selected_entry--;
-      if (selected_entry > maxy - 1) {
-        scroll_offset++;
-        if (scroll_offset > selected_entry - maxy + 1)
-          scroll_offset--;
-      }
-      break;
-
-    case KEY_NPAGE:
-      scroll_offset += maxy / 2;
-      while (maxy + scroll_offset > list_size_get())
-        scroll_offset--;
-      if (scroll_offset < 0)
-        scroll_offset = 0;
-      if (selected_entry < scroll_offset)
-        selected_entry = scroll_offset;
-      break;
-
-    case KEY_PPAGE:
-      scroll_offset -= maxy / 2;
-      if (scroll_offset < 0)
-        scroll_offset = 0;
-      if (selected_entry > maxy + scroll_offset - 1)
-        selected_entry = maxy + scroll_offset - 1;
-      break;
-
-    case KEY_HOME:
-    case KEY_F(5):
+    if (list_scan_poll() && scan_play && list_size_get() > 0) {
+      scan_play = 0;
+      list_request(0);
+    }
+    if (filter_play && ! list_filter_pending()) {
+      filter_play = 0;
       scroll_offset = 0;
       selected_entry = 0;
-      break;
-
-    case KEY_END:
-    case KEY_F(6):
-      if (list_size_get() - maxy > 0)
-        scroll_offset = list_size_get() - maxy;
-      selected_entry = list_size_get() - 1;
-      break;
-
-    case KEY_F(9):
-      list_shuffle();
-      break;
+      if (list_size_get() > 0)
+        list_request(0);
+    }
+    update_screen();
+    refresh(); /* Not left to getch(), which no longer blocks. */
 
-    case KEY_LEFT:
-    case KEY_RIGHT:
-      list_request(selected_entry);
-      break;
+    /* Tick while the filter result, metadata or scan is being worked on. */
+    busy = list_filter_pending() || list_meta_busy() || list_scan_busy();
+    if (ticking != busy) {
+      ticking = busy;
+      tick_set(fds[2].fd, ticking);
+    }
 
-    case KEY_ENTER:
-    case '\n':
-    case '\r':
-      if (list_filter_apply(file_filter) == 0) {
-        scroll_offset = 0;
-        selected_entry = 0;
-      }
+    if (poll(fds, 3, -1) == -1 && errno != EINTR)
       break;
 
-    case '\e': /* Escape */
-      return 0;
+    if (fds[1].revents & POLLIN)
+      play_reap();
+    if (fds[2].revents & POLLIN)
+      read(fds[2].fd, &expirations, sizeof(expirations));
 
-    case KEY_BACKSPACE:
-    case 0x7f:
-      len = strlen(file_filter);
-      if (len > 0)
-        file_filter[len - 1] = '\0';
-      break;
-
-    default:
-      if (! isprint(c))
-        break;
-      len = strlen(file_filter);
-      if (len <= FILTER_LIMIT - 2)
-        file_filter[len] = c;
-      break;
+    /* Also read after an interruption, it may have been a resize. */
+    while ((c = getch()) != ERR) {
+      if (key_handler(c))
+        return 0;
     }
   }
 
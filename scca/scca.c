@@ -5,34 +5,100 @@
 #include <curses.h>
 #include <limits.h>
 #include <locale.h>
-
-#define TEXT_MAX 65536
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "solve.h"
+#include "stats.h"
+
+#define READ_SIZE 65536 /* Initial buffer when the text cannot be mapped. */
 #define SAVE_EXTENSION "scca"
 #define PAGE_OFFSET_SKIP 10
+#define SOLVE_TICK 100 /* Milliseconds between looks at the solver. */
+#define FREQUENCY_WORD_WIDTH 12 /* Longer words are cut in the panel. */
+#define FREQUENCY_PATTERN_MAX 64 /* Longer words sort as if cut. */
+
+enum {
+  FREQUENCY_SORT_COUNT = 0,
+  FREQUENCY_SORT_TEXT,
+  FREQUENCY_SORT_DECIPHERED,
+  FREQUENCY_SORT_PATTERN,
+};
 
 static int allowed_char[UCHAR_MAX];
+static unsigned char alphabet[UCHAR_MAX];
 static unsigned char cipher[UCHAR_MAX];
-static unsigned char text[TEXT_MAX] = {'\0'};
+/* Every byte with the key applied, and as drawn, which is reversed if the
+   key changed it, or 0 if it takes more than one cell. Rebuilt by
+   cipher_update() when the key changes. */
+static unsigned char cipher_plain[UCHAR_MAX + 1];
+static chtype cipher_drawn[UCHAR_MAX + 1];
+/* Upper case of every byte. The text is left as it is in the file, and
+   folded when it is looked at. */
+static unsigned char text_upper[UCHAR_MAX + 1];
+static unsigned int cipher_generation = 0;
+/* The whole text, and where each line starts in it. The last offset is
+   the end of the text. */
+static unsigned char *text = NULL;
+static size_t text_size = 0;
+static int text_mapped = 0;
+static size_t *line = NULL;
+static int line_count = 0;
 static int allowed_char_len;
 static int cipher_pos = 0;
 static int text_offset = 0;
+static double solve_score = 0;
+static const char *screen_message = NULL; /* Until the next key. */
+static int screen_damaged = 1; /* Redraw everything next time. */
+static chtype *screen_row = NULL; /* Text of a row, before it is drawn. */
+static int frequency_kind = STATS_LETTER;
+static int frequency_sort = FREQUENCY_SORT_COUNT;
+
+static void cipher_update(void)
+{
+  int c, upper, plain;
+
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    upper = text_upper[c];
+    plain = upper;
+    if (upper < UCHAR_MAX && allowed_char[upper] != -1 &&
+        cipher[allowed_char[upper]] != ' ')
+      plain = cipher[allowed_char[upper]];
+    cipher_plain[c] = plain;
+
+    if (plain != upper)
+      cipher_drawn[c] = plain | A_REVERSE;
+    else if (isprint(upper))
+      cipher_drawn[c] = upper;
+    else
+      cipher_drawn[c] = 0; /* Tab, or shown like "^A" by unctrl(). */
+  }
+  cipher_generation++;
+}
 
 static void cipher_init(void)
 {
   unsigned char c;
+  int i;
 
   setlocale(LC_ALL, "");
+  for (i = 0; i <= UCHAR_MAX; i++)
+    text_upper[i] = toupper(i);
 
   allowed_char_len = 0;
   for (c = 0; c < UCHAR_MAX; c++) {
     if (isupper(c)) {
       allowed_char[c] = allowed_char_len;
+      alphabet[allowed_char_len] = c;
       allowed_char_len++;
     } else {
       allowed_char[c] = -1;
     }
     cipher[c] = ' ';
   }
+  cipher_update();
 }
 
 static void cipher_erase(void)
@@ -41,54 +107,192 @@ static void cipher_erase(void)
   for (c = 0; c < UCHAR_MAX; c++) {
     cipher[c] = ' ';
   }
+  cipher_update();
 }
 
 static unsigned char cipher_applied(unsigned char plain)
 {
-  unsigned char c;
+  return cipher_plain[plain];
+}
 
-  if (isupper(plain)) {
-    c = allowed_char[plain];
-    if (cipher[c] == ' ') {
-      return plain;
-    } else {
-      return cipher[c];
-    }
-  } else {
-    return plain;
+/* Let the solver work from the letters set so far, or stop it. */
+static void cipher_solve(void)
+{
+  int fixed[SOLVE_LETTERS_MAX];
+  int i;
+
+  if (solve_running()) {
+    solve_stop();
+    return;
+  }
+
+  if (! solve_ready()) {
+    screen_message = "Start with -q <english text> to solve.";
+    return;
+  }
+  if (allowed_char_len > SOLVE_LETTERS_MAX) {
+    screen_message = "Too many letters to solve.";
+    return;
   }
+
+  for (i = 0; i < allowed_char_len; i++) {
+    if (cipher[i] == ' ' || cipher[i] >= UCHAR_MAX)
+      fixed[i] = -1;
+    else
+      fixed[i] = allowed_char[cipher[i]];
+  }
+  solve_score = 0;
+  solve_start(text, text_size, fixed);
 }
 
-static int text_read(char *filename)
+/* Show the best key found so far. Returns 1 if it changed. */
+static int cipher_solve_poll(void)
 {
-  int c, n;
-  FILE *fh;
+  int key[SOLVE_LETTERS_MAX];
+  int i;
 
-  fh = fopen(filename, "r");
-  if (! fh) {
-    fprintf(stderr, "fopen() failed on file: %s\n", filename);
-    return 1;
+  if (! solve_poll(key, &solve_score))
+    return 0;
+  for (i = 0; i < allowed_char_len; i++)
+    cipher[i] = (key[i] == -1) ? ' ' : alphabet[key[i]];
+  cipher_update();
+  return 1;
+}
+
+/* Find where the lines start, counting them first to allocate once. */
+static int text_index(void)
+{
+  unsigned char *p, *end, *newline;
+  int n;
+
+  end = text + text_size;
+  line_count = 0;
+  for (p = text; p < end; p = newline + 1) {
+    newline = memchr(p, '\n', end - p);
+    if (newline == NULL)
+      newline = end;
+    line_count++;
   }
 
-  setlocale(LC_ALL, "");
+  line = malloc(sizeof(size_t) * (line_count + 1));
+  if (line == NULL)
+    return -1;
 
   n = 0;
-  while ((c = fgetc(fh)) != EOF) {
-    if (n > TEXT_MAX)
-      break;
-    if (c == '\r')
-      continue; /* CR causes issues, just strip it. */
-    text[n] = toupper(c);
-    n++;
+  for (p = text; p < end; p = newline + 1) {
+    newline = memchr(p, '\n', end - p);
+    if (newline == NULL)
+      newline = end;
+    line[n++] = p - text;
   }
+  line[n] = text_size;
 
-  fclose(fh);
   return 0;
 }
 
+/* Map the file if possible, only for reading, so its pages are shared with
+   the page cache. Otherwise read all of it. */
+static int text_load(int fd)
+{
+  struct stat st;
+  size_t capacity;
+  ssize_t n;
+  unsigned char *grown;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text != MAP_FAILED) {
+      text_size = st.st_size;
+      text_mapped = 1;
+      return 0;
+    }
+    text = NULL;
+  }
+
+  capacity = READ_SIZE;
+  text = malloc(capacity);
+  while (text != NULL) {
+    if (text_size == capacity) {
+      capacity *= 2;
+      grown = realloc(text, capacity);
+      if (grown == NULL)
+        break;
+      text = grown;
+    }
+    n = read(fd, text + text_size, capacity - text_size);
+    if (n <= 0)
+      return (n == 0) ? 0 : -1;
+    text_size += n;
+  }
+  return -1;
+}
+
+/* CR causes issues, just strip it. Mapped text is copied for that, which
+   is only needed for files that have any. */
+static int text_strip(void)
+{
+  unsigned char *stripped;
+  size_t i, n;
+
+  if (memchr(text, '\r', text_size) == NULL)
+    return 0;
+
+  stripped = text;
+  if (text_mapped) {
+    stripped = malloc(text_size);
+    if (stripped == NULL)
+      return -1;
+  }
+  n = 0;
+  for (i = 0; i < text_size; i++) {
+    if (text[i] != '\r')
+      stripped[n++] = text[i];
+  }
+
+  if (text_mapped)
+    munmap(text, text_size);
+  text = stripped;
+  text_size = n;
+  text_mapped = 0;
+  return 0;
+}
+
+static int text_read(char *filename)
+{
+  int fd, error;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "open() failed on file: %s\n", filename);
+    return 1;
+  }
+  error = text_load(fd);
+  close(fd);
+  if (error != 0) {
+    fprintf(stderr, "Could not read file: %s\n", filename);
+    return 1;
+  }
+
+  if (text_strip() != 0 || text_index() != 0) {
+    fprintf(stderr, "Out of memory for file: %s\n", filename);
+    return 1;
+  }
+  return 0;
+}
+
+/* Scroll by a number of lines, but not past the last one. */
+static void text_scroll(int lines)
+{
+  text_offset += lines;
+  if (text_offset > line_count - 1)
+    text_offset = line_count - 1;
+  if (text_offset < 0)
+    text_offset = 0;
+}
+
 static void text_save(char *old_filename)
 {
-  int i;
+  size_t i;
   FILE *fh;
   static char new_filename[PATH_MAX];
 
@@ -100,11 +304,8 @@ static void text_save(char *old_filename)
   if (fh == NULL) {
     mvprintw(0, 0, "Could not open file for writing: %s", new_filename);
   } else {
-    for (i = 0; i < TEXT_MAX; i++) {
-      if (text[i] == '\0')
-        break;
+    for (i = 0; i < text_size; i++)
       fputc(cipher_applied(text[i]), fh);
-    }
     mvprintw(0, 0, "Deciphered text saved to: %s", new_filename);
   }
   fclose(fh);
@@ -113,8 +314,10 @@ static void text_save(char *old_filename)
   refresh();
 
   flushinp();
+  timeout(-1); /* Even while solving. */
   getch(); /* Wait for keypress. */
   flushinp();
+  screen_damaged = 1;
 }
 
 static void display_help(void)
@@ -129,54 +332,228 @@ static void display_help(void)
   mvprintw(6,  0, "Space:       Erase cipher character.");
   mvprintw(7,  0, "[A-Z]:       Insert cipher character.");
   mvprintw(8,  0, "F1 / F5:     Display this help.");
-  mvprintw(9,  0, "F2 / F6:     Display character frequency.");
+  mvprintw(9,  0, "F2 / F6:     Display letter, bigram, trigram and word frequency.");
   mvprintw(10, 0, "F3 / F7:     Reset cipher. (Erase all.)");
   mvprintw(11, 0, "F4 / F8:     Save deciphered text to file.");
-  mvprintw(12, 0, "F10:         Quit");
-  mvprintw(14, 0, "Press any key to contiue...");
+  mvprintw(12, 0, "F9:          Solve the rest of the cipher. (Again to stop.)");
+  mvprintw(13, 0, "F10:         Quit");
+  mvprintw(15, 0, "Press any key to contiue...");
   refresh();
 
   flushinp();
+  timeout(-1); /* Even while solving. */
   getch(); /* Wait for keypress. */
   flushinp();
+  screen_damaged = 1;
 }
 
-static void display_frequency(void)
+static int frequency_text_compare(const unsigned char *a,
+  const unsigned char *b, int len)
 {
-  int count[UCHAR_MAX];
-  int i, y, x, maxy, maxx;
-  unsigned char c;
+  int i, n;
 
-  for (c = 0; c < UCHAR_MAX; c++) {
-    count[c] = 0;
+  for (i = 0; i < len; i++) {
+    n = text_upper[a[i]] - text_upper[b[i]];
+    if (n != 0)
+      return n;
   }
+  return 0;
+}
 
-  for (i = 0; i < TEXT_MAX; i++) {
-    if (text[i] == '\0')
-      break;
-    count[text[i]]++;
+/* Sort frequency rows by count, or by one of these first. */
+static int frequency_compare(const void *p1, const void *p2)
+{
+  const stats_row_t *a = p1, *b = p2;
+  char pattern_a[FREQUENCY_PATTERN_MAX], pattern_b[FREQUENCY_PATTERN_MAX];
+  int i, n, len;
+
+  len = (a->len < b->len) ? a->len : b->len;
+  switch (frequency_sort) {
+  case FREQUENCY_SORT_TEXT:
+    n = frequency_text_compare(a->text, b->text, len);
+    if (n != 0 || a->len != b->len)
+      return (n != 0) ? n : a->len - b->len;
+    break;
+
+  case FREQUENCY_SORT_DECIPHERED:
+    for (i = 0; i < len; i++) {
+      n = cipher_applied(a->text[i]) - cipher_applied(b->text[i]);
+      if (n != 0)
+        return n;
+    }
+    if (a->len != b->len)
+      return a->len - b->len;
+    break;
+
+  case FREQUENCY_SORT_PATTERN:
+    if (a->len != b->len)
+      return a->len - b->len;
+    if (len > FREQUENCY_PATTERN_MAX)
+      len = FREQUENCY_PATTERN_MAX;
+    stats_pattern(a->text, len, pattern_a);
+    stats_pattern(b->text, len, pattern_b);
+    n = memcmp(pattern_a, pattern_b, len);
+    if (n != 0)
+      return n;
+    break;
   }
 
-  erase();
-  getmaxyx(stdscr, maxy, maxx);
-  y = x = 0;
-  for (c = 0; c < UCHAR_MAX; c++) {
-    if (! isupper(c))
-      continue;
+  if (a->count != b->count)
+    return (a->count < b->count) ? 1 : -1;
+  n = frequency_text_compare(a->text, b->text, len);
+  return (n != 0) ? n : a->len - b->len;
+}
 
-    mvprintw(y, x, "%c: %d", c, count[c]);
-    x += 10;
-    if (x > (maxx - 10)) {
-      x = 0;
-      y++;
+/* Letters, bigrams, trigrams and words of the text, counted at load, next
+   to how they read with the current key. */
+static void display_frequency(void)
+{
+  static const char *kind_name[STATS_KINDS] =
+    {"Letters", "Bigrams", "Trigrams", "Words"};
+  static const char *sort_name[] =
+    {"count", "text", "deciphered text", "pattern"};
+  char pattern[FREQUENCY_WORD_WIDTH];
+  stats_row_t *row;
+  size_t total;
+  int rows, width, digits, cell, columns, lines, offset, sorted;
+  int i, j, k, y, x, maxy, maxx, len, c;
+
+  offset = 0;
+  sorted = 0;
+  timeout(-1); /* Even while solving. */
+  while (1) {
+    row = stats_get(frequency_kind, &rows, &total);
+    if (! sorted) {
+      qsort(row, rows, sizeof(stats_row_t), frequency_compare);
+      sorted = 1;
+    }
+
+    /* Cipher text, word pattern, deciphered text, count and share. */
+    width = 1;
+    for (i = 0; i < rows; i++) {
+      if (row[i].len > width)
+        width = row[i].len;
+    }
+    if (width > FREQUENCY_WORD_WIDTH)
+      width = FREQUENCY_WORD_WIDTH;
+    digits = snprintf(NULL, 0, "%zu", total);
+    cell = (width + 1) * ((frequency_kind == STATS_WORD) ? 3 : 2) +
+      digits + 9;
+
+    getmaxyx(stdscr, maxy, maxx);
+    columns = (maxx / cell > 0) ? maxx / cell : 1;
+    lines = (maxy - 3 > 0) ? maxy - 3 : 1;
+    if (offset > (rows + columns - 1) / columns - lines)
+      offset = (rows + columns - 1) / columns - lines;
+    if (offset < 0)
+      offset = 0;
+
+    erase();
+    x = 0;
+    for (i = 0; i < STATS_KINDS; i++) {
+      if (i == frequency_kind)
+        attron(A_REVERSE);
+      mvprintw(0, x, " %s ", kind_name[i]);
+      if (i == frequency_kind)
+        attroff(A_REVERSE);
+      x += strlen(kind_name[i]) + 3;
+    }
+    mvprintw(0, x, "Sorted by %s.", sort_name[frequency_sort]);
+
+    for (i = 0; i < lines * columns; i++) {
+      j = offset * columns + i;
+      if (j >= rows)
+        break;
+      y = 2 + i / columns;
+      x = (i % columns) * cell;
+      len = (row[j].len < width) ? row[j].len : width;
+
+      for (k = 0; k < len; k++)
+        mvaddch(y, x + k, text_upper[row[j].text[k]]);
+      x += width + 1;
+      if (frequency_kind == STATS_WORD) {
+        stats_pattern(row[j].text, len, pattern);
+        mvaddnstr(y, x, pattern, len);
+        x += width + 1;
+      }
+      for (k = 0; k < len; k++) {
+        c = cipher_applied(row[j].text[k]);
+        if (c != text_upper[row[j].text[k]])
+          attron(A_REVERSE);
+        mvaddch(y, x + k, c);
+        if (c != text_upper[row[j].text[k]])
+          attroff(A_REVERSE);
+      }
+      x += width + 1;
+      mvprintw(y, x, "%*zu %5.1f%%", digits, row[j].count,
+        (total > 0) ? 100.0 * row[j].count / total : 0.0);
+    }
+
+    mvprintw(maxy - 1, 0, "Left/Right: Kind  Up/Down/PgUp/PgDn: Scroll  "
+      "C/T/D/P: Sort  Other: Return");
+    refresh();
+
+    c = getch();
+    switch (c) {
+    case KEY_RESIZE:
+      break;
+
+    case KEY_LEFT:
+      frequency_kind = (frequency_kind + STATS_KINDS - 1) % STATS_KINDS;
+      offset = sorted = 0;
+      break;
+
+    case KEY_RIGHT:
+      frequency_kind = (frequency_kind + 1) % STATS_KINDS;
+      offset = sorted = 0;
+      break;
+
+    case KEY_UP:
+      offset--;
+      break;
+
+    case KEY_DOWN:
+      offset++;
+      break;
+
+    case KEY_PPAGE:
+      offset -= lines;
+      break;
+
+    case KEY_NPAGE:
+      offset += lines;
+      break;
+
+    case 'c':
+    case 'C':
+      frequency_sort = FREQUENCY_SORT_COUNT;
+      offset = sorted = 0;
+      break;
+
+    case 't':
+    case 'T':
+      frequency_sort = FREQUENCY_SORT_TEXT;
+      offset = sorted = 0;
+      break;
+
+    case 'd':
+    case 'D':
+      frequency_sort = FREQUENCY_SORT_DECIPHERED;
+      offset = sorted = 0;
+      break;
+
+    case 'p':
+    case 'P':
+      frequency_sort = FREQUENCY_SORT_PATTERN;
+      offset = sorted = 0;
+      break;
+
+    default:
+      flushinp();
+      screen_damaged = 1;
+      return;
     }
   }
-  mvprintw(y + 1, 0, "Press any key to contiue...");
-  refresh();
-  
-  flushinp();
-  getch(); /* Wait for keypress. */
-  flushinp();
 }
 
 static void screen_init(void)
@@ -187,13 +564,77 @@ static void screen_init(void)
   keypad(stdscr, TRUE);
 }
 
+/* Draw the text from the first line shown, in rows wrapped at the window
+   width. Each row is translated into a buffer and drawn in one go. */
+static void screen_text(int top, int bottom, int maxx)
+{
+  chtype *grown, drawn;
+  const char *shown;
+  size_t i, end;
+  int y, x, no;
+
+  /* Room for one more character, which may take a few cells. */
+  grown = realloc(screen_row, sizeof(chtype) * (maxx + TABSIZE + 8));
+  if (grown == NULL)
+    return;
+  screen_row = grown;
+
+  y = top;
+  for (no = text_offset; no < line_count && y < bottom; no++) {
+    end = line[no + 1];
+    if (end > line[no] && text[end - 1] == '\n')
+      end--;
+
+    x = 0;
+    for (i = line[no]; i < end && y < bottom; i++) {
+      drawn = cipher_drawn[text[i]];
+      if (drawn != 0) {
+        screen_row[x++] = drawn;
+      } else if (text[i] == '\t') {
+        do {
+          screen_row[x++] = ' ';
+        } while (x % TABSIZE != 0);
+      } else {
+        for (shown = unctrl(text[i]); *shown != '\0'; shown++)
+          screen_row[x++] = (unsigned char)*shown;
+      }
+
+      /* Full rows, what did not fit starts the next one. A character may
+         take more than a row in a narrow window. */
+      while (x >= maxx && y < bottom) {
+        mvaddchnstr(y, 0, screen_row, maxx);
+        memmove(screen_row, &screen_row[maxx], sizeof(chtype) * (x - maxx));
+        x -= maxx;
+        y++;
+      }
+      if (y >= bottom)
+        break;
+    }
+
+    if ((x > 0 || end == line[no]) && y < bottom) {
+      mvaddchnstr(y, 0, screen_row, x);
+      move(y, x); /* Drawing the row did not move the cursor. */
+      clrtoeol();
+      y++;
+    }
+  }
+
+  for (; y < bottom; y++) {
+    move(y, 0);
+    clrtoeol();
+  }
+}
+
 static void screen_update(void)
 {
+  static int drawn_offset, drawn_maxy, drawn_maxx;
+  static unsigned int drawn_generation;
   unsigned char c;
-  int i, y, x, maxy, maxx, skip_newline;
+  int x, maxy, maxx;
 
   getmaxyx(stdscr, maxy, maxx);
-  erase();
+  if (screen_damaged)
+    erase();
 
   /* Alphabet. */
   x = 0;
@@ -218,37 +659,23 @@ static void screen_update(void)
   /* Upper Separation Line */
   mvhline(2, 0, ACS_HLINE, maxx);
 
-  /* Text */
-  skip_newline = text_offset;
-  move(3, 0);
-  for (i = 0; i < TEXT_MAX; i++) {
-    if (text[i] == '\0')
-      break;
-
-    if (skip_newline > 0) {
-      if (text[i] == '\n') {
-        skip_newline--;
-      }
-      continue;
-    }
-
-    c = cipher_applied(text[i]);
-    if (c != text[i]) {
-      attron(A_REVERSE);
-    }
-    addch(c);
-    if (c != text[i]) {
-      attroff(A_REVERSE);
-    }
-
-    getyx(stdscr, y, x);
-    if (y >= (maxy - 1)) {
-      break;
-    }
+  /* Text, only when something it depends on changed. */
+  if (screen_damaged || drawn_offset != text_offset || drawn_maxy != maxy ||
+      drawn_maxx != maxx || drawn_generation != cipher_generation) {
+    screen_text(3, maxy - 1, maxx);
+    drawn_offset = text_offset;
+    drawn_maxy = maxy;
+    drawn_maxx = maxx;
+    drawn_generation = cipher_generation;
   }
+  screen_damaged = 0;
 
   /* Lower Separation Line */
   mvhline(maxy - 1, 0, ACS_HLINE, maxx);
+  if (solve_running())
+    mvprintw(maxy - 1, 1, " Solving, %.3f per quadgram. ", solve_score);
+  else if (screen_message != NULL)
+    mvprintw(maxy - 1, 1, " %s ", screen_message);
 
   move(1, cipher_pos);
   refresh();
@@ -257,6 +684,7 @@ static void screen_update(void)
 static void screen_resize(void)
 {
   endwin(); /* To get new window limits. */
+  screen_damaged = 1;
   screen_update();
   flushinp();
   keypad(stdscr, TRUE);
@@ -265,22 +693,53 @@ static void screen_resize(void)
 
 int main(int argc, char *argv[])
 {
-  int c;
+  int c, running;
+  char *english;
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <filename>\n", argv[0]);
+  english = NULL;
+  while ((c = getopt(argc, argv, "q:")) != -1) {
+    switch (c) {
+    case 'q':
+      english = optarg;
+      break;
+    default:
+      argc = 0; /* Show usage. */
+      break;
+    }
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr, "Usage: %s [-q <english text>] <filename>\n", argv[0]);
+    fprintf(stderr, "  -q  Learn from the text to solve with F9.\n");
     return 0;
   }
 
   cipher_init();
-  if (text_read(argv[1]) != 0) {
+  if (text_read(argv[optind]) != 0) {
+    return 1;
+  }
+  if (stats_build(text, text_size, allowed_char, allowed_char_len,
+      text_upper) != 0) {
+    fprintf(stderr, "Out of memory for file: %s\n", argv[optind]);
+    return 1;
+  }
+  if (english != NULL && solve_init(english, allowed_char, allowed_char_len)
+      != 0) {
+    fprintf(stderr, "Could not learn from file: %s\n", english);
     return 1;
   }
   screen_init();
+  atexit(solve_stop);
 
   while (1) {
+    /* Checked first, so a key offered by the last worker is not missed. */
+    running = solve_running();
+    cipher_solve_poll();
     screen_update();
+    timeout(running ? SOLVE_TICK : -1);
     c = getch();
+    if (c != ERR)
+      screen_message = NULL;
 
     switch (c) {
     case KEY_RESIZE:
@@ -299,25 +758,19 @@ int main(int argc, char *argv[])
       break;
 
     case KEY_UP:
-      text_offset--;
-      if (text_offset < 0)
-        text_offset = 0;
+      text_scroll(-1);
       break;
 
     case KEY_DOWN:
-      text_offset++;
-      /* NOTE: Nothing preventing infinite scrolling... */
+      text_scroll(1);
       break;
 
     case KEY_PPAGE:
-      text_offset -= PAGE_OFFSET_SKIP;
-      if (text_offset < 0)
-        text_offset = 0;
+      text_scroll(-PAGE_OFFSET_SKIP);
       break;
-      
+
     case KEY_NPAGE:
-      text_offset += PAGE_OFFSET_SKIP;
-      /* NOTE: Nothing preventing infinite scrolling... */
+      text_scroll(PAGE_OFFSET_SKIP);
       break;
 
     case KEY_F(1):
@@ -332,24 +785,33 @@ int main(int argc, char *argv[])
 
     case KEY_F(3):
     case KEY_F(7):
+      solve_stop();
       cipher_erase();
       break;
 
     case KEY_F(4):
     case KEY_F(8):
-      text_save(argv[1]);
+      text_save(argv[optind]);
+      break;
+
+    case KEY_F(9):
+      cipher_solve();
       break;
 
     case KEY_F(10):
       exit(0);
 
     case ' ':
+      solve_stop(); /* Would be overwritten. */
       cipher[cipher_pos] = ' ';
+      cipher_update();
       break;
 
     default:
       if (isalpha(c)) {
+        solve_stop();
         cipher[cipher_pos] = toupper(c);
+        cipher_update();
       }
       break;
     }
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "solve.h"
+
+#define SOLVE_THREADS_MAX 16
+#define SOLVE_SAMPLE_MAX 8192 /* Letters of the text scored for each key. */
+#define SOLVE_STALE_MAX 2000 /* Swaps without improvement before a restart. */
+#define SOLVE_QUIT_CHECK 256 /* Swaps between checks for a stop request. */
+
+/* Letters are indexes in the alphabet, and quadgrams pack four of them with
+   SOLVE_SHIFT bits each, so the next one is a shift and a mask away. */
+#define SOLVE_SHIFT 5
+#define SOLVE_QUADGRAMS (1 << (SOLVE_SHIFT * 4))
+#define SOLVE_MASK (SOLVE_QUADGRAMS - 1)
+
+static int solve_letter[UCHAR_MAX]; /* Byte to letter index, or -1. */
+static int solve_letters = 0;
+static float *solve_quadgram = NULL; /* Log probability in English. */
+
+/* Set by solve_start(), only read by the workers. */
+static unsigned char solve_sample[SOLVE_SAMPLE_MAX];
+static int solve_sample_len = 0;
+static int solve_fixed[SOLVE_LETTERS_MAX];
+static int solve_present[SOLVE_LETTERS_MAX];
+static pthread_t solve_thread[SOLVE_THREADS_MAX];
+static int solve_threads = 0;
+
+/* Shared between the UI and the workers. */
+static pthread_mutex_t solve_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int solve_quit = 0;
+static int solve_alive = 0; /* Workers not yet finished. */
+static int solve_best[SOLVE_LETTERS_MAX];
+static double solve_best_score = 0;
+static unsigned int solve_best_generation = 0;
+
+/* Only used by the UI. */
+static unsigned int solve_polled = 0;
+
+static int solve_index(int c)
+{
+  c = toupper(c);
+  if (c < 0 || c >= UCHAR_MAX)
+    return -1;
+  return solve_letter[c];
+}
+
+/* Learn how likely each run of four letters is from English text in the
+   file, ignoring anything between letters, like spaces. */
+int solve_init(const char *path, const int *letter, int letters)
+{
+  unsigned char buffer[BUFSIZ];
+  unsigned int *count, q;
+  double total, floor;
+  size_t n, i;
+  int seen, index;
+  FILE *fh;
+
+  if (letters > SOLVE_LETTERS_MAX)
+    return -1;
+  memcpy(solve_letter, letter, sizeof(solve_letter));
+  solve_letters = letters;
+
+  fh = fopen(path, "r");
+  if (fh == NULL)
+    return -1;
+  count = calloc(SOLVE_QUADGRAMS, sizeof(unsigned int));
+  if (count == NULL) {
+    fclose(fh);
+    return -1;
+  }
+
+  q = 0;
+  seen = 0;
+  total = 0;
+  while ((n = fread(buffer, 1, sizeof(buffer), fh)) > 0) {
+    for (i = 0; i < n; i++) {
+      index = solve_index(buffer[i]);
+      if (index == -1)
+        continue;
+      q = ((q << SOLVE_SHIFT) | index) & SOLVE_MASK;
+      if (++seen >= 4) {
+        count[q]++;
+        total++;
+      }
+    }
+  }
+  fclose(fh);
+
+  if (total == 0) {
+    free(count);
+    return -1;
+  }
+
+  solve_quadgram = malloc(sizeof(float) * SOLVE_QUADGRAMS);
+  if (solve_quadgram == NULL) {
+    free(count);
+    return -1;
+  }
+  /* Unseen ones are unlikely, not impossible. */
+  floor = log10(0.01 / total);
+  for (i = 0; i < SOLVE_QUADGRAMS; i++)
+    solve_quadgram[i] = (count[i] > 0) ? log10(count[i] / total) : floor;
+  free(count);
+
+  return 0;
+}
+
+/* How English the sample looks deciphered with the key. */
+static double solve_fitness(const int *key)
+{
+  unsigned int q;
+  double score;
+  int i;
+
+  q = 0;
+  score = 0;
+  for (i = 0; i < solve_sample_len; i++) {
+    q = ((q << SOLVE_SHIFT) | key[solve_sample[i]]) & SOLVE_MASK;
+    if (i >= 3)
+      score += solve_quadgram[q];
+  }
+  return score;
+}
+
+static int solve_quitting(void)
+{
+  int quit;
+
+  pthread_mutex_lock(&solve_mutex);
+  quit = solve_quit;
+  pthread_mutex_unlock(&solve_mutex);
+
+  return quit;
+}
+
+static void solve_offer(const int *key, double score)
+{
+  int i;
+
+  pthread_mutex_lock(&solve_mutex);
+  if (score > solve_best_score) {
+    for (i = 0; i < solve_letters; i++)
+      solve_best[i] = solve_present[i] ? key[i] : solve_fixed[i];
+    solve_best_score = score;
+    solve_best_generation++;
+  }
+  pthread_mutex_unlock(&solve_mutex);
+}
+
+/* Hill climbing from random keys, swapping two open letters at a time and
+   keeping the swap if the text looks more like English. */
+static void *solve_worker(void *arg)
+{
+  int key[SOLVE_LETTERS_MAX], open[SOLVE_LETTERS_MAX], pool[SOLVE_LETTERS_MAX];
+  int used[SOLVE_LETTERS_MAX];
+  int opens, pools, stale, a, b, i, temp;
+  double score, trial;
+  unsigned int seed;
+
+  seed = time(NULL) ^ (unsigned int)(size_t)arg * 2654435761u;
+
+  /* Letters the user left open, and the plain letters left for them. Some
+     are spare if the user used a letter twice. */
+  memset(used, 0, sizeof(used));
+  opens = 0;
+  for (i = 0; i < solve_letters; i++) {
+    if (solve_fixed[i] >= 0) {
+      key[i] = solve_fixed[i];
+      used[solve_fixed[i]] = 1;
+    } else {
+      open[opens++] = i;
+    }
+  }
+  pools = 0;
+  for (i = 0; i < solve_letters; i++) {
+    if (! used[i])
+      pool[pools++] = i;
+  }
+
+  while (! solve_quitting()) {
+    for (i = pools - 1; i > 0; i--) {
+      b = rand_r(&seed) % (i + 1);
+      temp = pool[i];
+      pool[i] = pool[b];
+      pool[b] = temp;
+    }
+    for (i = 0; i < opens; i++)
+      key[open[i]] = pool[i];
+    score = solve_fitness(key);
+
+    for (stale = 0; stale < SOLVE_STALE_MAX && opens >= 2; stale++) {
+      if (stale % SOLVE_QUIT_CHECK == 0 && solve_quitting())
+        break;
+      a = open[rand_r(&seed) % opens];
+      b = open[rand_r(&seed) % opens];
+      if (a == b)
+        continue;
+
+      temp = key[a];
+      key[a] = key[b];
+      key[b] = temp;
+      trial = solve_fitness(key);
+      if (trial > score) {
+        score = trial;
+        stale = -1;
+      } else {
+        key[b] = key[a];
+        key[a] = temp;
+      }
+    }
+
+    solve_offer(key, score);
+    if (opens < 2)
+      break; /* Nothing to try. */
+  }
+
+  pthread_mutex_lock(&solve_mutex);
+  solve_alive--;
+  pthread_mutex_unlock(&solve_mutex);
+
+  return NULL;
+}
+
+/* Search for the key on every core, keeping letters of "fixed" that are not
+   -1. The best key found so far is collected with solve_poll(). */
+int solve_start(const unsigned char *text, size_t size, const int *fixed)
+{
+  sigset_t all, old;
+  long cores;
+  size_t i;
+  int index;
+
+  if (solve_quadgram == NULL)
+    return -1;
+  solve_stop();
+
+  memset(solve_present, 0, sizeof(solve_present));
+  solve_sample_len = 0;
+  for (i = 0; i < size && solve_sample_len < SOLVE_SAMPLE_MAX; i++) {
+    index = solve_index(text[i]);
+    if (index == -1)
+      continue;
+    solve_sample[solve_sample_len++] = index;
+    solve_present[index] = 1;
+  }
+  memcpy(solve_fixed, fixed, sizeof(int) * solve_letters);
+
+  pthread_mutex_lock(&solve_mutex);
+  solve_quit = 0;
+  solve_best_score = -DBL_MAX;
+  pthread_mutex_unlock(&solve_mutex);
+  solve_polled = solve_best_generation;
+
+  cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1)
+    cores = 1;
+  if (cores > SOLVE_THREADS_MAX)
+    cores = SOLVE_THREADS_MAX;
+
+  /* Keep signals on the main thread, like in the other programs. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (solve_threads = 0; solve_threads < cores; solve_threads++) {
+    pthread_mutex_lock(&solve_mutex);
+    solve_alive++;
+    pthread_mutex_unlock(&solve_mutex);
+    if (pthread_create(&solve_thread[solve_threads], NULL, solve_worker,
+        (void *)(size_t)solve_threads) != 0) {
+      pthread_mutex_lock(&solve_mutex);
+      solve_alive--;
+      pthread_mutex_unlock(&solve_mutex);
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return (solve_threads > 0) ? 0 : -1;
+}
+
+/* Returns 1 and the key, with -1 for open letters not in the text, if a
+   better one was found since last time. The score is per quadgram. */
+int solve_poll(int *key, double *score)
+{
+  int better;
+
+  pthread_mutex_lock(&solve_mutex);
+  better = (solve_best_generation != solve_polled);
+  if (better) {
+    memcpy(key, solve_best, sizeof(int) * solve_letters);
+    *score = (solve_sample_len > 3) ?
+      solve_best_score / (solve_sample_len - 3) : 0;
+    solve_polled = solve_best_generation;
+  }
+  pthread_mutex_unlock(&solve_mutex);
+
+  return better;
+}
+
+/* Returns 1 while the workers search, they stop by themselves if there is
+   nothing to try. Keys offered before that can still be polled. */
+int solve_running(void)
+{
+  int running;
+
+  pthread_mutex_lock(&solve_mutex);
+  running = (solve_alive > 0);
+  pthread_mutex_unlock(&solve_mutex);
+
+  return running;
+}
+
+/* Returns 1 if solve_init() has learned what to solve with. */
+int solve_ready(void)
+{
+  return solve_quadgram != NULL;
+}
+
+void solve_stop(void)
+{
+  int i;
+
+  pthread_mutex_lock(&solve_mutex);
+  solve_quit = 1;
+  pthread_mutex_unlock(&solve_mutex);
+  for (i = 0; i < solve_threads; i++)
+    pthread_join(solve_thread[i], NULL);
+  solve_threads = 0;
+
+  /* Keys offered before the stop would undo what the user did since. */
+  pthread_mutex_lock(&solve_mutex);
+  solve_polled = solve_best_generation;
+  pthread_mutex_unlock(&solve_mutex);
+}
@@ -0,0 +1,15 @@
+#ifndef _SOLVE_H
+#define _SOLVE_H
+
+#include <stddef.h>
+
+#define SOLVE_LETTERS_MAX 32
+
+int solve_init(const char *path, const int *letter, int letters);
+int solve_start(const unsigned char *text, size_t size, const int *fixed);
+int solve_poll(int *key, double *score);
+int solve_running(void);
+int solve_ready(void);
+void solve_stop(void);
+
+#endif /* _SOLVE_H */
@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "stats.h"
+
+#define STATS_WORDS_MIN 1024 /* Initial slots in the word table. */
+
+static stats_row_t *stats_row[STATS_KINDS];
+static int stats_rows[STATS_KINDS];
+static size_t stats_total[STATS_KINDS];
+static unsigned char stats_alphabet[UCHAR_MAX];
+static const unsigned char *stats_fold; /* Bytes as counted, like upper case. */
+
+/* Distinct words, hashed on their text. Empty slots have no count. */
+static stats_row_t *stats_word = NULL;
+static size_t stats_word_slots = 0;
+static size_t stats_words = 0;
+
+static size_t stats_hash(const unsigned char *text, int len)
+{
+  size_t hash;
+  int i;
+
+  hash = 2166136261u;
+  for (i = 0; i < len; i++)
+    hash = (hash ^ stats_fold[text[i]]) * 16777619u;
+  return hash;
+}
+
+static int stats_text_compare(const unsigned char *a, const unsigned char *b,
+  int len)
+{
+  int i, n;
+
+  for (i = 0; i < len; i++) {
+    n = stats_fold[a[i]] - stats_fold[b[i]];
+    if (n != 0)
+      return n;
+  }
+  return 0;
+}
+
+static stats_row_t *stats_word_slot(stats_row_t *table, size_t slots,
+  const unsigned char *text, int len)
+{
+  size_t i;
+
+  i = stats_hash(text, len) & (slots - 1);
+  while (table[i].count > 0 &&
+         (table[i].len != len ||
+          stats_text_compare(table[i].text, text, len) != 0))
+    i = (i + 1) & (slots - 1);
+  return &table[i];
+}
+
+static int stats_word_add(const unsigned char *text, int len)
+{
+  stats_row_t *table, *slot;
+  size_t i, slots;
+
+  /* Kept at most half full. */
+  if ((stats_words + 1) * 2 > stats_word_slots) {
+    slots = (stats_word_slots == 0) ? STATS_WORDS_MIN : stats_word_slots * 2;
+    table = calloc(slots, sizeof(stats_row_t));
+    if (table == NULL)
+      return -1;
+    for (i = 0; i < stats_word_slots; i++) {
+      if (stats_word[i].count > 0)
+        *stats_word_slot(table, slots, stats_word[i].text,
+          stats_word[i].len) = stats_word[i];
+    }
+    free(stats_word);
+    stats_word = table;
+    stats_word_slots = slots;
+  }
+
+  slot = stats_word_slot(stats_word, stats_word_slots, text, len);
+  if (slot->count == 0) {
+    slot->text = text;
+    slot->len = len;
+    stats_words++;
+  }
+  slot->count++;
+  return 0;
+}
+
+static int stats_compare(const void *p1, const void *p2)
+{
+  const stats_row_t *a = p1, *b = p2;
+  int n;
+
+  if (a->count != b->count)
+    return (a->count < b->count) ? 1 : -1;
+  n = stats_text_compare(a->text, b->text, (a->len < b->len) ? a->len : b->len);
+  return (n != 0) ? n : a->len - b->len;
+}
+
+/* Turn the n-gram tables into rows, most common first. */
+static int stats_rows_from(int kind, int n, const size_t *count,
+  const size_t *first, size_t grams, const unsigned char *text)
+{
+  size_t i;
+  int rows;
+
+  rows = 0;
+  for (i = 0; i < grams; i++) {
+    if (count[i] > 0)
+      rows++;
+  }
+  stats_row[kind] = malloc(sizeof(stats_row_t) * (rows + 1));
+  if (stats_row[kind] == NULL)
+    return -1;
+
+  rows = 0;
+  for (i = 0; i < grams; i++) {
+    if (count[i] == 0)
+      continue;
+    stats_row[kind][rows].text = text + first[i];
+    stats_row[kind][rows].len = n;
+    stats_row[kind][rows].count = count[i];
+    stats_total[kind] += count[i];
+    rows++;
+  }
+  stats_rows[kind] = rows;
+  qsort(stats_row[kind], rows, sizeof(stats_row_t), stats_compare);
+  return 0;
+}
+
+/* Count letters, pairs and triples of letters within words, and words, in
+   one pass over the text. The counts are kept, as the text never changes,
+   and the rows point into it. Bytes are counted as "fold" has them, so
+   letters in either case are the same. */
+int stats_build(const unsigned char *text, size_t size, const int *letter,
+  int letters, const unsigned char *fold)
+{
+  static size_t count[4][UCHAR_MAX + 1];
+  size_t *bigram, *bigram_first, *trigram, *trigram_first;
+  size_t i, grams;
+  unsigned int q, mask;
+  int shift, index, run, c, n, error;
+
+  stats_fold = fold;
+
+  /* Four tables, so runs of the same letter do not wait on each other. */
+  memset(count, 0, sizeof(count));
+  for (i = 0; i + 4 <= size; i += 4) {
+    count[0][text[i]]++;
+    count[1][text[i + 1]]++;
+    count[2][text[i + 2]]++;
+    count[3][text[i + 3]]++;
+  }
+  for (; i < size; i++)
+    count[0][text[i]]++;
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    if (fold[c] != c)
+      count[0][fold[c]] += count[0][c] + count[1][c] + count[2][c] +
+        count[3][c];
+  }
+
+  n = 0;
+  stats_row[STATS_LETTER] = malloc(sizeof(stats_row_t) * (letters + 1));
+  if (stats_row[STATS_LETTER] == NULL)
+    return -1;
+  for (c = 0; c < UCHAR_MAX; c++) {
+    if (letter[c] == -1)
+      continue;
+    stats_alphabet[n] = c;
+    stats_row[STATS_LETTER][n].text = &stats_alphabet[n];
+    stats_row[STATS_LETTER][n].len = 1;
+    stats_row[STATS_LETTER][n].count =
+      count[0][c] + count[1][c] + count[2][c] + count[3][c];
+    stats_total[STATS_LETTER] += stats_row[STATS_LETTER][n].count;
+    n++;
+  }
+  stats_rows[STATS_LETTER] = n;
+  qsort(stats_row[STATS_LETTER], n, sizeof(stats_row_t), stats_compare);
+
+  /* N-grams are indexed by their letters, "shift" bits each. */
+  for (shift = 1; (1 << shift) < letters; shift++)
+    ;
+  grams = (size_t)1 << (shift * 3);
+  mask = grams - 1;
+  bigram = calloc(grams, sizeof(size_t));
+  bigram_first = malloc(sizeof(size_t) * grams);
+  trigram = calloc(grams, sizeof(size_t));
+  trigram_first = malloc(sizeof(size_t) * grams);
+
+  error = (bigram == NULL || bigram_first == NULL || trigram == NULL ||
+    trigram_first == NULL);
+  q = 0;
+  run = 0;
+  for (i = 0; i < size && ! error; i++) {
+    c = fold[text[i]];
+    index = (c < UCHAR_MAX) ? letter[c] : -1;
+    if (index == -1) {
+      if (run > 0)
+        error = stats_word_add(text + i - run, run);
+      run = 0;
+      continue;
+    }
+
+    q = ((q << shift) | index) & mask;
+    run++;
+    if (run >= 2 && bigram[q & ((1 << (shift * 2)) - 1)]++ == 0)
+      bigram_first[q & ((1 << (shift * 2)) - 1)] = i - 1;
+    if (run >= 3 && trigram[q]++ == 0)
+      trigram_first[q] = i - 2;
+  }
+  if (run > 0 && ! error)
+    error = stats_word_add(text + size - run, run);
+
+  if (! error)
+    error = stats_rows_from(STATS_BIGRAM, 2, bigram, bigram_first,
+      (size_t)1 << (shift * 2), text);
+  if (! error)
+    error = stats_rows_from(STATS_TRIGRAM, 3, trigram, trigram_first, grams,
+      text);
+  free(bigram);
+  free(bigram_first);
+  free(trigram);
+  free(trigram_first);
+  if (error)
+    return -1;
+
+  /* The word table becomes the rows, packed. */
+  n = 0;
+  for (i = 0; i < stats_word_slots; i++) {
+    if (stats_word[i].count > 0) {
+      stats_word[n++] = stats_word[i];
+      stats_total[STATS_WORD] += stats_word[i].count;
+    }
+  }
+  stats_row[STATS_WORD] = stats_word;
+  stats_rows[STATS_WORD] = n;
+  qsort(stats_word, n, sizeof(stats_row_t), stats_compare);
+
+  return 0;
+}
+
+/* Rows of a kind, which the caller may reorder, and the sum of counts. */
+stats_row_t *stats_get(int kind, int *rows, size_t *total)
+{
+  *rows = stats_rows[kind];
+  *total = stats_total[kind];
+  return stats_row[kind];
+}
+
+/* Letters in order of first appearance, so "LOOK" and "SEEN" both give
+   "ABBC". The pattern holds "len" characters and is not terminated. */
+void stats_pattern(const unsigned char *text, int len, char *pattern)
+{
+  char seen[UCHAR_MAX + 1];
+  int i, next;
+
+  memset(seen, 0, sizeof(seen));
+  next = 0;
+  for (i = 0; i < len; i++) {
+    if (seen[stats_fold[text[i]]] == 0)
+      seen[stats_fold[text[i]]] = (next < 26) ? 'A' + next++ : '?';
+    pattern[i] = seen[stats_fold[text[i]]];
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h>
+
+enum {
+  STATS_LETTER = 0,
+  STATS_BIGRAM,
+  STATS_TRIGRAM,
+  STATS_WORD,
+  STATS_KINDS,
+};
+
+typedef struct stats_row_s {
+  const unsigned char *text; /* First occurrence, not terminated. */
+  int len;
+  size_t count;
+} stats_row_t;
+
+int stats_build(const unsigned char *text, size_t size, const int *letter,
+  int letters, const unsigned char *fold);
+stats_row_t *stats_get(int kind, int *rows, size_t *total);
+void stats_pattern(const unsigned char *text, int len, char *pattern);
+
+#endif /* _STATS_H */
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "data.h"
+
+#define DATA_TABLE_INITIAL_SIZE 1024
+
+static unsigned int data_hash(const char *label, size_t len)
+{
+  unsigned int hash;
+  size_t i;
+
+  /* FNV-1a */
+  hash = 2166136261U;
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)label[i];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+int data_table_init(data_table_t *table)
+{
+  table->entry = calloc(DATA_TABLE_INITIAL_SIZE, sizeof(data_entry_t));
+  if (table->entry == NULL)
+    return -1;
+
+  table->size = DATA_TABLE_INITIAL_SIZE;
+  table->used = 0;
+  return 0;
+}
+
+void data_table_free(data_table_t *table)
+{
+  size_t i;
+
+  for (i = 0; i < table->size; i++) {
+    free(table->entry[i].label);
+  }
+  free(table->entry);
+  table->entry = NULL;
+  table->size = 0;
+  table->used = 0;
+}
+
+static int data_table_grow(data_table_t *table)
+{
+  data_entry_t *old, *entry;
+  size_t old_size, i, n;
+
+  old = table->entry;
+  old_size = table->size;
+
+  entry = calloc(old_size * 2, sizeof(data_entry_t));
+  if (entry == NULL)
+    return -1;
+
+  table->entry = entry;
+  table->size = old_size * 2;
+
+  /* Re-insert using the stored hashes, no labels are copied. */
+  for (i = 0; i < old_size; i++) {
+    if (old[i].label == NULL)
+      continue;
+    n = old[i].hash & (table->size - 1);
+    while (table->entry[n].label != NULL)
+      n = (n + 1) & (table->size - 1);
+    table->entry[n] = old[i];
+  }
+
+  free(old);
+  return 0;
+}
+
+/* Find or create the entry for a label. The pointer is only valid until
+   the next insert, since the table may grow. */
+data_entry_t *data_table_insert(data_table_t *table, const char *label, size_t len)
+{
+  unsigned int hash;
+  size_t n;
+  data_entry_t *entry;
+
+  /* Keep load factor below 3/4. */
+  if ((table->used + 1) * 4 > table->size * 3) {
+    if (data_table_grow(table) != 0)
+      return NULL;
+  }
+
+  hash = data_hash(label, len);
+  n = hash & (table->size - 1);
+  while (table->entry[n].label != NULL) {
+    entry = &table->entry[n];
+    if (entry->hash == hash &&
+        strncmp(entry->label, label, len) == 0 && entry->label[len] == '\0') {
+      return entry;
+    }
+    n = (n + 1) & (table->size - 1);
+  }
+
+  entry = &table->entry[n];
+  entry->label = malloc(len + 1);
+  if (entry->label == NULL)
+    return NULL;
+  memcpy(entry->label, label, len);
+  entry->label[len] = '\0';
+  entry->hash = hash;
+  entry->value = 0.0;
+  entry->ptr = NULL;
+  table->used++;
+
+  return entry;
+}
+
+int data_table_add(data_table_t *table, const char *label, size_t len, double value)
+{
+  data_entry_t *entry;
+
+  entry = data_table_insert(table, label, len);
+  if (entry == NULL)
+    return -1;
+
+  entry->value += value; /* Duplicate labels are summed up. */
+  return 0;
+}
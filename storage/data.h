@@ -0,0 +1,26 @@
+#ifndef _DATA_H
+#define _DATA_H
+
+#include <stddef.h>
+
+#define DATA_DELIMITER '\t'
+
+typedef struct data_entry_s {
+  char *label; /* NULL for an unused slot. */
+  unsigned int hash;
+  double value;
+  void *ptr; /* Free for use by the owner of the table. */
+} data_entry_t;
+
+typedef struct data_table_s {
+  data_entry_t *entry;
+  size_t size; /* Always a power of two. */
+  size_t used;
+} data_table_t;
+
+int data_table_init(data_table_t *table);
+void data_table_free(data_table_t *table);
+data_entry_t *data_table_insert(data_table_t *table, const char *label, size_t len);
+int data_table_add(data_table_t *table, const char *label, size_t len, double value);
+
+#endif /* _DATA_H */
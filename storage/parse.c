@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "data.h"
+#include "parse.h"
+
+#define PARSE_THREADS_MAX 64
+#define PARSE_CHUNK (16 * 1024 * 1024) /* When reading from a pipe. */
+#define PARSE_SPLIT_MIN (1024 * 1024) /* Less than this per thread is slower. */
+
+typedef struct parse_job_s {
+  const char *start;
+  const char *end;
+  data_table_t table; /* Partial sums for this part only. */
+  unsigned long long lines;
+  int result;
+} parse_job_t;
+
+static const double parse_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* Parses decimal numbers, falls back to strtod() for anything unusual like
+   hexadecimal, "inf" or "nan". Returns -1 if there is no number at all. */
+static int parse_number(const char *p, const char *end, double *value)
+{
+  unsigned long long mantissa;
+  int exponent, digits, seen, negative, exp_negative, exp_value;
+  const char *number;
+  char temp[64], *temp_end;
+  size_t len;
+
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  number = p;
+
+  negative = 0;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+
+  mantissa = 0;
+  exponent = 0;
+  digits = 0; /* Significant digits in the mantissa. */
+  seen = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (digits < 19) {
+      mantissa = (mantissa * 10) + (*p - '0');
+      if (mantissa > 0)
+        digits++;
+    } else {
+      exponent++; /* Beyond what fits, keep the magnitude only. */
+    }
+    seen++;
+    p++;
+  }
+
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (digits < 19) {
+        mantissa = (mantissa * 10) + (*p - '0');
+        if (mantissa > 0)
+          digits++;
+        exponent--;
+      }
+      seen++;
+      p++;
+    }
+  }
+
+  if (seen == 0 || (p < end && (*p == 'x' || *p == 'X'))) {
+    len = end - number;
+    if (len >= sizeof(temp))
+      len = sizeof(temp) - 1;
+    memcpy(temp, number, len);
+    temp[len] = '\0';
+    *value = strtod(temp, &temp_end);
+    return (temp_end == temp) ? -1 : 0;
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    exp_negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+      exp_negative = (*p == '-');
+      p++;
+    }
+    exp_value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (exp_value < 10000)
+        exp_value = (exp_value * 10) + (*p - '0');
+      p++;
+    }
+    exponent += exp_negative ? -exp_value : exp_value;
+  }
+
+  *value = (double)mantissa;
+  if (exponent < 0) {
+    if (exponent >= -22) {
+      *value /= parse_pow10[-exponent];
+    } else {
+      *value *= pow(10.0, exponent);
+    }
+  } else if (exponent > 0) {
+    if (exponent <= 22) {
+      *value *= parse_pow10[exponent];
+    } else {
+      *value *= pow(10.0, exponent);
+    }
+  }
+
+  if (negative)
+    *value = -*value;
+  return 0;
+}
+
+static void *parse_job_run(void *arg)
+{
+  parse_job_t *job = arg;
+  const char *p, *line_end, *tab, *label_end;
+  double value;
+
+  p = job->start;
+  while (p < job->end) {
+    line_end = memchr(p, '\n', job->end - p);
+    if (line_end == NULL)
+      line_end = job->end;
+    job->lines++;
+
+    label_end = line_end;
+    if (label_end > p && label_end[-1] == '\r')
+      label_end--;
+
+    tab = memchr(p, DATA_DELIMITER, label_end - p);
+    if (tab != NULL && parse_number(p, tab, &value) == 0) {
+      if (data_table_add(&job->table, tab + 1, label_end - (tab + 1), value) != 0) {
+        job->result = -1;
+        break;
+      }
+    }
+
+    p = line_end + 1;
+  }
+
+  return NULL;
+}
+
+static int parse_threads(size_t len)
+{
+  long n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  if (n > PARSE_THREADS_MAX)
+    n = PARSE_THREADS_MAX;
+  if (len / PARSE_SPLIT_MIN < n)
+    n = len / PARSE_SPLIT_MIN;
+  if (n < 1)
+    n = 1;
+  return n;
+}
+
+/* Splits the buffer on line boundaries, one part for each job. */
+static int parse_buffer(const char *buffer, size_t len, parse_job_t *job, int jobs)
+{
+  pthread_t thread[PARSE_THREADS_MAX];
+  const char *p, *end;
+  int i, n;
+
+  end = buffer + len;
+  p = buffer;
+  for (i = 0; i < jobs; i++) {
+    job[i].start = p;
+    if (i == jobs - 1) {
+      job[i].end = end;
+    } else {
+      job[i].end = buffer + (len / jobs) * (i + 1);
+      if (job[i].end < p)
+        job[i].end = p;
+      job[i].end = memchr(job[i].end, '\n', end - job[i].end);
+      job[i].end = (job[i].end == NULL) ? end : job[i].end + 1;
+    }
+    p = job[i].end;
+  }
+
+  for (n = 0; n < jobs - 1; n++) {
+    if (pthread_create(&thread[n], NULL, parse_job_run, &job[n]) != 0)
+      break;
+  }
+
+  /* Last part on this thread, then any whose thread failed to start. */
+  parse_job_run(&job[jobs - 1]);
+  for (i = n; i < jobs - 1; i++)
+    parse_job_run(&job[i]);
+  for (i = 0; i < n; i++)
+    pthread_join(thread[i], NULL);
+
+  for (i = 0; i < jobs; i++) {
+    if (job[i].result != 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int parse_read(int fd, parse_job_t *job, int jobs, unsigned long long *bytes)
+{
+  char *buffer, *bigger, *last;
+  size_t size, used, done;
+  ssize_t n;
+  int eof;
+
+  size = PARSE_CHUNK;
+  buffer = malloc(size);
+  if (buffer == NULL)
+    return -1;
+
+  used = 0;
+  eof = 0;
+  while (! eof) {
+    n = read(fd, buffer + used, size - used);
+    if (n < 0) {
+      free(buffer);
+      return -1;
+    }
+    if (n == 0)
+      eof = 1;
+    used += n;
+    *bytes += n;
+
+    if (used < size && ! eof)
+      continue; /* Fill up the chunk before parsing. */
+
+    if (eof) {
+      done = used;
+    } else {
+      last = memrchr(buffer, '\n', used);
+      if (last == NULL) {
+        /* A single line larger than the chunk. */
+        bigger = realloc(buffer, size * 2);
+        if (bigger == NULL) {
+          free(buffer);
+          return -1;
+        }
+        buffer = bigger;
+        size *= 2;
+        continue;
+      }
+      done = (last - buffer) + 1;
+    }
+
+    if (done > 0 && parse_buffer(buffer, done, job, jobs) != 0) {
+      free(buffer);
+      return -1;
+    }
+
+    /* Keep the incomplete last line for the next chunk. */
+    memmove(buffer, buffer + done, used - done);
+    used -= done;
+  }
+
+  free(buffer);
+  return 0;
+}
+
+/* Reads <value><TAB><label> lines from a file or pipe. Regular files are
+   mapped, pipes are read in large chunks. Each chunk is parsed by several
+   threads into their own tables, which are merged at the end. */
+int parse_fd(int fd, data_table_t *table, parse_stats_t *stats)
+{
+  parse_job_t job[PARSE_THREADS_MAX];
+  struct timespec start, stop;
+  struct stat st;
+  void *map;
+  size_t i;
+  int jobs, n, result;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  stats->lines = 0;
+  stats->bytes = 0;
+
+  map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  if (map != MAP_FAILED) {
+    jobs = parse_threads(st.st_size);
+  } else {
+    jobs = parse_threads(PARSE_CHUNK);
+  }
+
+  for (n = 0; n < jobs; n++) {
+    memset(&job[n], 0, sizeof(parse_job_t));
+    if (data_table_init(&job[n].table) != 0)
+      break;
+  }
+
+  if (n < jobs) {
+    result = -1;
+  } else if (map != MAP_FAILED) {
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    result = parse_buffer(map, st.st_size, job, jobs);
+    stats->bytes = st.st_size;
+  } else {
+    result = parse_read(fd, job, jobs, &stats->bytes);
+  }
+
+  if (map != MAP_FAILED)
+    munmap(map, st.st_size);
+
+  /* Merge the partial sums. */
+  for (jobs = 0; jobs < n; jobs++) {
+    stats->lines += job[jobs].lines;
+    for (i = 0; i < job[jobs].table.size && result == 0; i++) {
+      if (job[jobs].table.entry[i].label == NULL)
+        continue;
+      if (data_table_add(table, job[jobs].table.entry[i].label,
+          strlen(job[jobs].table.entry[i].label),
+          job[jobs].table.entry[i].value) != 0)
+        result = -1;
+    }
+    data_table_free(&job[jobs].table);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  stats->seconds = (stop.tv_sec - start.tv_sec) +
+    ((stop.tv_nsec - start.tv_nsec) / 1e9);
+
+  return result;
+}
@@ -0,0 +1,14 @@
+#ifndef _PARSE_H
+#define _PARSE_H
+
+#include "data.h"
+
+typedef struct parse_stats_s {
+  unsigned long long lines;
+  unsigned long long bytes;
+  double seconds;
+} parse_stats_t;
+
+int parse_fd(int fd, data_table_t *table, parse_stats_t *stats);
+
+#endif /* _PARSE_H */
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "data.h"
+#include "scan.h"
+
+#define SCAN_THREADS_MAX 64
+#define SCAN_INODE_INITIAL_SIZE 1024
+
+typedef struct scan_work_s {
+  char *path;
+  int slot; /* Top-level child that the size is counted towards. */
+  struct scan_work_s *next;
+} scan_work_t;
+
+typedef struct scan_slot_s {
+  char *name;
+  int is_dir;
+  unsigned long long size;
+} scan_slot_t;
+
+typedef struct scan_inode_s {
+  dev_t dev;
+  ino_t ino;
+  int used;
+} scan_inode_t;
+
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+static scan_work_t *scan_queue = NULL;
+static int scan_active = 0;  /* Workers currently busy. */
+static int scan_waiting = 0; /* Workers waiting for the queue. */
+
+static scan_slot_t *scan_slot = NULL;
+static int scan_slot_count = 0;
+
+/* Set of inodes with more than one link, so hardlinks only count once. */
+static pthread_mutex_t scan_inode_mutex = PTHREAD_MUTEX_INITIALIZER;
+static scan_inode_t *scan_inode = NULL;
+static size_t scan_inode_size = 0;
+static size_t scan_inode_used = 0;
+
+static size_t scan_inode_hash(dev_t dev, ino_t ino, size_t size)
+{
+  unsigned long long hash;
+
+  hash = ((unsigned long long)dev * 0x9E3779B97F4A7C15ULL) ^ (unsigned long long)ino;
+  hash *= 0xBF58476D1CE4E5B9ULL;
+  return (size_t)(hash >> 17) & (size - 1);
+}
+
+static int scan_inode_grow(void)
+{
+  scan_inode_t *old;
+  size_t old_size, i, n;
+
+  old = scan_inode;
+  old_size = scan_inode_size;
+
+  scan_inode_size = (old_size == 0) ? SCAN_INODE_INITIAL_SIZE : old_size * 2;
+  scan_inode = calloc(scan_inode_size, sizeof(scan_inode_t));
+  if (scan_inode == NULL) {
+    scan_inode = old;
+    scan_inode_size = old_size;
+    return -1;
+  }
+
+  for (i = 0; i < old_size; i++) {
+    if (! old[i].used)
+      continue;
+    n = scan_inode_hash(old[i].dev, old[i].ino, scan_inode_size);
+    while (scan_inode[n].used)
+      n = (n + 1) & (scan_inode_size - 1);
+    scan_inode[n] = old[i];
+  }
+
+  free(old);
+  return 0;
+}
+
+/* Returns non-zero the first time an inode is seen. */
+static int scan_inode_first(dev_t dev, ino_t ino)
+{
+  size_t n;
+  int first;
+
+  pthread_mutex_lock(&scan_inode_mutex);
+
+  if ((scan_inode_used + 1) * 2 > scan_inode_size) {
+    if (scan_inode_grow() != 0) {
+      pthread_mutex_unlock(&scan_inode_mutex);
+      return 1; /* Count it rather than lose it. */
+    }
+  }
+
+  first = 1;
+  n = scan_inode_hash(dev, ino, scan_inode_size);
+  while (scan_inode[n].used) {
+    if (scan_inode[n].dev == dev && scan_inode[n].ino == ino) {
+      first = 0;
+      break;
+    }
+    n = (n + 1) & (scan_inode_size - 1);
+  }
+
+  if (first) {
+    scan_inode[n].dev = dev;
+    scan_inode[n].ino = ino;
+    scan_inode[n].used = 1;
+    scan_inode_used++;
+  }
+
+  pthread_mutex_unlock(&scan_inode_mutex);
+  return first;
+}
+
+static unsigned long long scan_stat_size(struct stat *st)
+{
+  if (! S_ISDIR(st->st_mode) && st->st_nlink > 1) {
+    if (! scan_inode_first(st->st_dev, st->st_ino))
+      return 0;
+  }
+  return (unsigned long long)st->st_blocks * 512;
+}
+
+static void scan_push(const char *path, int slot)
+{
+  scan_work_t *work;
+
+  work = malloc(sizeof(scan_work_t));
+  if (work == NULL)
+    return;
+  work->path = strdup(path);
+  if (work->path == NULL) {
+    free(work);
+    return;
+  }
+  work->slot = slot;
+
+  pthread_mutex_lock(&scan_mutex);
+  work->next = scan_queue;
+  scan_queue = work;
+  pthread_cond_signal(&scan_cond);
+  pthread_mutex_unlock(&scan_mutex);
+}
+
+static int scan_starving(void)
+{
+  int starving;
+
+  pthread_mutex_lock(&scan_mutex);
+  starving = (scan_waiting > 0 && scan_queue == NULL);
+  pthread_mutex_unlock(&scan_mutex);
+
+  return starving;
+}
+
+/* Walks one directory, takes ownership of the descriptor. */
+static unsigned long long scan_walk(int fd, char *path, int slot)
+{
+  DIR *dh;
+  struct dirent *entry;
+  struct stat st;
+  unsigned long long size;
+  int subfd, len;
+
+  dh = fdopendir(fd);
+  if (dh == NULL) {
+    close(fd);
+    return 0;
+  }
+
+  size = 0;
+  len = strlen(path);
+  while ((entry = readdir(dh))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    if (fstatat(dirfd(dh), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+      continue;
+
+    size += scan_stat_size(&st);
+    if (! S_ISDIR(st.st_mode))
+      continue;
+
+    if (len + strlen(entry->d_name) + 2 > PATH_MAX)
+      continue;
+    path[len] = '/';
+    strcpy(&path[len + 1], entry->d_name);
+
+    /* Hand the directory over to an idle worker, or descend here. */
+    if (scan_starving()) {
+      scan_push(path, slot);
+    } else {
+      subfd = openat(dirfd(dh), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+      if (subfd != -1)
+        size += scan_walk(subfd, path, slot);
+    }
+    path[len] = '\0';
+  }
+
+  closedir(dh);
+  return size;
+}
+
+static void *scan_worker(void *arg)
+{
+  scan_work_t *work;
+  char path[PATH_MAX];
+  unsigned long long size;
+  int fd;
+
+  pthread_mutex_lock(&scan_mutex);
+  while (1) {
+    while (scan_queue == NULL && scan_active > 0) {
+      scan_waiting++;
+      pthread_cond_wait(&scan_cond, &scan_mutex);
+      scan_waiting--;
+    }
+    if (scan_queue == NULL)
+      break; /* Nothing queued and nobody left to queue more. */
+
+    work = scan_queue;
+    scan_queue = work->next;
+    scan_active++;
+    pthread_mutex_unlock(&scan_mutex);
+
+    strncpy(path, work->path, PATH_MAX - 1);
+    path[PATH_MAX - 1] = '\0';
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd != -1) {
+      size = scan_walk(fd, path, work->slot);
+      __atomic_fetch_add(&scan_slot[work->slot].size, size, __ATOMIC_RELAXED);
+    }
+    free(work->path);
+    free(work);
+
+    pthread_mutex_lock(&scan_mutex);
+    scan_active--;
+    if (scan_active == 0 && scan_queue == NULL)
+      pthread_cond_broadcast(&scan_cond);
+  }
+  pthread_mutex_unlock(&scan_mutex);
+
+  return NULL;
+}
+
+static int scan_threads(void)
+{
+  long n;
+
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    return 1;
+  if (n > SCAN_THREADS_MAX)
+    return SCAN_THREADS_MAX;
+  return n;
+}
+
+/* Sum up disk usage per top-level child of the directory. */
+int scan_dir(const char *path, data_table_t *table)
+{
+  DIR *dh;
+  struct dirent *entry;
+  struct stat st;
+  pthread_t thread[SCAN_THREADS_MAX];
+  char subpath[PATH_MAX];
+  scan_slot_t *slot;
+  int fd, i, n, result;
+
+  fd = open(path, O_RDONLY | O_DIRECTORY);
+  if (fd == -1)
+    return -1;
+  dh = fdopendir(fd);
+  if (dh == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  /* Top-level children are counted here, their contents by the workers. */
+  scan_active = 1; /* Keep workers alive until the queue is seeded. */
+  while ((entry = readdir(dh))) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    if (fstatat(dirfd(dh), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+      continue;
+
+    slot = realloc(scan_slot, sizeof(scan_slot_t) * (scan_slot_count + 1));
+    if (slot == NULL)
+      break;
+    scan_slot = slot;
+    scan_slot[scan_slot_count].name = strdup(entry->d_name);
+    scan_slot[scan_slot_count].is_dir = S_ISDIR(st.st_mode);
+    scan_slot[scan_slot_count].size = scan_stat_size(&st);
+    if (scan_slot[scan_slot_count].name == NULL)
+      break;
+    scan_slot_count++;
+  }
+
+  closedir(dh);
+
+  /* Seed the queue only once the slot array is no longer moving. */
+  for (i = 0; i < scan_slot_count; i++) {
+    if (! scan_slot[i].is_dir)
+      continue;
+    snprintf(subpath, PATH_MAX, "%s/%s", path, scan_slot[i].name);
+    scan_push(subpath, i);
+  }
+
+  n = scan_threads();
+  for (i = 0; i < n; i++) {
+    if (pthread_create(&thread[i], NULL, scan_worker, NULL) != 0)
+      break;
+  }
+  n = i;
+
+  /* Release only the seeding reference, workers may have counted in. */
+  pthread_mutex_lock(&scan_mutex);
+  scan_active--;
+  pthread_cond_broadcast(&scan_cond);
+  pthread_mutex_unlock(&scan_mutex);
+
+  if (n == 0) {
+    scan_worker(NULL); /* No threads, walk in the foreground. */
+  } else {
+    for (i = 0; i < n; i++)
+      pthread_join(thread[i], NULL);
+  }
+
+  result = 0;
+  for (i = 0; i < scan_slot_count; i++) {
+    if (result == 0 && data_table_add(table, scan_slot[i].name,
+        strlen(scan_slot[i].name), (double)scan_slot[i].size) != 0)
+      result = -1;
+    free(scan_slot[i].name);
+  }
+  free(scan_slot);
+  scan_slot = NULL;
+  scan_slot_count = 0;
+
+  free(scan_inode);
+  scan_inode = NULL;
+  scan_inode_size = 0;
+  scan_inode_used = 0;
+
+  return result;
+}
@@ -0,0 +1,8 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include "data.h"
+
+int scan_dir(const char *path, data_table_t *table);
+
+#endif /* _SCAN_H */
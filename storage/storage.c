@@ -2,21 +2,45 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
 #include <curses.h>
+#include "data.h"
+#include "scan.h"
+#include "tree.h"
+#include "parse.h"
 
-#define TEXT_X_AREA 20
-#define TEXT_MAX TEXT_X_AREA - 3
-#define DATA_MAX 24 /* Best fit when using 80x24 terminal. */
-#define DATA_DELIMITER "\t"
+typedef enum {
+  SOURCE_STDIN,
+  SOURCE_FILE,
+  SOURCE_COMMAND,
+  SOURCE_SCAN,
+} source_type_t;
 
-typedef struct data_s {
-  double value;
-  char text[TEXT_MAX + 1];
-} data_t;
+/* Frames are drawn off-screen, and only cells that differ from the
+   previous frame are sent to curses. */
+static chtype *frame = NULL;
+static chtype *frame_previous = NULL;
+static int frame_size_y = 0;
+static int frame_size_x = 0;
+
+static parse_stats_t source_stats;
 
 static void screen_init(int *max_y, int *max_x)
 {
-  initscr();
+  FILE *tty;
+
+  /* Input may have been piped in, so keys must come from the terminal. */
+  if (isatty(STDIN_FILENO)) {
+    initscr();
+  } else {
+    tty = fopen("/dev/tty", "r");
+    if (tty == NULL || newterm(NULL, stdout, tty) == NULL) {
+      fprintf(stderr, "Error: Unable to open terminal for input.\n");
+      exit(1);
+    }
+  }
   atexit((void *)endwin);
   if (has_colors()) {
     start_color();
@@ -29,133 +53,407 @@ static void screen_init(int *max_y, int *max_x)
     init_pair(7, COLOR_WHITE,   COLOR_BLACK);
   }
   noecho();
+  keypad(stdscr, TRUE);
   getmaxyx(stdscr, *max_y, *max_x);
 }
 
+static int frame_resize(int size_y, int size_x)
+{
+  chtype *cells;
+  int i;
+
+  if (size_y == frame_size_y && size_x == frame_size_x)
+    return 0;
+
+  cells = realloc(frame, sizeof(chtype) * size_y * size_x);
+  if (cells == NULL)
+    return -1;
+  frame = cells;
+
+  cells = realloc(frame_previous, sizeof(chtype) * size_y * size_x);
+  if (cells == NULL)
+    return -1;
+  frame_previous = cells;
+
+  /* Nothing is known to be on screen after a resize. */
+  for (i = 0; i < size_y * size_x; i++)
+    frame_previous[i] = (chtype)-1;
+
+  frame_size_y = size_y;
+  frame_size_x = size_x;
+  clearok(stdscr, TRUE);
+  return 0;
+}
+
+static void frame_clear(void)
+{
+  int i;
+
+  for (i = 0; i < frame_size_y * frame_size_x; i++)
+    frame[i] = ' ';
+}
+
+static void frame_put(int y, int x, chtype ch)
+{
+  if (y < 0 || y >= frame_size_y || x < 0 || x >= frame_size_x)
+    return;
+  frame[(y * frame_size_x) + x] = ch;
+}
+
+static void frame_puts(int y, int x, const char *s, attr_t attr)
+{
+  while (*s != '\0')
+    frame_put(y, x++, (unsigned char)*s++ | attr);
+}
+
+static void frame_flush(void)
+{
+  int y, x, i;
+  chtype *temp;
+
+  for (y = 0; y < frame_size_y; y++) {
+    for (x = 0; x < frame_size_x; x++) {
+      i = (y * frame_size_x) + x;
+      if (frame[i] != frame_previous[i])
+        mvaddch(y, x, frame[i]);
+    }
+  }
+
+  temp = frame_previous;
+  frame_previous = frame;
+  frame = temp;
+}
+
+static int box_char(int pattern)
+{
+  if (pattern < 26)
+    return pattern + 'A';
+  return pattern - 26 + 'a';
+}
+
+static attr_t pattern_attr(int pattern, int selected)
+{
+  attr_t attr;
+
+  attr = COLOR_PAIR((pattern % 7) + 1);
+  if ((pattern % 14) > 6)
+    attr |= A_BOLD;
+  if (selected)
+    attr |= A_REVERSE;
+  return attr;
+}
+
 static void box_draw(int pattern, int start_y, int start_x,
-  int size_y, int size_x)
+  int size_y, int size_x, int selected)
 {
   int y, x;
   for (y = 0; y < size_y; y++) {
     for (x = 0; x < size_x; x++) {
-      if ((pattern % 14) > 6) {
-        wattrset(stdscr, A_BOLD | COLOR_PAIR((pattern % 7) + 1));
-      } else {
-        wattrset(stdscr, COLOR_PAIR((pattern % 7) + 1));
-      }
-      mvaddch(start_y + y, start_x + x, pattern + 0x41);
+      frame_put(start_y + y, start_x + x,
+        box_char(pattern) | pattern_attr(pattern, selected));
     }
   }
-  refresh();
 }
 
-static void text_draw(int pattern, char *text, int y, int x)
+static void text_draw(int pattern, char *text, int y, int x, int selected)
 {
-  if ((pattern % 14) > 6) {
-    wattrset(stdscr, A_BOLD | COLOR_PAIR((pattern % 7) + 1));
+  char line[TEXT_X_AREA + 1];
+
+  snprintf(line, sizeof(line), "%c:%s", box_char(pattern), text);
+  frame_puts(y, x, line, pattern_attr(pattern, selected));
+}
+
+static void status_draw(tree_node_t *node, int y, int max_x)
+{
+  char path[PATH_MAX];
+  char line[PATH_MAX + 32];
+  int x;
+
+  tree_path(node, path, PATH_MAX);
+  if (source_stats.lines > 0 && source_stats.seconds > 0.0) {
+    snprintf(line, sizeof(line), " %s  %.0f  (%llu lines, %.0f lines/s)",
+      path, node->total, source_stats.lines,
+      source_stats.lines / source_stats.seconds);
   } else {
-    wattrset(stdscr, COLOR_PAIR((pattern % 7) + 1));
+    snprintf(line, sizeof(line), " %s  %.0f", path, node->total);
+  }
+  for (x = 0; x < max_x; x++)
+    frame_put(y, x, ' ' | A_REVERSE);
+  frame_puts(y, 0, line, A_REVERSE);
+}
+
+static void screen_draw(tree_node_t *node, int *selected)
+{
+  int i, n, max_y, max_x;
+  tree_box_t *box;
+
+  getmaxyx(stdscr, max_y, max_x);
+  if (frame_resize(max_y, max_x) != 0)
+    return;
+  frame_clear();
+
+  /* Last line shows where in the tree we are. */
+  n = tree_layout(node, max_y - 1, max_x - TEXT_X_AREA);
+  if (*selected >= n)
+    *selected = (n > 0) ? n - 1 : 0; /* Fewer boxes after a resize. */
+
+  for (i = 0; i < n; i++) {
+    box = &node->box[i];
+    box_draw(i, box->y, box->x, box->size_y, box->size_x, i == *selected);
+  }
+
+  for (i = 0; i < n; i++) {
+    text_draw(i, node->box[i].text, i, max_x - TEXT_X_AREA + 1, i == *selected);
   }
-  mvprintw(y, x, "%c:%s", pattern + 0x41, text);
+
+  status_draw(node, max_y - 1, max_x);
+
+  /* One batched update for the whole frame. */
+  frame_flush();
+  move(*selected, max_x - TEXT_X_AREA + 1);
   refresh();
 }
 
-static int data_compare(const void *p1, const void *p2)
+static tree_node_t *source_load(source_type_t type, char *source)
 {
-  return ((data_t *)p1)->value < ((data_t *)p2)->value;
+  data_table_t table;
+  tree_node_t *root;
+  FILE *fh;
+  int result;
+
+  if (data_table_init(&table) != 0)
+    return NULL;
+
+  /* Duplicate labels are summed, then paths are split into a tree. */
+  source_stats.lines = 0;
+  switch (type) {
+  case SOURCE_SCAN:
+    result = scan_dir(source, &table);
+    break;
+
+  case SOURCE_COMMAND:
+    fh = popen(source, "r");
+    if (fh == NULL) {
+      result = -1;
+      break;
+    }
+    result = parse_fd(fileno(fh), &table, &source_stats);
+    pclose(fh);
+    break;
+
+  case SOURCE_FILE:
+    fh = fopen(source, "r");
+    if (fh == NULL) {
+      result = -1;
+      break;
+    }
+    result = parse_fd(fileno(fh), &table, &source_stats);
+    fclose(fh);
+    break;
+
+  case SOURCE_STDIN:
+  default:
+    result = parse_fd(STDIN_FILENO, &table, &source_stats);
+    break;
+  }
+
+  if (result != 0) {
+    data_table_free(&table);
+    return NULL;
+  }
+
+  root = tree_build(&table);
+  data_table_free(&table);
+  return root;
 }
 
-int main(int argc, char *argv[])
+static int box_find(tree_node_t *node, const char *text)
 {
-  int i, max_y, max_x, start_y, start_x, size_y, size_x, horizontal;
-  double sum, share, used, value;
-  char line[128], *p;
-  data_t data[DATA_MAX];
+  int i, max_y, max_x, n;
 
-  for (i = 0; i < DATA_MAX; i++) {
-    data[i].value = 0.0;
-    data[i].text[0] = '\0';
+  getmaxyx(stdscr, max_y, max_x);
+  n = tree_layout(node, max_y - 1, max_x - TEXT_X_AREA);
+  for (i = 0; i < n; i++) {
+    if (strcmp(node->box[i].text, text) == 0)
+      return i;
   }
-  strncpy(data[DATA_MAX - 1].text, "*OTHER*", TEXT_MAX);
-
-  i = 0;
-  while (fgets(line, sizeof(line), stdin) != NULL) {
-    p = strtok(line, DATA_DELIMITER);
-    if (p == NULL)
-      continue;
-
-    value = atof(p);
-
-    p = strtok(NULL, DATA_DELIMITER);
-    if (p == NULL)
-      continue;
-
-    if (i >= (DATA_MAX - 1)) {
-      data[DATA_MAX - 1].value += value;
-    } else {
-      data[i].value = value;
-      strncpy(data[i].text, p, TEXT_MAX);
-      data[i].text[TEXT_MAX] = '\0';
-      i++;
+  return 0;
+}
+
+static void display_help(const char *progname)
+{
+  fprintf(stdout, "Usage: %s <options>\n", progname);
+  fprintf(stdout, "Options:\n"
+    "  -h, --help           Display this help.\n"
+    "  -s, --scan <dir>     Scan directory instead of reading from stdin.\n"
+    "  -f, --file <file>    Read from file instead of stdin.\n"
+    "  -c, --command <cmd>  Read the output of a command instead of stdin.\n"
+    "  -i, --interval <n>   Reload the above every n seconds.\n"
+    "\n"
+    "Input on stdin is <value><TAB><label> per line, like from \"du\".\n"
+    "Labels that are paths are shown as a tree, use the arrow keys to\n"
+    "select a box, Enter to go into it, Backspace to go back and Q to quit.\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int n, max_y, max_x, selected, interval, wait;
+  tree_node_t *root, *view, *reloaded, *node;
+  char text[TEXT_MAX + 1];
+  source_type_t source_type;
+  char *source;
+  time_t next_reload;
+  int c;
+  static struct option long_options[] = {
+    {"help",     no_argument,       0, 'h'},
+    {"scan",     required_argument, 0, 's'},
+    {"file",     required_argument, 0, 'f'},
+    {"command",  required_argument, 0, 'c'},
+    {"interval", required_argument, 0, 'i'},
+    {0, 0, 0, 0},
+  };
+
+  source_type = SOURCE_STDIN;
+  source = NULL;
+  interval = 0;
+  while ((c = getopt_long(argc, argv, "hs:f:c:i:", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'h':
+      display_help(argv[0]);
+      return 0;
+
+    case 's':
+      source_type = SOURCE_SCAN;
+      source = optarg;
+      break;
+
+    case 'f':
+      source_type = SOURCE_FILE;
+      source = optarg;
+      break;
+
+    case 'c':
+      source_type = SOURCE_COMMAND;
+      source = optarg;
+      break;
+
+    case 'i':
+      interval = atoi(optarg);
+      break;
+
+    case '?':
+    default:
+      display_help(argv[0]);
+      return 1;
     }
   }
 
-  /* Sort to get largest value first. */
-  qsort(data, DATA_MAX, sizeof(data_t), data_compare);
+  if (interval > 0 && source_type == SOURCE_STDIN) {
+    fprintf(stderr, "Error: Cannot reload from stdin, use a file, command or scan.\n");
+    return 1;
+  }
 
-  sum = 0.0;
-  for (i = 0; i < DATA_MAX; i++) {
-    if (data[i].value <= 0.0)
-      break;
-    sum += data[i].value;
+  root = source_load(source_type, source);
+  if (root == NULL) {
+    fprintf(stderr, "Error: Unable to read input.\n");
+    return 1;
   }
 
-  if (sum <= 0.0) {
+  if (root->total <= 0.0) {
+    tree_free(root);
     return 1; /* Will divide by zero, abort. */
   }
 
   screen_init(&max_y, &max_x);
-  max_x -= TEXT_X_AREA;
-
-  used = 0.0;
-  horizontal = start_y = start_x = 0;
-  size_y = max_y;
-  size_x = max_x;
-  for (i = 0; i < DATA_MAX; i++) {
-    if (data[i].value <= 0.0)
-      break;
 
-    share = data[i].value / (sum - used);
-
-    if (horizontal) {
-      size_x = max_x - start_x;
-      size_y = share * (double)(max_y - start_y);
-      box_draw(i, start_y, start_x, size_y, size_x);
-      start_y += size_y;
-      horizontal = 0;
-    } else {
-      size_y = max_y - start_y;
-      size_x = share * (double)(max_x - start_x);
-      box_draw(i, start_y, start_x, size_y, size_x);
-      start_x += size_x;
-      horizontal = 1;
+  view = tree_start(root);
+  selected = 0;
+  next_reload = time(NULL) + interval;
+  while (1) {
+    screen_draw(view, &selected);
+    n = view->no_of_boxes;
+
+    if (interval > 0) {
+      wait = next_reload - time(NULL);
+      timeout((wait > 0) ? wait * 1000 : 0);
     }
 
-    used += data[i].value;
-  }
+    c = getch();
+    switch (c) {
+    case ERR:
+      if (interval <= 0 || time(NULL) < next_reload)
+        break;
+      next_reload = time(NULL) + interval;
+
+      reloaded = source_load(source_type, source);
+      if (reloaded == NULL || reloaded->total <= 0.0) {
+        if (reloaded != NULL)
+          tree_free(reloaded);
+        break; /* Keep showing the old data. */
+      }
 
-  for (i = 0; i < DATA_MAX; i++) {
-    if (data[i].value <= 0.0)
+      /* Stay on the same level and box, if they still exist. */
+      text[0] = '\0';
+      if (selected < n)
+        strncpy(text, view->box[selected].text, sizeof(text));
+      node = tree_match(reloaded, view);
+      tree_free(root);
+      root = reloaded;
+      view = (node != NULL) ? node : tree_start(root);
+      selected = box_find(view, text);
       break;
-    text_draw(i, data[i].text, i, max_x + 1);
-  }
 
-  move(0,0);
-  refresh();
-  while (1) {
-    sleep(1); /* Ctrl-C to quit! */
+    case KEY_RESIZE:
+      break; /* Next frame is drawn at the new size. */
+
+    case KEY_UP:
+    case 'k':
+      if (selected > 0)
+        selected--;
+      break;
+
+    case KEY_DOWN:
+    case 'j':
+      if (selected < n - 1)
+        selected++;
+      break;
+
+    case KEY_RIGHT:
+    case KEY_ENTER:
+    case '\n':
+    case '\r':
+    case 'l':
+      if (selected < n && view->box[selected].node != NULL &&
+        view->box[selected].node->no_of_children > 0) {
+        view = view->box[selected].node;
+        selected = 0;
+      }
+      break;
+
+    case KEY_LEFT:
+    case KEY_BACKSPACE:
+    case '\b':
+    case 0x7f:
+    case 'h':
+      if (view->parent != NULL) {
+        /* Keep the box we came from selected. */
+        strncpy(text, view->name, sizeof(text));
+        text[TEXT_MAX] = '\0';
+        view = view->parent;
+        selected = box_find(view, text);
+      }
+      break;
+
+    case 'q':
+    case 'Q':
+      endwin();
+      tree_free(root);
+      free(frame);
+      free(frame_previous);
+      return 0;
+    }
+
   }
 
   return 0;
 }
-
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "data.h"
+#include "tree.h"
+
+static tree_node_t *tree_node_new(tree_node_t *parent, const char *name, size_t len)
+{
+  tree_node_t *new, **child;
+  unsigned int size;
+
+  new = calloc(1, sizeof(tree_node_t));
+  if (new == NULL)
+    return NULL;
+
+  if (name != NULL) {
+    new->name = malloc(len + 1);
+    if (new->name == NULL) {
+      free(new);
+      return NULL;
+    }
+    memcpy(new->name, name, len);
+    new->name[len] = '\0';
+  }
+  new->parent = parent;
+
+  if (parent != NULL) {
+    if (parent->no_of_children >= parent->children_size) {
+      size = (parent->children_size == 0) ? 4 : parent->children_size * 2;
+      child = realloc(parent->child, sizeof(tree_node_t *) * size);
+      if (child == NULL) {
+        free(new->name);
+        free(new);
+        return NULL;
+      }
+      parent->child = child;
+      parent->children_size = size;
+    }
+    parent->child[parent->no_of_children++] = new;
+  }
+
+  return new;
+}
+
+/* Look up the node for a path, creating it and any missing parents. */
+static tree_node_t *tree_node_get(data_table_t *paths, tree_node_t *root,
+  const char *label, size_t len)
+{
+  data_entry_t *entry;
+  tree_node_t *parent, *node;
+  size_t p;
+
+  while (len > 1 && label[len - 1] == '/')
+    len--;
+  if (len == 0)
+    return root;
+
+  entry = data_table_insert(paths, label, len);
+  if (entry == NULL)
+    return NULL;
+  if (entry->ptr != NULL)
+    return entry->ptr;
+
+  for (p = len; p > 0; p--) {
+    if (label[p - 1] == '/')
+      break;
+  }
+
+  if (p == 0) {
+    parent = root; /* No slash, top-level. */
+    node = tree_node_new(parent, label, len);
+  } else if (len == 1) {
+    parent = root; /* The "/" directory itself. */
+    node = tree_node_new(parent, label, len);
+  } else {
+    parent = tree_node_get(paths, root, label, (p == 1) ? 1 : p - 1);
+    if (parent == NULL)
+      return NULL;
+    node = tree_node_new(parent, &label[p], len - p);
+  }
+  if (node == NULL)
+    return NULL;
+
+  /* Table may have grown while parents were added, look up again. */
+  entry = data_table_insert(paths, label, len);
+  if (entry == NULL)
+    return NULL;
+  entry->ptr = node;
+
+  return node;
+}
+
+static double tree_total(tree_node_t *node)
+{
+  unsigned int i;
+  double sum;
+
+  sum = 0.0;
+  for (i = 0; i < node->no_of_children; i++) {
+    sum += tree_total(node->child[i]);
+  }
+
+  /* Input like du already includes the children in a directory value. */
+  node->total = (node->value > sum) ? node->value : sum;
+  return node->total;
+}
+
+tree_node_t *tree_build(data_table_t *table)
+{
+  data_table_t paths;
+  tree_node_t *root, *node;
+  size_t i;
+
+  root = tree_node_new(NULL, NULL, 0);
+  if (root == NULL)
+    return NULL;
+
+  if (data_table_init(&paths) != 0) {
+    tree_free(root);
+    return NULL;
+  }
+
+  for (i = 0; i < table->size; i++) {
+    if (table->entry[i].label == NULL)
+      continue;
+    node = tree_node_get(&paths, root, table->entry[i].label,
+      strlen(table->entry[i].label));
+    if (node == NULL) {
+      data_table_free(&paths);
+      tree_free(root);
+      return NULL;
+    }
+    node->value += table->entry[i].value;
+  }
+
+  data_table_free(&paths);
+  tree_total(root);
+
+  return root;
+}
+
+void tree_free(tree_node_t *node)
+{
+  unsigned int i;
+
+  for (i = 0; i < node->no_of_children; i++) {
+    tree_free(node->child[i]);
+  }
+  free(node->child);
+  free(node->box);
+  free(node->name);
+  free(node);
+}
+
+/* Skip levels with only a single child, like "." or "/" from du. */
+tree_node_t *tree_start(tree_node_t *root)
+{
+  while (root->no_of_children == 1 && root->child[0]->no_of_children > 0 &&
+    root->child[0]->total >= root->total) {
+    root = root->child[0];
+  }
+  return root;
+}
+
+/* Find the node with the same path in another tree, or NULL. */
+tree_node_t *tree_match(tree_node_t *root, tree_node_t *node)
+{
+  tree_node_t *parent;
+  unsigned int i;
+
+  if (node->parent == NULL)
+    return root;
+
+  parent = tree_match(root, node->parent);
+  if (parent == NULL)
+    return NULL;
+
+  for (i = 0; i < parent->no_of_children; i++) {
+    if (strcmp(parent->child[i]->name, node->name) == 0)
+      return parent->child[i];
+  }
+
+  return NULL;
+}
+
+char *tree_path(tree_node_t *node, char *path, int path_len)
+{
+  int len;
+
+  if (node->parent == NULL) {
+    path[0] = '\0';
+    return path;
+  }
+
+  tree_path(node->parent, path, path_len);
+  len = strlen(path);
+  if (len > 0 && path[len - 1] != '/') {
+    snprintf(&path[len], path_len - len, "/%s", node->name);
+  } else {
+    snprintf(&path[len], path_len - len, "%s", node->name);
+  }
+
+  return path;
+}
+
+static void tree_heap_sift_down(tree_node_t **heap, int size, int i)
+{
+  int child;
+  tree_node_t *temp;
+
+  while ((child = (i * 2) + 1) < size) {
+    if (child + 1 < size && heap[child + 1]->total < heap[child]->total)
+      child++;
+    if (heap[i]->total <= heap[child]->total)
+      break;
+    temp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = temp;
+    i = child;
+  }
+}
+
+static void tree_heap_sift_up(tree_node_t **heap, int i)
+{
+  int parent;
+  tree_node_t *temp;
+
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (heap[parent]->total <= heap[i]->total)
+      break;
+    temp = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = temp;
+    i = parent;
+  }
+}
+
+static int tree_box_compare(const void *p1, const void *p2)
+{
+  double v1, v2;
+
+  v1 = ((tree_box_t *)p1)->value;
+  v2 = ((tree_box_t *)p2)->value;
+  if (v1 > v2)
+    return -1;
+  if (v1 < v2)
+    return 1;
+  return 0;
+}
+
+static void tree_box_set(tree_box_t *box, tree_node_t *node, const char *text,
+  double value)
+{
+  box->node = node;
+  box->value = value;
+  strncpy(box->text, text, TEXT_MAX);
+  box->text[TEXT_MAX] = '\0';
+}
+
+/* Pick the largest children with a heap, so the cost is independent of how
+   many children are too small to get a box of their own. */
+static int tree_boxes_select(tree_node_t *node, tree_box_t *box, int max)
+{
+  tree_node_t **heap;
+  unsigned int i;
+  int heap_size, k, n, positive;
+  double other, files;
+
+  files = node->total;
+  positive = 0;
+  for (i = 0; i < node->no_of_children; i++) {
+    files -= node->child[i]->total;
+    if (node->child[i]->total > 0.0)
+      positive++;
+  }
+  if (files < node->total * 1e-9)
+    files = 0.0; /* Only rounding left. */
+  if (files > 0.0)
+    max--;
+
+  k = (positive > max) ? max - 1 : positive;
+  heap = malloc(sizeof(tree_node_t *) * (k + 1));
+  if (heap == NULL)
+    return -1;
+
+  heap_size = 0;
+  other = 0.0;
+  for (i = 0; i < node->no_of_children; i++) {
+    if (node->child[i]->total <= 0.0)
+      continue;
+
+    if (heap_size < k) {
+      heap[heap_size] = node->child[i];
+      tree_heap_sift_up(heap, heap_size);
+      heap_size++;
+    } else if (k > 0 && node->child[i]->total > heap[0]->total) {
+      other += heap[0]->total;
+      heap[0] = node->child[i];
+      tree_heap_sift_down(heap, heap_size, 0);
+    } else {
+      other += node->child[i]->total;
+    }
+  }
+
+  n = 0;
+  for (i = 0; i < heap_size; i++) {
+    tree_box_set(&box[n++], heap[i], heap[i]->name, heap[i]->total);
+  }
+  free(heap);
+
+  if (other > 0.0)
+    tree_box_set(&box[n++], NULL, "*OTHER*", other);
+  if (files > 0.0)
+    tree_box_set(&box[n++], NULL, "*FILES*", files);
+
+  qsort(box, n, sizeof(tree_box_t), tree_box_compare);
+  return n;
+}
+
+static double tree_worst(double side, double sum, double largest, double smallest)
+{
+  double a, b;
+
+  a = (side * side * largest) / (sum * sum);
+  b = (sum * sum) / (side * side * smallest);
+  return (a > b) ? a : b;
+}
+
+static void tree_box_place(tree_box_t *box, double y, double x,
+  double size_y, double size_x)
+{
+  /* Layout is done with square cells, a character is about twice as high
+     as it is wide, so widths are doubled when converting. */
+  box->y = lround(y);
+  box->x = lround(x * 2.0);
+  box->size_y = lround(y + size_y) - box->y;
+  box->size_x = lround((x + size_x) * 2.0) - box->x;
+}
+
+/* Squarified treemap, boxes must be sorted largest first. */
+static void tree_squarify(tree_box_t *box, int n, int size_y, int size_x)
+{
+  double y, x, h, w, side, sum, row_sum, worst, next, t, pos;
+  double *area;
+  int i, j, k;
+
+  area = malloc(sizeof(double) * n);
+  if (area == NULL)
+    return;
+
+  y = x = 0.0;
+  h = size_y;
+  w = size_x / 2.0;
+
+  sum = 0.0;
+  for (i = 0; i < n; i++)
+    sum += box[i].value;
+  for (i = 0; i < n; i++)
+    area[i] = box[i].value / sum * h * w;
+
+  i = 0;
+  while (i < n) {
+    side = (w < h) ? w : h;
+
+    /* Grow the row while the worst aspect ratio keeps improving. */
+    row_sum = area[i];
+    worst = tree_worst(side, row_sum, area[i], area[i]);
+    for (j = i + 1; j < n; j++) {
+      next = tree_worst(side, row_sum + area[j], area[i], area[j]);
+      if (next > worst)
+        break;
+      row_sum += area[j];
+      worst = next;
+    }
+
+    /* Place the row along the shorter side. */
+    t = (side > 0.0) ? row_sum / side : 0.0;
+    pos = 0.0;
+    for (k = i; k < j; k++) {
+      if (w >= h) {
+        tree_box_place(&box[k], y + pos, x, area[k] / t, t);
+        pos += area[k] / t;
+      } else {
+        tree_box_place(&box[k], y, x + pos, t, area[k] / t);
+        pos += area[k] / t;
+      }
+    }
+    if (w >= h) {
+      x += t;
+      w -= t;
+    } else {
+      y += t;
+      h -= t;
+    }
+
+    i = j;
+  }
+
+  free(area);
+}
+
+/* Compute boxes for one level, unless already done for this size. */
+int tree_layout(tree_node_t *node, int size_y, int size_x)
+{
+  int max;
+
+  if (node->box != NULL &&
+    node->layout_y == size_y && node->layout_x == size_x)
+    return node->no_of_boxes;
+
+  free(node->box);
+  node->no_of_boxes = 0;
+
+  max = (size_y < TREE_BOX_MAX) ? size_y : TREE_BOX_MAX;
+  if (max < 2)
+    max = 2;
+
+  node->box = malloc(sizeof(tree_box_t) * max);
+  if (node->box == NULL)
+    return -1;
+
+  node->no_of_boxes = tree_boxes_select(node, node->box, max);
+  if (node->no_of_boxes < 0) {
+    node->no_of_boxes = 0;
+    return -1;
+  }
+
+  if (node->no_of_boxes > 0)
+    tree_squarify(node->box, node->no_of_boxes, size_y, size_x);
+
+  node->layout_y = size_y;
+  node->layout_x = size_x;
+  return node->no_of_boxes;
+}
@@ -0,0 +1,40 @@
+#ifndef _TREE_H
+#define _TREE_H
+
+#include "data.h"
+
+#define TEXT_X_AREA 20
+#define TEXT_MAX TEXT_X_AREA - 3
+#define TREE_BOX_MAX 52 /* One letter per box, A-Z and a-z. */
+
+struct tree_node_s;
+
+typedef struct tree_box_s {
+  double value;
+  char text[TEXT_MAX + 1];
+  struct tree_node_s *node; /* NULL for the "*OTHER*" and "*FILES*" boxes. */
+  int y, x, size_y, size_x;
+} tree_box_t;
+
+typedef struct tree_node_s {
+  char *name;
+  double value; /* As given by the input, if at all. */
+  double total; /* Value, or sum of children if that is larger. */
+  struct tree_node_s *parent;
+  unsigned int no_of_children;
+  unsigned int children_size;
+  struct tree_node_s **child;
+  /* Layout, only computed once the level is viewed. */
+  tree_box_t *box;
+  int no_of_boxes;
+  int layout_y, layout_x;
+} tree_node_t;
+
+tree_node_t *tree_build(data_table_t *table);
+void tree_free(tree_node_t *node);
+tree_node_t *tree_start(tree_node_t *root);
+tree_node_t *tree_match(tree_node_t *root, tree_node_t *node);
+int tree_layout(tree_node_t *node, int size_y, int size_x);
+char *tree_path(tree_node_t *node, char *path, int path_len);
+
+#endif /* _TREE_H */